@@ -3,9 +3,15 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // format of a coord in the native file
 typedef struct {
@@ -26,12 +32,52 @@ typedef struct
     uint16_t attr;
 } __attribute__((packed)) stl_triangle_t;
 
+// an indexed triangle mesh.  Each triangle is 3 indexes in the vertices.
+typedef struct
+{
+    vector_t *vertices;
+    int vertex_count;
+    int vertex_allocated;
+    int *indices;
+    int triangle_count;
+    int triangle_allocated;
+// from build_adjacency.  The triangle across each edge or -1.
+    int *neighbors;
+// the triangles using each vertex
+    int *vertex_start;
+    int *vertex_triangles;
+} mesh_t;
+
+// An STL file which several threads can write at once.  Each thread fills
+// its own chunk of triangles.  A full chunk reserves its place in the file
+// by atomically adding to the offset & is written with pwrite, so the chunks
+// of different threads land in any order.  The triangle count is written
+// by close_stl_writer after all the chunks are flushed.
+typedef struct
+{
+    int fd;
+    int64_t offset;
+    int count;
+    int error;
+} stl_writer_t;
+
+// triangles buffered by 1 thread
+typedef struct
+{
+    stl_writer_t *writer;
+    stl_triangle_t *triangles;
+    int count;
+} stl_chunk_t;
+
 #define TEXTLEN 1024
 #define BUFSIZE 1024
+#define STL_HEADER_SIZE 80
 #define HEADER "MESH-MESH-MESH-MESH-MESH-MESH-MESH-MESH-MESH-MESH-MESH-MESH-MESH-MESH-MESH-MESH\n"
-FILE *out;
-int countOffset = 0;
+#define CHUNK_TRIANGLES 65536
 int triangleCount = 0;
+// the file written by open_stl, writeTriangle & close_stl
+stl_writer_t stlWriter;
+stl_chunk_t stlChunk;
 
 double length = 0;
 // radians
@@ -46,52 +92,144 @@ double sinPlane = 0.0;
 
 void writeTriangle(vector_t coord0, vector_t coord1, vector_t coord2);
 void writeTriangle2(vector_t coord0, vector_t coord1, vector_t coord2);
+vector_t triangleNormal(vector_t coord0, vector_t coord1, vector_t coord2);
 
-void writeInt32(int x)
+// returns 1 on failure
+int pwrite_all(int fd, const void *data, int64_t size, int64_t offset)
 {
-    fwrite(&x, 1, sizeof(int), out);
+    const uint8_t *ptr = (const uint8_t*)data;
+    while(size > 0)
+    {
+        ssize_t result = pwrite(fd, ptr, size, offset);
+        if(result <= 0)
+        {
+            perror("pwrite_all");
+            return 1;
+        }
+        ptr += result;
+        size -= result;
+        offset += result;
+    }
+    return 0;
 }
 
-void writeFloat(float x)
+// returns 1 on failure
+int open_stl_writer(stl_writer_t *writer, const char *path)
 {
-    fwrite(&x, 1, sizeof(float), out);
+    uint8_t header[STL_HEADER_SIZE + sizeof(int)];
+    memset(writer, 0, sizeof(stl_writer_t));
+    if((writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        printf("open_stl_writer %d: Couldn't open %s\n", __LINE__, path);
+        perror("");
+        return 1;
+    }
+
+// the count is 0 until close_stl_writer
+    memset(header, 0, sizeof(header));
+    memcpy(header, HEADER, strlen(HEADER));
+    writer->error = pwrite_all(writer->fd, header, sizeof(header), 0);
+    writer->offset = sizeof(header);
+    return writer->error;
 }
 
+void init_stl_chunk(stl_chunk_t *chunk, stl_writer_t *writer)
+{
+    chunk->writer = writer;
+    chunk->triangles = (stl_triangle_t*)malloc(sizeof(stl_triangle_t) * CHUNK_TRIANGLES);
+    chunk->count = 0;
+}
 
-double toRad(double angle)
+void flush_stl_chunk(stl_chunk_t *chunk)
 {
-    return angle * M_PI * 2.0 / 360.0;
+    if(chunk->count > 0)
+    {
+        stl_writer_t *writer = chunk->writer;
+        int64_t size = (int64_t)sizeof(stl_triangle_t) * chunk->count;
+        int64_t offset = __sync_fetch_and_add(&writer->offset, size);
+        if(pwrite_all(writer->fd, chunk->triangles, size, offset))
+        {
+            writer->error = 1;
+        }
+        __sync_fetch_and_add(&writer->count, chunk->count);
+        chunk->count = 0;
+    }
 }
 
-double hypot3(double x, double y, double z)
+// flushes the remaining triangles
+void free_stl_chunk(stl_chunk_t *chunk)
 {
-    return sqrt(x * x + y * y + z * z);
+    flush_stl_chunk(chunk);
+    free(chunk->triangles);
+    chunk->triangles = 0;
 }
 
-int open_stl(char *path)
+void chunk_triangle(stl_chunk_t *chunk, vector_t coord0, vector_t coord1, vector_t coord2)
+{
+    stl_triangle_t *triangle = &chunk->triangles[chunk->count++];
+    triangle->n = triangleNormal(coord0, coord1, coord2);
+    triangle->coords[0] = coord0;
+    triangle->coords[1] = coord1;
+    triangle->coords[2] = coord2;
+    triangle->attr = 0;
+    if(chunk->count >= CHUNK_TRIANGLES)
+    {
+        flush_stl_chunk(chunk);
+    }
+}
+
+// All the chunks must be flushed.  Returns 1 on failure.
+int close_stl_writer(stl_writer_t *writer)
+{
+    if(pwrite_all(writer->fd, &writer->count, sizeof(int), STL_HEADER_SIZE))
+    {
+        writer->error = 1;
+    }
+    if(close(writer->fd))
+    {
+        writer->error = 1;
+    }
+    writer->fd = -1;
+    return writer->error;
+}
+
+void confirm_overwrite(const char *path)
 {
-    if((out = fopen(path, "r")))
+    FILE *in;
+    if((in = fopen(path, "r")))
     {
         printf("Overwrite existing file %s? (y/n)\n", path);
         char string[TEXTLEN];
         char* _ = fgets(string, TEXTLEN, stdin);
-        if(strcmp(string, "y\n"))
+        if(!_ || strcmp(string, "y\n"))
         {
             printf("Giving up & going to a movie.\n");
     		exit(1);
         }
-        fclose(out);
+        fclose(in);
     }
+}
+
+
+double toRad(double angle)
+{
+    return angle * M_PI * 2.0 / 360.0;
+}
+
+double hypot3(double x, double y, double z)
+{
+    return sqrt(x * x + y * y + z * z);
+}
 
-    if(!(out = fopen(path, "w")))
+int open_stl(char *path)
+{
+    confirm_overwrite(path);
+    if(open_stl_writer(&stlWriter, path))
     {
         printf("open_stl %d: Couldn't open %s\n", __LINE__, path);
         exit(1);
     }
-
-    fprintf(out, HEADER);
-    countOffset = ftell(out);
-    writeInt32(0);
+    init_stl_chunk(&stlChunk, &stlWriter);
 
 
     cosPlane = cos(planeAngle);
@@ -101,388 +239,2113 @@ int open_stl(char *path)
     return 0;
 }
 
-stl_triangle_t* read_stl(const char *path, int *count)
+int has_extension(const char *path, const char *extension)
 {
-    FILE *in;
-    uint8_t buffer[BUFSIZE];
-    *count = 0;
-    if(!(in = fopen(path, "r")))
-    {
-        printf("read_stl %d: Couldn't open %s\n", __LINE__, path);
-        perror("");
-        return 0;
-    }
-    
-    int _ = fread(buffer, 1, strlen(HEADER), in);
-    _ = fread(count, 1, sizeof(int), in);
-    stl_triangle_t *triangles = (stl_triangle_t*)calloc(sizeof(stl_triangle_t), *count);
-    _ = fread(triangles, sizeof(stl_triangle_t), *count, in);
-    printf("read_stl %d: %d triangles\n", __LINE__, *count);
-    
-    fclose(in);
-    return triangles;
+    int len1 = strlen(path);
+    int len2 = strlen(extension);
+    return len1 >= len2 && !strcasecmp(path + len1 - len2, extension);
 }
 
-void write_stl(char *path, int count, stl_triangle_t *triangles)
+// map a whole file for reading.  Returns 0 on failure.
+uint8_t* map_file(const char *path, int64_t *size)
 {
-    if((out = fopen(path, "r")))
+    int fd;
+    struct stat st;
+    *size = 0;
+    if((fd = open(path, O_RDONLY)) < 0)
     {
-        printf("Overwrite existing file %s? (y/n)\n", path);
-        char string[TEXTLEN];
-        char* _ = fgets(string, TEXTLEN, stdin);
-        if(strcmp(string, "y\n"))
-        {
-            printf("Giving up & going to a movie.\n");
-    		exit(1);
-        }
-        fclose(out);
+        printf("map_file %d: Couldn't open %s\n", __LINE__, path);
+        perror("");
+        return 0;
     }
 
-    if(!(out = fopen(path, "w")))
+    if(fstat(fd, &st) < 0 || st.st_size == 0)
     {
-        printf("open_stl %d: Couldn't open %s\n", __LINE__, path);
-        exit(1);
+        printf("map_file %d: %s is empty\n", __LINE__, path);
+        close(fd);
+        return 0;
     }
 
-    fprintf(out, HEADER);
-    writeInt32(count);
-    int i;
-    for(i = 0; i < count; i++)
+    uint8_t *data = (uint8_t*)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
     {
-        stl_triangle_t *triangle = &triangles[i];
-        writeTriangle(triangle->coords[0], 
-            triangle->coords[1], 
-            triangle->coords[2]);
+        printf("map_file %d: Couldn't map %s\n", __LINE__, path);
+        perror("");
+        return 0;
     }
 
-//    fwrite(triangles, sizeof(stl_triangle_t), count, out);
-    fclose(out);
+    *size = st.st_size;
+    return data;
 }
 
+// skip spaces on the current line
+const char* skip_blanks(const char *ptr, const char *end)
+{
+    while(ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\r'))
+    {
+        ptr++;
+    }
+    return ptr;
+}
 
-
-
-void close_stl()
+// skip spaces & newlines
+const char* skip_space(const char *ptr, const char *end)
 {
-    fseek(out, countOffset, SEEK_SET);
-    printf("close_stl %d: triangleCount=%d\n", __LINE__, triangleCount);
-    writeInt32(triangleCount);
-    fclose(out);
+    while(ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n'))
+    {
+        ptr++;
+    }
+    return ptr;
 }
 
-vector_t polarToXYZ(vector_t point)
+// go to the start of the next line
+const char* skip_line(const char *ptr, const char *end)
 {
-// polar to XYZ
-    double angle = point.x;
-    double radius = point.y;
-    double z = point.z;
-    double x = radius * cos(angle);
-    double y = -radius * sin(angle);
-// printf("polarToXYZ %d %f %f %f -> %f %f %f\n", 
-//     __LINE__, 
-//     point.x,
-//     point.y,
-//     point.z,
-//     x,
-//     y,
-//     z);
-// 
+    while(ptr < end && *ptr != '\n')
+    {
+        ptr++;
+    }
+    if(ptr < end)
+    {
+        ptr++;
+    }
+    return ptr;
+}
 
-    if(fabs(planeAngle) > 0.001)
+const char* token_end(const char *ptr, const char *end)
+{
+    while(ptr < end && *ptr != ' ' && *ptr != '\t' && *ptr != '\r' && *ptr != '\n')
     {
-// x slope given x
-// rotate top X of cylinder
-        double topX = x * cosPlane;
-// rotate top Z of cylinder
-        double topZ = planeIntercept + x * sinPlane;
-        double slope = (topX - x) / topZ;
-// interpolate X
-        x += z * slope;
+        ptr++;
     }
+    return ptr;
+}
 
-    return (vector_t){ x, y, z };
+// test if the token at ptr is the text
+int token_is(const char *ptr, const char *end, const char *text)
+{
+    const char *next = token_end(ptr, end);
+    return next - ptr == (ptrdiff_t)strlen(text) && !memcmp(ptr, text, next - ptr);
 }
 
+// copy the token at ptr to a string
+const char* copy_token(const char *ptr, const char *end, char *dst, int size)
+{
+    ptr = skip_blanks(ptr, end);
+    const char *next = token_end(ptr, end);
+    int len = next - ptr;
+    if(len > size - 1)
+    {
+        len = size - 1;
+    }
+    memcpy(dst, ptr, len);
+    dst[len] = 0;
+    return next;
+}
 
-vector_t XYZToPolar(vector_t xyz)
+// Parse a number on the current line.  Hand rolled because sscanf & strtod
+// dominated the load time of big text files.  Returns 1 if a number was
+// parsed.
+int parse_double(const char **ptr, const char *end, double *result)
 {
-    double aspect = 1.0;
-    if(fabs(topAspect - 1.0) > 0.001)
+    static const double powers[] = 
     {
-        double fraction = xyz.z / length;
-        aspect = (topAspect * fraction) + (1.0 - fraction);
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *p = skip_blanks(*ptr, end);
+    int negative = 0;
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+
+    if(p < end && (*p == '-' || *p == '+'))
+    {
+        negative = (*p == '-');
+        p++;
     }
-    xyz.x = xyz.x / aspect;
 
-// circularize XY
-    double y = xyz.y;
-    double x = xyz.x;
-    double z = xyz.z;
-    if(fabs(planeAngle) > 0.001)
+    while(p < end && *p >= '0' && *p <= '9')
+    {
+// digits beyond the precision of a double only change the exponent
+        if(mantissa < 1000000000000000000ULL)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+        }
+        else
+        {
+            exponent++;
+        }
+        p++;
+        digits++;
+    }
+
+    if(p < end && *p == '.')
     {
-// brute force
-        double step = fabs(x) / 2;
-        double goalX = x;
-        while(step > 0.0001)
-//        while(step > 1)
-        {
-            double topX = x * cosPlane;
-            double topZ = planeIntercept + x * sinPlane;
-            double slope = (topX - x) / topZ;
-            double testX = x + z * slope;
-//printf("XYZToPolar %d testX=%f x=%f\n", __LINE__, testX, x);
-            if(testX < goalX)
+        p++;
+        while(p < end && *p >= '0' && *p <= '9')
+        {
+            if(mantissa < 1000000000000000000ULL)
             {
-                x += step;
+                mantissa = mantissa * 10 + (*p - '0');
+                exponent--;
             }
-            else
+            p++;
+            digits++;
+        }
+    }
+
+    if(!digits)
+    {
+        return 0;
+    }
+
+    if(p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char *q = p + 1;
+        int exp_negative = 0;
+        int value = 0;
+        if(q < end && (*q == '-' || *q == '+'))
+        {
+            exp_negative = (*q == '-');
+            q++;
+        }
+
+        if(q < end && *q >= '0' && *q <= '9')
+        {
+            while(q < end && *q >= '0' && *q <= '9')
             {
-                x -= step;
+                if(value < 10000)
+                {
+                    value = value * 10 + (*q - '0');
+                }
+                q++;
             }
-            
-            step /= 2;
+            exponent += exp_negative ? -value : value;
+            p = q;
         }
     }
-    
-// convert XY to angle & radius
-    double angle = atan2(-y, x);
-    double radius = hypot(x, y);
-// printf("polarToXYZ %d %f %f %f -> %f %f %f\n", 
-//     __LINE__, 
-//     xyz.x,
-//     xyz.y,
-//     xyz.z,
-//     angle,
-//     radius,
-//     z);
 
-    return (vector_t){ angle, radius, z };
-}
+    double value = mantissa;
+    if(exponent < 0)
+    {
+        value /= (-exponent < 23) ? powers[-exponent] : pow(10, -exponent);
+    }
+    else
+    if(exponent > 0)
+    {
+        value *= (exponent < 23) ? powers[exponent] : pow(10, exponent);
+    }
 
-vector_t addVectors(vector_t a, vector_t b)
-{
-	return (vector_t){ a.x + b.x, a.y + b.y, a.z + b.z };
-}
- 
-vector_t subVectors(vector_t a, vector_t b)
-{
-	return (vector_t){ a.x - b.x, a.y - b.y, a.z - b.z };
+    *result = negative ? -value : value;
+    *ptr = p;
+    return 1;
 }
 
-vector_t crossProduct(vector_t a, vector_t b)
+int parse_int(const char **ptr, const char *end, int *result)
 {
-    vector_t result;
-	result.x = a.y * b.z - a.z * b.y;
-	result.y = a.z * b.x - a.x * b.z;
-	result.z = a.x * b.y - a.y * b.x;
-    return result;
-}
+    const char *p = skip_blanks(*ptr, end);
+    int negative = 0;
+    int value = 0;
+    if(p < end && (*p == '-' || *p == '+'))
+    {
+        negative = (*p == '-');
+        p++;
+    }
 
-double magnitude(vector_t a)
-{
-    return sqrt(a.x * a.x + a.y * a.y + a.z * a.z);
-}
+    if(p >= end || *p < '0' || *p > '9')
+    {
+        return 0;
+    }
 
-vector_t normalize(vector_t a)
-{
-    double m = magnitude(a);
-    return (vector_t){ a.x / m, a.y / m, a.z / m };
-}
+    while(p < end && *p >= '0' && *p <= '9')
+    {
+        value = value * 10 + (*p - '0');
+        p++;
+    }
 
-double dotProduct(vector_t a, vector_t b)
-{
-	return a.x * b.x + a.y * b.y + a.z * b.z;
+    *result = negative ? -value : value;
+    *ptr = p;
+    return 1;
 }
 
-vector_t scaleVector(double l, vector_t a)
+int parse_vector(const char **ptr, const char *end, vector_t *result)
 {
-	return (vector_t){ l * a.x, l * a.y, l * a.z };
+    double x, y, z;
+    if(!parse_double(ptr, end, &x) ||
+        !parse_double(ptr, end, &y) ||
+        !parse_double(ptr, end, &z))
+    {
+        return 0;
+    }
+    result->x = x;
+    result->y = y;
+    result->z = z;
+    return 1;
 }
 
-// does the line intersect the plane?
-int intersect(vector_t lineVector, vector_t planeNormal)
+// ASCII files start with solid but so do some binary headers, so a binary
+// file is recognized by its size
+int is_ascii_stl(const uint8_t *data, int64_t size)
 {
-    if(dotProduct(lineVector, planeNormal) == 0)
+    const char *end = (const char*)data + size;
+    const char *ptr = skip_space((const char*)data, end);
+    if(!token_is(ptr, end, "solid"))
     {
         return 0;
     }
-    else
+
+    int64_t header_size = STL_HEADER_SIZE + sizeof(int);
+    if(size >= header_size)
     {
-        return 1;
+        uint32_t count;
+        memcpy(&count, data + STL_HEADER_SIZE, sizeof(int));
+        if(header_size + (int64_t)count * (int64_t)sizeof(stl_triangle_t) == size)
+        {
+            return 0;
+        }
     }
+    return 1;
 }
 
-// point where line intersects plane.  Not reliable.
-vector_t intersectionPoint(vector_t lineVector, 
-    vector_t linePoint, 
-    vector_t planeNormal, 
-    vector_t planePoint)
+stl_triangle_t* read_ascii_stl(const char *path, const char *data, int64_t size, int *count)
 {
-	vector_t diff = subVectors(linePoint,planePoint);
- 
-	return addVectors(addVectors(diff,planePoint),
-        scaleVector(
-            -dotProduct(diff,planeNormal) / 
-                dotProduct(lineVector,planeNormal),
-            lineVector));
-}
+    const char *ptr = data;
+    const char *end = data + size;
+    int allocated = 1024;
+    int vertices = 0;
+    int skipped = 0;
+    stl_triangle_t *triangles = (stl_triangle_t*)malloc(sizeof(stl_triangle_t) * allocated);
+    stl_triangle_t current;
+    memset(&current, 0, sizeof(current));
+    *count = 0;
 
-// brute force intersection between line & plane
-vector_t intersectionPoint2(vector_t xyz1, 
-    vector_t xyz2, 
-    double planeIntercept, 
-    double planeSlope)
-{
-    double testFraction = 0.5;
-    double step = 0.5;
-    vector_t testPoint;
-    vector_t diff = subVectors(xyz2, xyz1);
-    while(step > 0.0001)
+    while(1)
     {
-        testPoint = addVectors(xyz1, 
-            scaleVector(testFraction, diff));
-        double testZ = planeIntercept + testPoint.x * planeSlope;
-        step /= 2;
-        if(testPoint.z > testZ)
+        ptr = skip_space(ptr, end);
+        if(ptr >= end)
         {
-            testFraction -= step;
+            break;
         }
-        else
+
+        if(token_is(ptr, end, "facet"))
+        {
+// skip the normal keyword
+            ptr = skip_blanks(token_end(ptr, end), end);
+            ptr = token_end(ptr, end);
+            vector_t n = { 0, 0, 0 };
+            parse_vector(&ptr, end, &n);
+            memset(&current, 0, sizeof(current));
+            current.n = n;
+            vertices = 0;
+        }
+        else
+        if(token_is(ptr, end, "vertex"))
+        {
+            vector_t point;
+            ptr = token_end(ptr, end);
+            if(parse_vector(&ptr, end, &point) && vertices < 3)
+            {
+                current.coords[vertices] = point;
+            }
+            vertices++;
+        }
+        else
+        if(token_is(ptr, end, "endfacet"))
+        {
+            ptr = token_end(ptr, end);
+            if(vertices == 3)
+            {
+                if(*count >= allocated)
+                {
+                    allocated *= 2;
+                    triangles = (stl_triangle_t*)realloc(triangles, 
+                        sizeof(stl_triangle_t) * allocated);
+                }
+                triangles[(*count)++] = current;
+            }
+            else
+            {
+                skipped++;
+            }
+            vertices = 0;
+        }
+        else
+        {
+            ptr = token_end(ptr, end);
+        }
+    }
+
+    if(skipped)
+    {
+        printf("read_stl %d: %s skipped %d facets without 3 vertices\n", 
+            __LINE__, 
+            path, 
+            skipped);
+    }
+    return triangles;
+}
+
+// read a binary or ASCII STL file
+stl_triangle_t* read_stl_file(const char *path, int *count)
+{
+    int64_t size;
+    *count = 0;
+    uint8_t *data = map_file(path, &size);
+    if(!data)
+    {
+        return 0;
+    }
+
+    stl_triangle_t *triangles;
+    int header_size = STL_HEADER_SIZE + sizeof(int);
+    if(is_ascii_stl(data, size))
+    {
+        triangles = read_ascii_stl(path, (const char*)data, size, count);
+    }
+    else
+    if(size < header_size)
+    {
+        printf("read_stl %d: %s is too short\n", __LINE__, path);
+        munmap(data, size);
+        return 0;
+    }
+    else
+    {
+// don't trust the count beyond the end of the file
+        uint32_t file_count;
+        memcpy(&file_count, data + STL_HEADER_SIZE, sizeof(int));
+        int64_t available = (size - header_size) / sizeof(stl_triangle_t);
+        if(file_count > available)
+        {
+            printf("read_stl %d: %s has %d triangles but claims %u\n", 
+                __LINE__, 
+                path, 
+                (int)available, 
+                file_count);
+            file_count = available;
+        }
+
+        *count = file_count;
+        triangles = (stl_triangle_t*)malloc(sizeof(stl_triangle_t) * *count);
+        memcpy(triangles, data + header_size, sizeof(stl_triangle_t) * *count);
+    }
+
+    munmap(data, size);
+    printf("read_stl %d: %d triangles\n", __LINE__, *count);
+    return triangles;
+}
+
+void init_mesh(mesh_t *mesh)
+{
+    memset(mesh, 0, sizeof(mesh_t));
+}
+
+void free_adjacency(mesh_t *mesh);
+
+void free_mesh(mesh_t *mesh)
+{
+    free(mesh->vertices);
+    free(mesh->indices);
+    free_adjacency(mesh);
+    init_mesh(mesh);
+}
+
+int mesh_add_vertex(mesh_t *mesh, vector_t point)
+{
+    if(mesh->vertex_count >= mesh->vertex_allocated)
+    {
+        mesh->vertex_allocated = mesh->vertex_allocated ? mesh->vertex_allocated * 2 : 1024;
+        mesh->vertices = (vector_t*)realloc(mesh->vertices, 
+            sizeof(vector_t) * mesh->vertex_allocated);
+    }
+    mesh->vertices[mesh->vertex_count] = point;
+    return mesh->vertex_count++;
+}
+
+void mesh_add_triangle(mesh_t *mesh, int a, int b, int c)
+{
+    if(mesh->triangle_count >= mesh->triangle_allocated)
+    {
+        mesh->triangle_allocated = mesh->triangle_allocated ? mesh->triangle_allocated * 2 : 1024;
+        mesh->indices = (int*)realloc(mesh->indices, 
+            sizeof(int) * 3 * mesh->triangle_allocated);
+    }
+    int *triangle = &mesh->indices[mesh->triangle_count * 3];
+    triangle[0] = a;
+    triangle[1] = b;
+    triangle[2] = c;
+    mesh->triangle_count++;
+}
+
+// drop triangles with indexes outside the vertices
+void check_mesh(mesh_t *mesh, const char *path)
+{
+    int i, j;
+    int dst = 0;
+    for(i = 0; i < mesh->triangle_count; i++)
+    {
+        int *triangle = &mesh->indices[i * 3];
+        for(j = 0; j < 3; j++)
+        {
+            if(triangle[j] < 0 || triangle[j] >= mesh->vertex_count)
+            {
+                break;
+            }
+        }
+
+        if(j == 3)
+        {
+            memmove(&mesh->indices[dst * 3], triangle, sizeof(int) * 3);
+            dst++;
+        }
+    }
+
+    if(dst < mesh->triangle_count)
+    {
+        printf("check_mesh %d: %s has %d triangles with bad vertex indexes\n", 
+            __LINE__, 
+            path, 
+            mesh->triangle_count - dst);
+        mesh->triangle_count = dst;
+    }
+}
+
+// Wavefront OBJ.  Only the vertices & faces are used.  Faces with more than
+// 3 vertices are split into a fan.
+int read_obj(const char *path, mesh_t *mesh)
+{
+    int64_t size;
+    const char *data = (const char*)map_file(path, &size);
+    if(!data)
+    {
+        return 1;
+    }
+
+    const char *ptr = data;
+    const char *end = data + size;
+    while(ptr < end)
+    {
+        ptr = skip_blanks(ptr, end);
+        if(token_is(ptr, end, "v"))
+        {
+            vector_t point;
+            ptr++;
+            if(parse_vector(&ptr, end, &point))
+            {
+                mesh_add_vertex(mesh, point);
+            }
+        }
+        else
+        if(token_is(ptr, end, "f"))
+        {
+            int first = -1;
+            int prev = -1;
+            int total = 0;
+            int index;
+            ptr++;
+            while(parse_int(&ptr, end, &index))
+            {
+// skip the texture & normal indexes
+                ptr = token_end(ptr, end);
+// negative indexes are relative to the last vertex
+                index = (index < 0) ? mesh->vertex_count + index : index - 1;
+                if(total == 0)
+                {
+                    first = index;
+                }
+                else
+                if(total >= 2)
+                {
+                    mesh_add_triangle(mesh, first, prev, index);
+                }
+                prev = index;
+                total++;
+            }
+        }
+        ptr = skip_line(ptr, end);
+    }
+
+    munmap((void*)data, size);
+    return 0;
+}
+
+// PLY property types
+#define PLY_TYPES 8
+const char *ply_type_names[] = 
+{
+    "char", "uchar", "short", "ushort", "int", "uint", "float", "double" 
+};
+const char *ply_type_names2[] = 
+{
+    "int8", "uint8", "int16", "uint16", "int32", "uint32", "float32", "float64" 
+};
+const int ply_type_sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+
+#define PLY_ASCII 0
+#define PLY_LITTLE_ENDIAN 1
+#define PLY_BIG_ENDIAN 2
+#define PLY_MAX_ELEMENTS 16
+#define PLY_MAX_PROPERTIES 32
+#define PLY_NAMELEN 64
+typedef struct
+{
+    char name[PLY_NAMELEN];
+    int count;
+    int total_properties;
+    char property_names[PLY_MAX_PROPERTIES][PLY_NAMELEN];
+// type of the value or the items in a list
+    int types[PLY_MAX_PROPERTIES];
+// type of the list size or -1 if not a list
+    int count_types[PLY_MAX_PROPERTIES];
+} ply_element_t;
+
+int ply_type(const char *name)
+{
+    int i;
+    for(i = 0; i < PLY_TYPES; i++)
+    {
+        if(!strcmp(name, ply_type_names[i]) || !strcmp(name, ply_type_names2[i]))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// read 1 value in the data section.  Returns 1 on success.
+int ply_value(const char **ptr, const char *end, int format, int type, double *result)
+{
+    if(format == PLY_ASCII)
+    {
+        return parse_double(ptr, end, result);
+    }
+
+    int i;
+    int size = ply_type_sizes[type];
+    uint8_t buffer[8];
+    if(end - *ptr < size)
+    {
+        return 0;
+    }
+
+    for(i = 0; i < size; i++)
+    {
+        buffer[i] = (format == PLY_BIG_ENDIAN) ? (*ptr)[size - 1 - i] : (*ptr)[i];
+    }
+    *ptr += size;
+
+    switch(type)
+    {
+        case 0: { int8_t x; memcpy(&x, buffer, 1); *result = x; break; }
+        case 1: { uint8_t x; memcpy(&x, buffer, 1); *result = x; break; }
+        case 2: { int16_t x; memcpy(&x, buffer, 2); *result = x; break; }
+        case 3: { uint16_t x; memcpy(&x, buffer, 2); *result = x; break; }
+        case 4: { int32_t x; memcpy(&x, buffer, 4); *result = x; break; }
+        case 5: { uint32_t x; memcpy(&x, buffer, 4); *result = x; break; }
+        case 6: { float x; memcpy(&x, buffer, 4); *result = x; break; }
+        case 7: { double x; memcpy(&x, buffer, 8); *result = x; break; }
+    }
+    return 1;
+}
+
+// Stanford PLY in ASCII or binary.  The vertex x, y, z & the face
+// vertex_indices are used.  Faces with more than 3 vertices are split into a
+// fan.
+int read_ply(const char *path, mesh_t *mesh)
+{
+    int64_t size;
+    const char *data = (const char*)map_file(path, &size);
+    if(!data)
+    {
+        return 1;
+    }
+
+    const char *ptr = data;
+    const char *end = data + size;
+    ply_element_t *elements = (ply_element_t*)calloc(PLY_MAX_ELEMENTS, sizeof(ply_element_t));
+    ply_element_t *element = 0;
+    int total_elements = 0;
+    int format = -1;
+    int error = 0;
+    int i, j, k;
+    char string[PLY_NAMELEN];
+
+    if(!token_is(ptr, end, "ply"))
+    {
+        printf("read_ply %d: %s is not a PLY file\n", __LINE__, path);
+        error = 1;
+    }
+
+// header
+    while(!error)
+    {
+        ptr = skip_line(ptr, end);
+        if(ptr >= end)
+        {
+            printf("read_ply %d: %s has no end_header\n", __LINE__, path);
+            error = 1;
+            break;
+        }
+
+        ptr = skip_blanks(ptr, end);
+        if(token_is(ptr, end, "end_header"))
+        {
+            ptr = skip_line(ptr, end);
+            break;
+        }
+        else
+        if(token_is(ptr, end, "format"))
+        {
+            ptr = copy_token(token_end(ptr, end), end, string, PLY_NAMELEN);
+            if(!strcmp(string, "ascii"))
+            {
+                format = PLY_ASCII;
+            }
+            else
+            if(!strcmp(string, "binary_little_endian"))
+            {
+                format = PLY_LITTLE_ENDIAN;
+            }
+            else
+            if(!strcmp(string, "binary_big_endian"))
+            {
+                format = PLY_BIG_ENDIAN;
+            }
+        }
+        else
+        if(token_is(ptr, end, "element"))
+        {
+            if(total_elements >= PLY_MAX_ELEMENTS)
+            {
+                printf("read_ply %d: %s has too many elements\n", __LINE__, path);
+                error = 1;
+                break;
+            }
+            element = &elements[total_elements++];
+            ptr = copy_token(token_end(ptr, end), end, element->name, PLY_NAMELEN);
+            parse_int(&ptr, end, &element->count);
+        }
+        else
+        if(token_is(ptr, end, "property") && element)
+        {
+            if(element->total_properties >= PLY_MAX_PROPERTIES)
+            {
+                printf("read_ply %d: %s has too many properties\n", __LINE__, path);
+                error = 1;
+                break;
+            }
+            int property = element->total_properties++;
+            element->count_types[property] = -1;
+            ptr = copy_token(token_end(ptr, end), end, string, PLY_NAMELEN);
+            if(!strcmp(string, "list"))
+            {
+                ptr = copy_token(ptr, end, string, PLY_NAMELEN);
+                element->count_types[property] = ply_type(string);
+                ptr = copy_token(ptr, end, string, PLY_NAMELEN);
+                if(element->count_types[property] < 0)
+                {
+                    error = 1;
+                }
+            }
+            element->types[property] = ply_type(string);
+            copy_token(ptr, end, element->property_names[property], PLY_NAMELEN);
+            if(element->types[property] < 0)
+            {
+                error = 1;
+            }
+
+            if(error)
+            {
+                printf("read_ply %d: %s has an unknown property type\n", __LINE__, path);
+            }
+        }
+    }
+
+    if(!error && format < 0)
+    {
+        printf("read_ply %d: %s has no format\n", __LINE__, path);
+        error = 1;
+    }
+
+// data
+    for(i = 0; i < total_elements && !error; i++)
+    {
+        element = &elements[i];
+        int is_vertex = !strcmp(element->name, "vertex");
+        int is_face = !strcmp(element->name, "face");
+        for(j = 0; j < element->count && !error; j++)
+        {
+            vector_t point = { 0, 0, 0 };
+            int property;
+            for(property = 0; property < element->total_properties && !error; property++)
+            {
+                const char *name = element->property_names[property];
+                double value;
+                if(element->count_types[property] >= 0)
+                {
+                    if(!ply_value(&ptr, end, format, element->count_types[property], &value))
+                    {
+                        error = 1;
+                        break;
+                    }
+
+                    int total = value;
+                    int use_it = is_face && 
+                        (!strcmp(name, "vertex_indices") || !strcmp(name, "vertex_index"));
+                    int first = -1;
+                    int prev = -1;
+                    for(k = 0; k < total; k++)
+                    {
+                        if(!ply_value(&ptr, end, format, element->types[property], &value))
+                        {
+                            error = 1;
+                            break;
+                        }
+
+                        if(use_it)
+                        {
+                            int index = value;
+                            if(k == 0)
+                            {
+                                first = index;
+                            }
+                            else
+                            if(k >= 2)
+                            {
+                                mesh_add_triangle(mesh, first, prev, index);
+                            }
+                            prev = index;
+                        }
+                    }
+                }
+                else
+                {
+                    if(!ply_value(&ptr, end, format, element->types[property], &value))
+                    {
+                        error = 1;
+                        break;
+                    }
+
+                    if(is_vertex)
+                    {
+                        if(!strcmp(name, "x"))
+                        {
+                            point.x = value;
+                        }
+                        else
+                        if(!strcmp(name, "y"))
+                        {
+                            point.y = value;
+                        }
+                        else
+                        if(!strcmp(name, "z"))
+                        {
+                            point.z = value;
+                        }
+                    }
+                }
+            }
+
+            if(is_vertex)
+            {
+                mesh_add_vertex(mesh, point);
+            }
+            if(format == PLY_ASCII)
+            {
+                ptr = skip_line(ptr, end);
+            }
+        }
+
+        if(error)
+        {
+            printf("read_ply %d: %s is truncated\n", __LINE__, path);
+        }
+    }
+
+    free(elements);
+    munmap((void*)data, size);
+    return error;
+}
+
+// Read any supported file as an indexed mesh.  Returns 0 on success.
+// Triangles from STL files have their own vertices.
+int read_mesh(const char *path, mesh_t *mesh)
+{
+    int result = 0;
+    int i, j;
+    init_mesh(mesh);
+    if(has_extension(path, ".obj"))
+    {
+        result = read_obj(path, mesh);
+    }
+    else
+    if(has_extension(path, ".ply"))
+    {
+        result = read_ply(path, mesh);
+    }
+    else
+    {
+        int count;
+        stl_triangle_t *triangles = read_stl_file(path, &count);
+        if(!triangles)
+        {
+            return 1;
+        }
+
+        for(i = 0; i < count; i++)
+        {
+            for(j = 0; j < 3; j++)
+            {
+                mesh_add_vertex(mesh, triangles[i].coords[j]);
+            }
+            mesh_add_triangle(mesh, i * 3, i * 3 + 1, i * 3 + 2);
+        }
+        free(triangles);
+    }
+
+    if(result)
+    {
+        free_mesh(mesh);
+        return result;
+    }
+
+    check_mesh(mesh, path);
+    printf("read_mesh %d: %d vertices %d triangles\n", 
+        __LINE__, 
+        mesh->vertex_count, 
+        mesh->triangle_count);
+    return 0;
+}
+
+// expand an indexed mesh to STL triangles which the caller frees
+stl_triangle_t* mesh_to_stl(mesh_t *mesh, int *count)
+{
+    int i, j;
+    *count = mesh->triangle_count;
+    stl_triangle_t *triangles = (stl_triangle_t*)malloc(sizeof(stl_triangle_t) * (*count + 1));
+    for(i = 0; i < mesh->triangle_count; i++)
+    {
+        stl_triangle_t *triangle = &triangles[i];
+        for(j = 0; j < 3; j++)
+        {
+            triangle->coords[j] = mesh->vertices[mesh->indices[i * 3 + j]];
+        }
+        triangle->n = triangleNormal(triangle->coords[0], 
+            triangle->coords[1], 
+            triangle->coords[2]);
+        triangle->attr = 0;
+    }
+    return triangles;
+}
+
+// returns a copy of the triangles which the caller frees.  OBJ & PLY files
+// are expanded to triangles.
+stl_triangle_t* read_stl(const char *path, int *count)
+{
+    *count = 0;
+    if(has_extension(path, ".obj") || has_extension(path, ".ply"))
+    {
+        mesh_t mesh;
+        if(read_mesh(path, &mesh))
+        {
+            return 0;
+        }
+        stl_triangle_t *triangles = mesh_to_stl(&mesh, count);
+        free_mesh(&mesh);
+        return triangles;
+    }
+
+    return read_stl_file(path, count);
+}
+
+void write_stl(char *path, int count, stl_triangle_t *triangles)
+{
+    stl_writer_t writer;
+    stl_chunk_t chunk;
+    confirm_overwrite(path);
+    if(open_stl_writer(&writer, path))
+    {
+        printf("write_stl %d: Couldn't open %s\n", __LINE__, path);
+        exit(1);
+    }
+
+    init_stl_chunk(&chunk, &writer);
+    int i;
+    for(i = 0; i < count; i++)
+    {
+        stl_triangle_t *triangle = &triangles[i];
+        chunk_triangle(&chunk, 
+            triangle->coords[0], 
+            triangle->coords[1], 
+            triangle->coords[2]);
+    }
+
+    free_stl_chunk(&chunk);
+    close_stl_writer(&writer);
+}
+
+
+
+
+void close_stl()
+{
+    free_stl_chunk(&stlChunk);
+    printf("close_stl %d: triangleCount=%d\n", __LINE__, stlWriter.count);
+    close_stl_writer(&stlWriter);
+}
+
+vector_t polarToXYZ(vector_t point)
+{
+// polar to XYZ
+    double angle = point.x;
+    double radius = point.y;
+    double z = point.z;
+    double x = radius * cos(angle);
+    double y = -radius * sin(angle);
+// printf("polarToXYZ %d %f %f %f -> %f %f %f\n", 
+//     __LINE__, 
+//     point.x,
+//     point.y,
+//     point.z,
+//     x,
+//     y,
+//     z);
+// 
+
+    if(fabs(planeAngle) > 0.001)
+    {
+// x slope given x
+// rotate top X of cylinder
+        double topX = x * cosPlane;
+// rotate top Z of cylinder
+        double topZ = planeIntercept + x * sinPlane;
+        double slope = (topX - x) / topZ;
+// interpolate X
+        x += z * slope;
+    }
+
+    return (vector_t){ x, y, z };
+}
+
+
+// Invert the plane slope in polarToXYZ.  Solving
+// goal = x + z * x * (cosPlane - 1) / (planeIntercept + x * sinPlane)
+// for x gives the quadratic
+// sinPlane * x^2 + (planeIntercept + z * (cosPlane - 1) - goal * sinPlane) * x
+//     - goal * planeIntercept = 0
+// The root nearest the goal is the one on the cylinder.
+double planeX(double goal, double z)
+{
+    double a = sinPlane;
+    double b = planeIntercept + z * (cosPlane - 1) - goal * sinPlane;
+    double c = -goal * planeIntercept;
+// tangent if it misses
+    double disc = b * b - 4 * a * c;
+    if(disc < 0)
+    {
+        disc = 0;
+    }
+
+// avoid the cancellation in -b + sqrt
+    double q = -0.5 * (b + copysign(sqrt(disc), b));
+    double root1 = (a != 0) ? q / a : NAN;
+    double root2 = (q != 0) ? c / q : NAN;
+    if(isnan(root1) && isnan(root2))
+    {
+        return goal;
+    }
+    if(isnan(root1) || fabs(root2 - goal) < fabs(root1 - goal))
+    {
+        return root2;
+    }
+    return root1;
+}
+
+vector_t XYZToPolar(vector_t xyz)
+{
+    double aspect = 1.0;
+    if(fabs(topAspect - 1.0) > 0.001)
+    {
+        double fraction = xyz.z / length;
+        aspect = (topAspect * fraction) + (1.0 - fraction);
+    }
+    xyz.x = xyz.x / aspect;
+
+// circularize XY
+    double y = xyz.y;
+    double x = xyz.x;
+    double z = xyz.z;
+    if(fabs(planeAngle) > 0.001)
+    {
+        x = planeX(x, z);
+    }
+    
+// convert XY to angle & radius
+    double angle = atan2(-y, x);
+    double radius = hypot(x, y);
+// printf("polarToXYZ %d %f %f %f -> %f %f %f\n", 
+//     __LINE__, 
+//     xyz.x,
+//     xyz.y,
+//     xyz.z,
+//     angle,
+//     radius,
+//     z);
+
+    return (vector_t){ angle, radius, z };
+}
+
+vector_t addVectors(vector_t a, vector_t b)
+{
+	return (vector_t){ a.x + b.x, a.y + b.y, a.z + b.z };
+}
+ 
+vector_t subVectors(vector_t a, vector_t b)
+{
+	return (vector_t){ a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+vector_t crossProduct(vector_t a, vector_t b)
+{
+    vector_t result;
+	result.x = a.y * b.z - a.z * b.y;
+	result.y = a.z * b.x - a.x * b.z;
+	result.z = a.x * b.y - a.y * b.x;
+    return result;
+}
+
+double magnitude(vector_t a)
+{
+    return sqrt(a.x * a.x + a.y * a.y + a.z * a.z);
+}
+
+vector_t normalize(vector_t a)
+{
+    double m = magnitude(a);
+    return (vector_t){ a.x / m, a.y / m, a.z / m };
+}
+
+double dotProduct(vector_t a, vector_t b)
+{
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+vector_t scaleVector(double l, vector_t a)
+{
+	return (vector_t){ l * a.x, l * a.y, l * a.z };
+}
+
+// does the line intersect the plane?
+int intersect(vector_t lineVector, vector_t planeNormal)
+{
+    if(dotProduct(lineVector, planeNormal) == 0)
+    {
+        return 0;
+    }
+    else
+    {
+        return 1;
+    }
+}
+
+// point where line intersects plane.  Not reliable.
+vector_t intersectionPoint(vector_t lineVector, 
+    vector_t linePoint, 
+    vector_t planeNormal, 
+    vector_t planePoint)
+{
+	vector_t diff = subVectors(linePoint,planePoint);
+ 
+	return addVectors(addVectors(diff,planePoint),
+        scaleVector(
+            -dotProduct(diff,planeNormal) / 
+                dotProduct(lineVector,planeNormal),
+            lineVector));
+}
+
+// intersection between line & the plane z = planeIntercept + x * planeSlope,
+// clamped to the ends of the line
+vector_t intersectionPoint2(vector_t xyz1, 
+    vector_t xyz2, 
+    double planeIntercept, 
+    double planeSlope)
+{
+    vector_t diff = subVectors(xyz2, xyz1);
+    double denominator = diff.z - planeSlope * diff.x;
+    double fraction;
+    if(denominator == 0)
+    {
+// parallel.  Take the end on the plane's side.
+        fraction = (xyz1.z > planeIntercept + xyz1.x * planeSlope) ? 0 : 1;
+    }
+    else
+    {
+        fraction = (planeIntercept + planeSlope * xyz1.x - xyz1.z) / denominator;
+    }
+
+    if(fraction < 0)
+    {
+        fraction = 0;
+    }
+    if(fraction > 1)
+    {
+        fraction = 1;
+    }
+    return addVectors(xyz1, scaleVector(fraction, diff));
+}
+
+// normal from the winding order
+vector_t triangleNormal(vector_t coord0, vector_t coord1, vector_t coord2)
+{
+    vector_t n = crossProduct(subVectors(coord1, coord0),
+        subVectors(coord2, coord1));
+    if(magnitude(n) > 0)
+    {
+        n = normalize(n);
+    }
+    return n;
+}
+
+void writeTriangle(vector_t coord0, vector_t coord1, vector_t coord2)
+{
+    chunk_triangle(&stlChunk, coord0, coord1, coord2);
+    triangleCount++;
+}
+
+
+
+void writeTriangle2(vector_t coord0, vector_t coord1, vector_t coord2)
+{
+    writeTriangle(coord2, coord1, coord0);
+}
+
+
+void writeQuad(vector_t coord0, vector_t coord1, vector_t coord2, vector_t coord3)
+{
+    if(isnan(coord0.x) ||
+        isnan(coord0.y) ||
+        isnan(coord0.z) ||
+        isnan(coord1.x) ||
+        isnan(coord1.y) ||
+        isnan(coord1.z) ||
+        isnan(coord2.x) ||
+        isnan(coord2.y) ||
+        isnan(coord2.z) ||
+        isnan(coord3.x) ||
+        isnan(coord3.y) ||
+        isnan(coord3.z))
+    {
+        printf("writeQuad %d: Nan at triangle %d\n", __LINE__, triangleCount);
+        return;
+    }
+        
+
+    writeTriangle(coord0, coord1, coord2);
+    writeTriangle(coord0, coord2, coord3);
+}
+
+void loopToSolid(vector_t *edgeLoop1, vector_t *edgeLoop2, int loopPoints)
+{
+    int j;
+    for(j = 0; j < loopPoints - 1; j++)
+    {
+        writeQuad(edgeLoop1[j], 
+            edgeLoop1[j + 1], 
+            edgeLoop2[j + 1], 
+            edgeLoop2[j]);
+    }
+
+// join last point to 1st point in the loop
+    writeQuad(edgeLoop1[loopPoints - 1], 
+        edgeLoop1[0], 
+        edgeLoop2[0], 
+        edgeLoop2[loopPoints - 1]);
+}
+
+
+// create a solid from edge loops
+// edgeLoops -> XYZ coords
+// capIt -> make quads for the ends, otherwise the last & first edge loops are joined
+void loopsToSolid(vector_t **edgeLoops, 
+    int totalLoops, 
+    int loopPoints,
+    int capIt)
+{
+    if(totalLoops < 2)
+    {
+        printf("loopsToSolid %d totalLoops=%d\n", __LINE__, totalLoops);
+        return;
+    }
+
+#ifdef USE_CLIPPING
+    capIt = 1;
+#endif
+
+    int i;
+    for(i = 0; i < totalLoops - 1; i++)
+    {
+        vector_t *edgeLoop1 = edgeLoops[i];
+        vector_t *edgeLoop2 = edgeLoops[i + 1];
+        loopToSolid(edgeLoops[i], edgeLoops[i + 1], loopPoints);
+    }
+    
+    if(!capIt)
+    {
+        loopToSolid(edgeLoops[totalLoops - 1], edgeLoops[0], loopPoints);
+    }
+    else
+    {
+// make end pieces.  Assume they're quads for now & loop 0 is the bottom
+        writeQuad(edgeLoops[0][3], 
+            edgeLoops[0][2], 
+            edgeLoops[0][1], 
+            edgeLoops[0][0]);
+        writeQuad(edgeLoops[totalLoops - 1][0], 
+            edgeLoops[totalLoops - 1][1], 
+            edgeLoops[totalLoops - 1][2], 
+            edgeLoops[totalLoops - 1][3]);
+    }
+}
+
+
+void free_adjacency(mesh_t *mesh)
+{
+    free(mesh->neighbors);
+    free(mesh->vertex_start);
+    free(mesh->vertex_triangles);
+    mesh->neighbors = 0;
+    mesh->vertex_start = 0;
+    mesh->vertex_triangles = 0;
+}
+
+int64_t weld_cell(double x, double size)
+{
+    return (int64_t)floor(x / size);
+}
+
+int weld_bucket(int64_t x, int64_t y, int64_t z, int mask)
+{
+    uint64_t hash = (uint64_t)x * 73856093ULL ^
+        (uint64_t)y * 19349663ULL ^
+        (uint64_t)z * 83492791ULL;
+    return (int)((hash ^ (hash >> 29)) & mask);
+}
+
+// Merge vertices closer than the tolerance to the 1st one in the file.  The
+// kept vertices go in a hash grid with the tolerance as the cell size so
+// only the 27 cells around a vertex are tested.  Triangles which lose an
+// edge are dropped.  Returns the number of vertices removed.
+int weld_mesh(mesh_t *mesh, double tolerance)
+{
+    int i;
+    int64_t x, y, z;
+    int size = 1024;
+    while(size < mesh->vertex_count * 2)
+    {
+        size *= 2;
+    }
+
+    double cell_size = (tolerance > 0) ? tolerance : 1.0;
+    int *heads = (int*)malloc(sizeof(int) * size);
+    int *next = (int*)malloc(sizeof(int) * (mesh->vertex_count + 1));
+    int *remap = (int*)malloc(sizeof(int) * (mesh->vertex_count + 1));
+    int kept = 0;
+    for(i = 0; i < size; i++)
+    {
+        heads[i] = -1;
+    }
+
+    free_adjacency(mesh);
+    for(i = 0; i < mesh->vertex_count; i++)
+    {
+        vector_t *point = &mesh->vertices[i];
+        int64_t cx = weld_cell(point->x, cell_size);
+        int64_t cy = weld_cell(point->y, cell_size);
+        int64_t cz = weld_cell(point->z, cell_size);
+        int match = -1;
+        for(x = cx - 1; x <= cx + 1 && match < 0; x++)
+        {
+            for(y = cy - 1; y <= cy + 1 && match < 0; y++)
+            {
+                for(z = cz - 1; z <= cz + 1 && match < 0; z++)
+                {
+                    int entry = heads[weld_bucket(x, y, z, size - 1)];
+                    while(entry >= 0)
+                    {
+                        vector_t *other = &mesh->vertices[entry];
+                        if(hypot3(point->x - other->x, 
+                            point->y - other->y, 
+                            point->z - other->z) <= tolerance &&
+                            (match < 0 || entry < match))
+                        {
+                            match = entry;
+                        }
+                        entry = next[entry];
+                    }
+                }
+            }
+        }
+
+        if(match >= 0)
+        {
+            remap[i] = match;
+        }
+        else
+        {
+// compact the vertices in place
+            remap[i] = kept;
+            mesh->vertices[kept] = *point;
+            int bucket = weld_bucket(cx, cy, cz, size - 1);
+            next[kept] = heads[bucket];
+            heads[bucket] = kept;
+            kept++;
+        }
+    }
+
+    int removed = mesh->vertex_count - kept;
+    int dst = 0;
+    for(i = 0; i < mesh->triangle_count; i++)
+    {
+        int a = remap[mesh->indices[i * 3]];
+        int b = remap[mesh->indices[i * 3 + 1]];
+        int c = remap[mesh->indices[i * 3 + 2]];
+        if(a != b && b != c && c != a)
+        {
+            mesh->indices[dst * 3] = a;
+            mesh->indices[dst * 3 + 1] = b;
+            mesh->indices[dst * 3 + 2] = c;
+            dst++;
+        }
+    }
+
+    printf("weld_mesh %d: removed %d vertices %d triangles\n", 
+        __LINE__, 
+        removed, 
+        mesh->triangle_count - dst);
+    mesh->vertex_count = kept;
+    mesh->triangle_count = dst;
+    free(heads);
+    free(next);
+    free(remap);
+    return removed;
+}
+
+// the vertices of edge N of a triangle, lowest 1st
+void mesh_edge(mesh_t *mesh, int edge, int *low, int *high)
+{
+    int a = mesh->indices[edge];
+    int b = mesh->indices[(edge / 3) * 3 + (edge + 1) % 3];
+    *low = (a < b) ? a : b;
+    *high = (a > b) ? a : b;
+}
+
+// Build the tables for the neighbor queries.  Has to be called again after
+// the mesh changes.  Edges are matched regardless of winding.  Edges shared
+// by more than 2 triangles have no neighbor.
+void build_adjacency(mesh_t *mesh)
+{
+    int i, j, k;
+    int total_vertices = mesh->vertex_count;
+    int total_edges = mesh->triangle_count * 3;
+    free_adjacency(mesh);
+
+// triangles of each vertex
+    mesh->vertex_start = (int*)calloc(total_vertices + 1, sizeof(int));
+    mesh->vertex_triangles = (int*)malloc(sizeof(int) * (total_edges + 1));
+    for(i = 0; i < total_edges; i++)
+    {
+        mesh->vertex_start[mesh->indices[i] + 1]++;
+    }
+    for(i = 0; i < total_vertices; i++)
+    {
+        mesh->vertex_start[i + 1] += mesh->vertex_start[i];
+    }
+
+    int *fill = (int*)malloc(sizeof(int) * (total_vertices + 1));
+    memcpy(fill, mesh->vertex_start, sizeof(int) * total_vertices);
+    for(i = 0; i < total_edges; i++)
+    {
+        mesh->vertex_triangles[fill[mesh->indices[i]]++] = i / 3;
+    }
+
+// Counting sort the edges by their highest vertex, then by their lowest 
+// vertex.  The 2nd sort is stable so the edges with the same vertices end 
+// up next to each other, without comparing every pair in a bucket.  
+// read_obj makes n-gons into fans, so 1 vertex can have thousands of edges.
+    int *high_start = (int*)calloc(total_vertices + 1, sizeof(int));
+    int *low_start = (int*)calloc(total_vertices + 1, sizeof(int));
+    int *by_high = (int*)malloc(sizeof(int) * (total_edges + 1));
+    int *edges = (int*)malloc(sizeof(int) * (total_edges + 1));
+    for(i = 0; i < total_edges; i++)
+    {
+        int low, high;
+        mesh_edge(mesh, i, &low, &high);
+        high_start[high + 1]++;
+        low_start[low + 1]++;
+    }
+    for(i = 0; i < total_vertices; i++)
+    {
+        high_start[i + 1] += high_start[i];
+        low_start[i + 1] += low_start[i];
+    }
+    memcpy(fill, high_start, sizeof(int) * total_vertices);
+    for(i = 0; i < total_edges; i++)
+    {
+        int low, high;
+        mesh_edge(mesh, i, &low, &high);
+        by_high[fill[high]++] = i;
+    }
+    memcpy(fill, low_start, sizeof(int) * total_vertices);
+    for(i = 0; i < total_edges; i++)
+    {
+        int low, high;
+        mesh_edge(mesh, by_high[i], &low, &high);
+        edges[fill[low]++] = by_high[i];
+    }
+
+// a run of 2 edges with the same vertices is a shared edge.  Other runs are
+// boundaries or non manifold.
+    mesh->neighbors = (int*)malloc(sizeof(int) * (total_edges + 1));
+    for(i = 0; i < total_edges; i = j)
+    {
+        int low, high;
+        mesh_edge(mesh, edges[i], &low, &high);
+        for(j = i + 1; j < total_edges; j++)
+        {
+            int low2, high2;
+            mesh_edge(mesh, edges[j], &low2, &high2);
+            if(low2 != low || high2 != high)
+            {
+                break;
+            }
+        }
+
+        if(j - i == 2)
+        {
+            mesh->neighbors[edges[i]] = edges[i + 1] / 3;
+            mesh->neighbors[edges[i + 1]] = edges[i] / 3;
+        }
+        else
         {
-            testFraction += step;
+            for(k = i; k < j; k++)
+            {
+                mesh->neighbors[edges[k]] = -1;
+            }
         }
     }
-    
-    return testPoint;
+
+    free(fill);
+    free(high_start);
+    free(low_start);
+    free(by_high);
+    free(edges);
 }
 
-void writeTriangle(vector_t coord0, vector_t coord1, vector_t coord2)
+// the triangle across edge 0-2 of the triangle or -1.  Edge N goes from
+// vertex N to vertex N + 1.
+int mesh_neighbor(mesh_t *mesh, int triangle, int edge)
 {
-// normal
-    vector_t n = crossProduct(subVectors(coord1, coord0),
-        subVectors(coord2, coord1));
-    if(magnitude(n) > 0)
+    return mesh->neighbors[triangle * 3 + edge];
+}
+
+// the triangles using the vertex.  Returns the number of triangles.
+int mesh_vertex_triangles(mesh_t *mesh, int vertex, int **triangles)
+{
+    *triangles = &mesh->vertex_triangles[mesh->vertex_start[vertex]];
+    return mesh->vertex_start[vertex + 1] - mesh->vertex_start[vertex];
+}
+
+// Label the triangles connected through shared vertices.  The component
+// array has 1 entry per triangle.  Returns the number of components.
+int mesh_components(mesh_t *mesh, int *component)
+{
+    int i, j, k;
+    int total = 0;
+    int *stack = (int*)malloc(sizeof(int) * (mesh->triangle_count + 1));
+    if(!mesh->vertex_start)
     {
-        n = normalize(n);
+        build_adjacency(mesh);
     }
-    
-    writeFloat(n.x);
-    writeFloat(n.y);
-    writeFloat(n.z);
-
-// vertex
-    writeFloat(coord0.x);
-    writeFloat(coord0.y);
-    writeFloat(coord0.z);
-// vertex
-    writeFloat(coord1.x);
-    writeFloat(coord1.y);
-    writeFloat(coord1.z);
-// vertex
-    writeFloat(coord2.x);
-    writeFloat(coord2.y);
-    writeFloat(coord2.z);
-
-// attribute
-    uint16_t x = 0;
-    fwrite(&x, 1, 2, out);
-    
-    triangleCount++;
+
+    for(i = 0; i < mesh->triangle_count; i++)
+    {
+        component[i] = -1;
+    }
+
+    for(i = 0; i < mesh->triangle_count; i++)
+    {
+        if(component[i] >= 0)
+        {
+            continue;
+        }
+
+        int used = 0;
+        stack[used++] = i;
+        component[i] = total;
+        while(used > 0)
+        {
+            int current = stack[--used];
+            for(j = 0; j < 3; j++)
+            {
+                int *others;
+                int others_total = mesh_vertex_triangles(mesh, 
+                    mesh->indices[current * 3 + j], 
+                    &others);
+                for(k = 0; k < others_total; k++)
+                {
+                    if(component[others[k]] < 0)
+                    {
+                        component[others[k]] = total;
+                        stack[used++] = others[k];
+                    }
+                }
+            }
+        }
+        total++;
+    }
+
+    free(stack);
+    return total;
 }
 
 
+// Coordinates in separate arrays for the batch functions.  The batch
+// functions pick AVX2 at runtime if the CPU has it & a scalar loop if it
+// doesn't.  The AVX2 versions use float maths so they can differ from the
+// double versions in the last bits.  The destination can be the source.
+typedef struct
+{
+    float *x;
+    float *y;
+    float *z;
+    int count;
+} vectors_t;
 
-void writeTriangle2(vector_t coord0, vector_t coord1, vector_t coord2)
+void allocVectors(vectors_t *v, int count)
 {
-    writeTriangle(coord2, coord1, coord0);
+    int size = (sizeof(float) * count + 63) & ~63;
+    v->x = (float*)aligned_alloc(64, size ? size : 64);
+    v->y = (float*)aligned_alloc(64, size ? size : 64);
+    v->z = (float*)aligned_alloc(64, size ? size : 64);
+    v->count = count;
 }
 
+void freeVectors(vectors_t *v)
+{
+    free(v->x);
+    free(v->y);
+    free(v->z);
+    memset(v, 0, sizeof(vectors_t));
+}
 
-void writeQuad(vector_t coord0, vector_t coord1, vector_t coord2, vector_t coord3)
+vector_t getVector(vectors_t *v, int i)
 {
-    if(isnan(coord0.x) ||
-        isnan(coord0.y) ||
-        isnan(coord0.z) ||
-        isnan(coord1.x) ||
-        isnan(coord1.y) ||
-        isnan(coord1.z) ||
-        isnan(coord2.x) ||
-        isnan(coord2.y) ||
-        isnan(coord2.z) ||
-        isnan(coord3.x) ||
-        isnan(coord3.y) ||
-        isnan(coord3.z))
+    return (vector_t){ v->x[i], v->y[i], v->z[i] };
+}
+
+void setVector(vectors_t *v, int i, vector_t value)
+{
+    v->x[i] = value.x;
+    v->y[i] = value.y;
+    v->z[i] = value.z;
+}
+
+int useAVX2()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static int result = -1;
+    if(result < 0)
     {
-        printf("writeQuad %d: Nan at triangle %d\n", __LINE__, triangleCount);
-        return;
+        __builtin_cpu_init();
+        result = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
     }
-        
+    return result;
+#else
+    return 0;
+#endif
+}
 
-    writeTriangle(coord0, coord1, coord2);
-    writeTriangle(coord0, coord2, coord3);
+// matrix is 3 rows of 4 with the translation in the last column
+void transformVectorsScalar(vectors_t *dst, vectors_t *src, const double *matrix)
+{
+    int i;
+    for(i = 0; i < src->count; i++)
+    {
+        double x = src->x[i];
+        double y = src->y[i];
+        double z = src->z[i];
+        dst->x[i] = matrix[0] * x + matrix[1] * y + matrix[2] * z + matrix[3];
+        dst->y[i] = matrix[4] * x + matrix[5] * y + matrix[6] * z + matrix[7];
+        dst->z[i] = matrix[8] * x + matrix[9] * y + matrix[10] * z + matrix[11];
+    }
 }
 
-void loopToSolid(vector_t *edgeLoop1, vector_t *edgeLoop2, int loopPoints)
+// normal of each triangle from the 3 arrays of coords
+void triangleNormalsScalar(vectors_t *dst, 
+    vectors_t *coord0, 
+    vectors_t *coord1, 
+    vectors_t *coord2)
 {
-    int j;
-    for(j = 0; j < loopPoints - 1; j++)
+    int i;
+    for(i = 0; i < coord0->count; i++)
     {
-        writeQuad(edgeLoop1[j], 
-            edgeLoop1[j + 1], 
-            edgeLoop2[j + 1], 
-            edgeLoop2[j]);
+        setVector(dst, i, triangleNormal(getVector(coord0, i), 
+            getVector(coord1, i), 
+            getVector(coord2, i)));
     }
+}
 
-// join last point to 1st point in the loop
-    writeQuad(edgeLoop1[loopPoints - 1], 
-        edgeLoop1[0], 
-        edgeLoop2[0], 
-        edgeLoop2[loopPoints - 1]);
+void polarToXYZVectorsScalar(vectors_t *dst, vectors_t *src)
+{
+    int i;
+    for(i = 0; i < src->count; i++)
+    {
+        setVector(dst, i, polarToXYZ(getVector(src, i)));
+    }
 }
 
+void XYZToPolarVectorsScalar(vectors_t *dst, vectors_t *src)
+{
+    int i;
+    for(i = 0; i < src->count; i++)
+    {
+        setVector(dst, i, XYZToPolar(getVector(src, i)));
+    }
+}
 
-// create a solid from edge loops
-// edgeLoops -> XYZ coords
-// capIt -> make quads for the ends, otherwise the last & first edge loops are joined
-void loopsToSolid(vector_t **edgeLoops, 
-    int totalLoops, 
-    int loopPoints,
-    int capIt)
+void boundsVectorsScalar(vectors_t *src, vector_t *min, vector_t *max)
 {
-    if(totalLoops < 2)
+    int i;
+    *min = (vector_t){ INFINITY, INFINITY, INFINITY };
+    *max = (vector_t){ -INFINITY, -INFINITY, -INFINITY };
+    for(i = 0; i < src->count; i++)
     {
-        printf("loopsToSolid %d totalLoops=%d\n", __LINE__, totalLoops);
+        min->x = fminf(min->x, src->x[i]);
+        min->y = fminf(min->y, src->y[i]);
+        min->z = fminf(min->z, src->z[i]);
+        max->x = fmaxf(max->x, src->x[i]);
+        max->y = fmaxf(max->y, src->y[i]);
+        max->z = fmaxf(max->z, src->z[i]);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define AVX2 __attribute__((target("avx2,fma")))
+
+// sine & cosine of 8 floats with the Cephes polynomials
+AVX2 void sincosAVX2(__m256 x, __m256 *s, __m256 *c)
+{
+    __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    __m256 sign = _mm256_and_ps(x, sign_mask);
+    x = _mm256_andnot_ps(sign_mask, x);
+
+// octant rounded up to even
+    __m256i j = _mm256_cvttps_epi32(_mm256_mul_ps(x, _mm256_set1_ps(4 / M_PI)));
+    j = _mm256_add_epi32(j, _mm256_set1_epi32(1));
+    j = _mm256_and_si256(j, _mm256_set1_epi32(~1));
+    __m256 y = _mm256_cvtepi32_ps(j);
+
+    __m256 swap_sin = _mm256_castsi256_ps(_mm256_slli_epi32(
+        _mm256_and_si256(j, _mm256_set1_epi32(4)), 29));
+    __m256 swap_cos = _mm256_castsi256_ps(_mm256_slli_epi32(
+        _mm256_andnot_si256(_mm256_sub_epi32(j, _mm256_set1_epi32(2)), 
+            _mm256_set1_epi32(4)), 
+        29));
+    __m256 poly_mask = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+        _mm256_and_si256(j, _mm256_set1_epi32(2)), 
+        _mm256_setzero_si256()));
+
+// x - y * pi / 4 in 3 parts
+    x = _mm256_fnmadd_ps(y, _mm256_set1_ps(0.78515625f), x);
+    x = _mm256_fnmadd_ps(y, _mm256_set1_ps(2.4187564849853515625e-4f), x);
+    x = _mm256_fnmadd_ps(y, _mm256_set1_ps(3.77489497744594108e-8f), x);
+
+    __m256 z = _mm256_mul_ps(x, x);
+    __m256 cos_poly = _mm256_set1_ps(2.443315711809948e-5f);
+    cos_poly = _mm256_fmadd_ps(cos_poly, z, _mm256_set1_ps(-1.388731625493765e-3f));
+    cos_poly = _mm256_fmadd_ps(cos_poly, z, _mm256_set1_ps(4.166664568298827e-2f));
+    cos_poly = _mm256_mul_ps(cos_poly, _mm256_mul_ps(z, z));
+    cos_poly = _mm256_fnmadd_ps(z, _mm256_set1_ps(0.5f), cos_poly);
+    cos_poly = _mm256_add_ps(cos_poly, _mm256_set1_ps(1.0f));
+
+    __m256 sin_poly = _mm256_set1_ps(-1.9515295891e-4f);
+    sin_poly = _mm256_fmadd_ps(sin_poly, z, _mm256_set1_ps(8.3321608736e-3f));
+    sin_poly = _mm256_fmadd_ps(sin_poly, z, _mm256_set1_ps(-1.6666654611e-1f));
+    sin_poly = _mm256_mul_ps(sin_poly, _mm256_mul_ps(z, x));
+    sin_poly = _mm256_add_ps(sin_poly, x);
+
+    *s = _mm256_blendv_ps(cos_poly, sin_poly, poly_mask);
+    *c = _mm256_blendv_ps(sin_poly, cos_poly, poly_mask);
+    *s = _mm256_xor_ps(*s, _mm256_xor_ps(sign, swap_sin));
+    *c = _mm256_xor_ps(*c, swap_cos);
+}
+
+// arc tangent of 8 floats with the Cephes polynomial
+AVX2 __m256 atan2AVX2(__m256 y, __m256 x)
+{
+    __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    __m256 abs_x = _mm256_andnot_ps(sign_mask, x);
+    __m256 abs_y = _mm256_andnot_ps(sign_mask, y);
+    __m256 swap = _mm256_cmp_ps(abs_y, abs_x, _CMP_GT_OQ);
+    __m256 numerator = _mm256_min_ps(abs_x, abs_y);
+    __m256 denominator = _mm256_max_ps(abs_x, abs_y);
+// 0 / 0 is 0
+    __m256 zero = _mm256_cmp_ps(denominator, _mm256_setzero_ps(), _CMP_EQ_OQ);
+    __m256 a = _mm256_div_ps(numerator, 
+        _mm256_blendv_ps(denominator, _mm256_set1_ps(1.0f), zero));
+
+// reduce to tan(pi / 8)
+    __m256 reduce = _mm256_cmp_ps(a, _mm256_set1_ps(0.4142135623730950f), _CMP_GT_OQ);
+    __m256 offset = _mm256_and_ps(reduce, _mm256_set1_ps(M_PI / 4));
+    a = _mm256_blendv_ps(a, 
+        _mm256_div_ps(_mm256_sub_ps(a, _mm256_set1_ps(1.0f)), 
+            _mm256_add_ps(a, _mm256_set1_ps(1.0f))), 
+        reduce);
+
+    __m256 z = _mm256_mul_ps(a, a);
+    __m256 poly = _mm256_set1_ps(8.05374449538e-2f);
+    poly = _mm256_fmadd_ps(poly, z, _mm256_set1_ps(-1.38776856032e-1f));
+    poly = _mm256_fmadd_ps(poly, z, _mm256_set1_ps(1.99777106478e-1f));
+    poly = _mm256_fmadd_ps(poly, z, _mm256_set1_ps(-3.33329491539e-1f));
+    __m256 result = _mm256_add_ps(offset, 
+        _mm256_fmadd_ps(_mm256_mul_ps(poly, z), a, a));
+
+// restore the octant
+    result = _mm256_blendv_ps(result, 
+        _mm256_sub_ps(_mm256_set1_ps(M_PI / 2), result), 
+        swap);
+    result = _mm256_blendv_ps(result, 
+        _mm256_sub_ps(_mm256_set1_ps(M_PI), result), 
+        _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ));
+    return _mm256_xor_ps(result, _mm256_and_ps(y, sign_mask));
+}
+
+AVX2 void transformVectorsAVX2(vectors_t *dst, vectors_t *src, const double *matrix)
+{
+    int i;
+    __m256 m[12];
+    for(i = 0; i < 12; i++)
+    {
+        m[i] = _mm256_set1_ps(matrix[i]);
+    }
+
+    for(i = 0; i + 8 <= src->count; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(src->x + i);
+        __m256 y = _mm256_loadu_ps(src->y + i);
+        __m256 z = _mm256_loadu_ps(src->z + i);
+        _mm256_storeu_ps(dst->x + i, 
+            _mm256_fmadd_ps(m[0], x, _mm256_fmadd_ps(m[1], y, _mm256_fmadd_ps(m[2], z, m[3]))));
+        _mm256_storeu_ps(dst->y + i, 
+            _mm256_fmadd_ps(m[4], x, _mm256_fmadd_ps(m[5], y, _mm256_fmadd_ps(m[6], z, m[7]))));
+        _mm256_storeu_ps(dst->z + i, 
+            _mm256_fmadd_ps(m[8], x, _mm256_fmadd_ps(m[9], y, _mm256_fmadd_ps(m[10], z, m[11]))));
+    }
+
+// remaining vectors
+    vectors_t src2 = { src->x + i, src->y + i, src->z + i, src->count - i };
+    vectors_t dst2 = { dst->x + i, dst->y + i, dst->z + i, src->count - i };
+    transformVectorsScalar(&dst2, &src2, matrix);
+}
+
+AVX2 void triangleNormalsAVX2(vectors_t *dst, 
+    vectors_t *coord0, 
+    vectors_t *coord1, 
+    vectors_t *coord2)
+{
+    int i;
+    for(i = 0; i + 8 <= coord0->count; i += 8)
+    {
+        __m256 x0 = _mm256_loadu_ps(coord0->x + i);
+        __m256 y0 = _mm256_loadu_ps(coord0->y + i);
+        __m256 z0 = _mm256_loadu_ps(coord0->z + i);
+        __m256 x1 = _mm256_loadu_ps(coord1->x + i);
+        __m256 y1 = _mm256_loadu_ps(coord1->y + i);
+        __m256 z1 = _mm256_loadu_ps(coord1->z + i);
+        __m256 ax = _mm256_sub_ps(x1, x0);
+        __m256 ay = _mm256_sub_ps(y1, y0);
+        __m256 az = _mm256_sub_ps(z1, z0);
+        __m256 bx = _mm256_sub_ps(_mm256_loadu_ps(coord2->x + i), x1);
+        __m256 by = _mm256_sub_ps(_mm256_loadu_ps(coord2->y + i), y1);
+        __m256 bz = _mm256_sub_ps(_mm256_loadu_ps(coord2->z + i), z1);
+        __m256 nx = _mm256_fmsub_ps(ay, bz, _mm256_mul_ps(az, by));
+        __m256 ny = _mm256_fmsub_ps(az, bx, _mm256_mul_ps(ax, bz));
+        __m256 nz = _mm256_fmsub_ps(ax, by, _mm256_mul_ps(ay, bx));
+        __m256 m = _mm256_sqrt_ps(_mm256_fmadd_ps(nx, nx, 
+            _mm256_fmadd_ps(ny, ny, _mm256_mul_ps(nz, nz))));
+// degenerate triangles keep the 0 normal
+        m = _mm256_blendv_ps(m, 
+            _mm256_set1_ps(1.0f), 
+            _mm256_cmp_ps(m, _mm256_setzero_ps(), _CMP_EQ_OQ));
+        _mm256_storeu_ps(dst->x + i, _mm256_div_ps(nx, m));
+        _mm256_storeu_ps(dst->y + i, _mm256_div_ps(ny, m));
+        _mm256_storeu_ps(dst->z + i, _mm256_div_ps(nz, m));
+    }
+
+    for(; i < coord0->count; i++)
+    {
+        setVector(dst, i, triangleNormal(getVector(coord0, i), 
+            getVector(coord1, i), 
+            getVector(coord2, i)));
+    }
+}
+
+AVX2 void polarToXYZVectorsAVX2(vectors_t *dst, vectors_t *src)
+{
+    int i;
+    int plane = fabs(planeAngle) > 0.001;
+    __m256 cos_plane = _mm256_set1_ps(cosPlane);
+    __m256 sin_plane = _mm256_set1_ps(sinPlane);
+    __m256 intercept = _mm256_set1_ps(planeIntercept);
+    for(i = 0; i + 8 <= src->count; i += 8)
+    {
+        __m256 s, c;
+        __m256 radius = _mm256_loadu_ps(src->y + i);
+        __m256 z = _mm256_loadu_ps(src->z + i);
+        sincosAVX2(_mm256_loadu_ps(src->x + i), &s, &c);
+        __m256 x = _mm256_mul_ps(radius, c);
+        __m256 y = _mm256_xor_ps(_mm256_mul_ps(radius, s), _mm256_set1_ps(-0.0f));
+        if(plane)
+        {
+            __m256 top_x = _mm256_mul_ps(x, cos_plane);
+            __m256 top_z = _mm256_fmadd_ps(x, sin_plane, intercept);
+            __m256 slope = _mm256_div_ps(_mm256_sub_ps(top_x, x), top_z);
+            x = _mm256_fmadd_ps(z, slope, x);
+        }
+        _mm256_storeu_ps(dst->x + i, x);
+        _mm256_storeu_ps(dst->y + i, y);
+        _mm256_storeu_ps(dst->z + i, z);
+    }
+
+    for(; i < src->count; i++)
+    {
+        setVector(dst, i, polarToXYZ(getVector(src, i)));
+    }
+}
+
+// planeX for 8 floats
+AVX2 __m256 planeXAVX2(__m256 goal, __m256 z)
+{
+    __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    __m256 a = _mm256_set1_ps(sinPlane);
+    __m256 b = _mm256_fmadd_ps(z, 
+        _mm256_set1_ps(cosPlane - 1), 
+        _mm256_fnmadd_ps(goal, a, _mm256_set1_ps(planeIntercept)));
+    __m256 c = _mm256_mul_ps(_mm256_xor_ps(goal, sign_mask), 
+        _mm256_set1_ps(planeIntercept));
+    __m256 disc = _mm256_max_ps(_mm256_fmsub_ps(b, b, 
+            _mm256_mul_ps(_mm256_set1_ps(4.0f), _mm256_mul_ps(a, c))), 
+        _mm256_setzero_ps());
+    __m256 root = _mm256_or_ps(_mm256_sqrt_ps(disc), _mm256_and_ps(b, sign_mask));
+    __m256 q = _mm256_mul_ps(_mm256_set1_ps(-0.5f), _mm256_add_ps(b, root));
+    __m256 root1 = _mm256_div_ps(q, a);
+    __m256 root2 = _mm256_div_ps(c, q);
+// 0 / 0 is NAN & c / 0 is never nearest
+    __m256 use2 = _mm256_or_ps(
+        _mm256_cmp_ps(_mm256_andnot_ps(sign_mask, _mm256_sub_ps(root2, goal)), 
+            _mm256_andnot_ps(sign_mask, _mm256_sub_ps(root1, goal)), 
+            _CMP_LT_OQ), 
+        _mm256_cmp_ps(root1, root1, _CMP_UNORD_Q));
+    __m256 result = _mm256_blendv_ps(root1, root2, use2);
+    return _mm256_blendv_ps(result, goal, _mm256_cmp_ps(result, result, _CMP_UNORD_Q));
+}
+
+AVX2 void XYZToPolarVectorsAVX2(vectors_t *dst, vectors_t *src)
+{
+    int i;
+    int aspect = fabs(topAspect - 1.0) > 0.001;
+    int plane = fabs(planeAngle) > 0.001;
+    __m256 top_aspect = _mm256_set1_ps(topAspect);
+    __m256 inv_length = _mm256_set1_ps(1.0 / length);
+    for(i = 0; i + 8 <= src->count; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(src->x + i);
+        __m256 y = _mm256_loadu_ps(src->y + i);
+        __m256 z = _mm256_loadu_ps(src->z + i);
+        if(aspect)
+        {
+            __m256 fraction = _mm256_mul_ps(z, inv_length);
+            __m256 scale = _mm256_fmadd_ps(_mm256_sub_ps(top_aspect, _mm256_set1_ps(1.0f)), 
+                fraction, 
+                _mm256_set1_ps(1.0f));
+            x = _mm256_div_ps(x, scale);
+        }
+        if(plane)
+        {
+            x = planeXAVX2(x, z);
+        }
+        _mm256_storeu_ps(dst->x + i, 
+            atan2AVX2(_mm256_xor_ps(y, _mm256_set1_ps(-0.0f)), x));
+        _mm256_storeu_ps(dst->y + i, 
+            _mm256_sqrt_ps(_mm256_fmadd_ps(x, x, _mm256_mul_ps(y, y))));
+        _mm256_storeu_ps(dst->z + i, z);
+    }
+
+    for(; i < src->count; i++)
+    {
+        setVector(dst, i, XYZToPolar(getVector(src, i)));
+    }
+}
+
+AVX2 void boundsVectorsAVX2(vectors_t *src, vector_t *min, vector_t *max)
+{
+    int i, j;
+    __m256 min_x = _mm256_set1_ps(INFINITY);
+    __m256 min_y = min_x;
+    __m256 min_z = min_x;
+    __m256 max_x = _mm256_set1_ps(-INFINITY);
+    __m256 max_y = max_x;
+    __m256 max_z = max_x;
+    for(i = 0; i + 8 <= src->count; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(src->x + i);
+        __m256 y = _mm256_loadu_ps(src->y + i);
+        __m256 z = _mm256_loadu_ps(src->z + i);
+        min_x = _mm256_min_ps(min_x, x);
+        min_y = _mm256_min_ps(min_y, y);
+        min_z = _mm256_min_ps(min_z, z);
+        max_x = _mm256_max_ps(max_x, x);
+        max_y = _mm256_max_ps(max_y, y);
+        max_z = _mm256_max_ps(max_z, z);
+    }
+
+    float lanes[6][8];
+    _mm256_storeu_ps(lanes[0], min_x);
+    _mm256_storeu_ps(lanes[1], min_y);
+    _mm256_storeu_ps(lanes[2], min_z);
+    _mm256_storeu_ps(lanes[3], max_x);
+    _mm256_storeu_ps(lanes[4], max_y);
+    _mm256_storeu_ps(lanes[5], max_z);
+
+    vectors_t rest = { src->x + i, src->y + i, src->z + i, src->count - i };
+    boundsVectorsScalar(&rest, min, max);
+    for(j = 0; j < 8; j++)
+    {
+        min->x = fminf(min->x, lanes[0][j]);
+        min->y = fminf(min->y, lanes[1][j]);
+        min->z = fminf(min->z, lanes[2][j]);
+        max->x = fmaxf(max->x, lanes[3][j]);
+        max->y = fmaxf(max->y, lanes[4][j]);
+        max->z = fmaxf(max->z, lanes[5][j]);
+    }
+}
+#endif // x86
+
+void transformVectors(vectors_t *dst, vectors_t *src, const double *matrix)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if(useAVX2())
+    {
+        transformVectorsAVX2(dst, src, matrix);
         return;
     }
+#endif
+    transformVectorsScalar(dst, src, matrix);
+}
 
-#ifdef USE_CLIPPING
-    capIt = 1;
+void triangleNormals(vectors_t *dst, 
+    vectors_t *coord0, 
+    vectors_t *coord1, 
+    vectors_t *coord2)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if(useAVX2())
+    {
+        triangleNormalsAVX2(dst, coord0, coord1, coord2);
+        return;
+    }
+#endif
+    triangleNormalsScalar(dst, coord0, coord1, coord2);
+}
+
+void polarToXYZVectors(vectors_t *dst, vectors_t *src)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if(useAVX2())
+    {
+        polarToXYZVectorsAVX2(dst, src);
+        return;
+    }
+#endif
+    polarToXYZVectorsScalar(dst, src);
+}
+
+void XYZToPolarVectors(vectors_t *dst, vectors_t *src)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if(useAVX2())
+    {
+        XYZToPolarVectorsAVX2(dst, src);
+        return;
+    }
+#endif
+    XYZToPolarVectorsScalar(dst, src);
+}
+
+void boundsVectors(vectors_t *src, vector_t *min, vector_t *max)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if(useAVX2())
+    {
+        boundsVectorsAVX2(src, min, max);
+        return;
+    }
 #endif
+    boundsVectorsScalar(src, min, max);
+}
+
+
 
+// Convert whole edge loops in place with the batch functions.  The loops
+// are copied to separate coordinate arrays & back.
+void loopToVectors(vectors_t *dst, vector_t *loop, int loopPoints)
+{
     int i;
-    for(i = 0; i < totalLoops - 1; i++)
+    for(i = 0; i < loopPoints; i++)
     {
-        vector_t *edgeLoop1 = edgeLoops[i];
-        vector_t *edgeLoop2 = edgeLoops[i + 1];
-        loopToSolid(edgeLoops[i], edgeLoops[i + 1], loopPoints);
+        setVector(dst, i, loop[i]);
     }
-    
-    if(!capIt)
+}
+
+void vectorsToLoop(vector_t *loop, vectors_t *src)
+{
+    int i;
+    for(i = 0; i < src->count; i++)
     {
-        loopToSolid(edgeLoops[totalLoops - 1], edgeLoops[0], loopPoints);
+        loop[i] = getVector(src, i);
     }
-    else
+}
+
+void polarToXYZLoops(vector_t **edgeLoops, int totalLoops, int loopPoints)
+{
+    int i;
+    vectors_t vectors;
+    allocVectors(&vectors, loopPoints);
+    for(i = 0; i < totalLoops; i++)
     {
-// make end pieces.  Assume they're quads for now & loop 0 is the bottom
-        writeQuad(edgeLoops[0][3], 
-            edgeLoops[0][2], 
-            edgeLoops[0][1], 
-            edgeLoops[0][0]);
-        writeQuad(edgeLoops[totalLoops - 1][0], 
-            edgeLoops[totalLoops - 1][1], 
-            edgeLoops[totalLoops - 1][2], 
-            edgeLoops[totalLoops - 1][3]);
+        loopToVectors(&vectors, edgeLoops[i], loopPoints);
+        polarToXYZVectors(&vectors, &vectors);
+        vectorsToLoop(edgeLoops[i], &vectors);
+    }
+    freeVectors(&vectors);
+}
+
+void XYZToPolarLoops(vector_t **edgeLoops, int totalLoops, int loopPoints)
+{
+    int i;
+    vectors_t vectors;
+    allocVectors(&vectors, loopPoints);
+    for(i = 0; i < totalLoops; i++)
+    {
+        loopToVectors(&vectors, edgeLoops[i], loopPoints);
+        XYZToPolarVectors(&vectors, &vectors);
+        vectorsToLoop(edgeLoops[i], &vectors);
     }
+    freeVectors(&vectors);
 }
 
 #endif // _3DSTUFF_H
@@ -0,0 +1,210 @@
+// time the batch functions in 3dstuff.h against their scalar loops & check
+// they agree.  Exits with 1 if they differ by more than float rounding.
+
+// gcc -O2 3dstuff_bench.c -o 3dstuff_bench -lm
+
+#include "3dstuff.h"
+#include <time.h>
+
+#define TOTAL_VECTORS 1000003
+#define REPEATS 10
+// relative to the magnitude of the value
+#define MAX_ERROR 0.0001
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+double random_range(double min, double max)
+{
+    return min + rand() / (double)RAND_MAX * (max - min);
+}
+
+double value_error(double value, double expected)
+{
+    return fabs(value - expected) / fmax(1.0, fabs(expected));
+}
+
+// the angles in x can be on either side of +-pi
+double max_error(vectors_t *vectors, vectors_t *expected, int angles)
+{
+    double result = 0;
+    int i;
+    for(i = 0; i < expected->count; i++)
+    {
+        double x_error = value_error(vectors->x[i], expected->x[i]);
+        if(angles)
+        {
+            x_error = fmin(x_error,
+                value_error(fabs(vectors->x[i] - expected->x[i]), 2 * M_PI));
+        }
+        result = fmax(result, x_error);
+        result = fmax(result, value_error(vectors->y[i], expected->y[i]));
+        result = fmax(result, value_error(vectors->z[i], expected->z[i]));
+    }
+    return result;
+}
+
+int report(const char *name, double scalar_time, double batch_time, double error)
+{
+    printf("%-20s scalar=%.2fns batch=%.2fns speedup=%.1fx error=%g\n",
+        name,
+        scalar_time / REPEATS / TOTAL_VECTORS * 1e9,
+        batch_time / REPEATS / TOTAL_VECTORS * 1e9,
+        scalar_time / batch_time,
+        error);
+    if(error > MAX_ERROR)
+    {
+        printf("report %d: %s differs from the scalar loop\n", __LINE__, name);
+        return 1;
+    }
+    return 0;
+}
+
+int main()
+{
+    vectors_t coord0, coord1, coord2, polar, scalar, batch;
+    double matrix[12] = { 0.8, -0.6, 0, 10, 0.6, 0.8, 0, -5, 0, 0, 1, 2 };
+    vector_t scalar_min, scalar_max, batch_min, batch_max;
+    int failed = 0;
+    int i, j;
+    double start, scalar_time, batch_time;
+
+    allocVectors(&coord0, TOTAL_VECTORS);
+    allocVectors(&coord1, TOTAL_VECTORS);
+    allocVectors(&coord2, TOTAL_VECTORS);
+    allocVectors(&polar, TOTAL_VECTORS);
+    allocVectors(&scalar, TOTAL_VECTORS);
+    allocVectors(&batch, TOTAL_VECTORS);
+    srand(1);
+    for(i = 0; i < TOTAL_VECTORS; i++)
+    {
+        coord0.x[i] = random_range(-100, 100);
+        coord0.y[i] = random_range(-100, 100);
+        coord0.z[i] = random_range(0, 100);
+// no degenerate triangles.  Their normals are rounding noise.
+        coord1.x[i] = coord0.x[i] + 1 + rand() % 5;
+        coord1.y[i] = coord0.y[i] + rand() % 3;
+        coord1.z[i] = coord0.z[i];
+        coord2.x[i] = coord0.x[i];
+        coord2.y[i] = coord0.y[i] + rand() % 4;
+        coord2.z[i] = coord0.z[i] + 1 + rand() % 2;
+        polar.x[i] = random_range(-M_PI, M_PI);
+        polar.y[i] = random_range(0, 100);
+        polar.z[i] = random_range(0, 100);
+    }
+
+    printf("main %d: AVX2=%d\n", __LINE__, useAVX2());
+
+    start = now();
+    for(j = 0; j < REPEATS; j++)
+    {
+        transformVectorsScalar(&scalar, &coord0, matrix);
+    }
+    scalar_time = now() - start;
+    start = now();
+    for(j = 0; j < REPEATS; j++)
+    {
+        transformVectors(&batch, &coord0, matrix);
+    }
+    batch_time = now() - start;
+    failed |= report("transformVectors",
+        scalar_time,
+        batch_time,
+        max_error(&batch, &scalar, 0));
+
+    start = now();
+    for(j = 0; j < REPEATS; j++)
+    {
+        triangleNormalsScalar(&scalar, &coord0, &coord1, &coord2);
+    }
+    scalar_time = now() - start;
+    start = now();
+    for(j = 0; j < REPEATS; j++)
+    {
+        triangleNormals(&batch, &coord0, &coord1, &coord2);
+    }
+    batch_time = now() - start;
+    failed |= report("triangleNormals",
+        scalar_time,
+        batch_time,
+        max_error(&batch, &scalar, 0));
+
+    start = now();
+    for(j = 0; j < REPEATS; j++)
+    {
+        boundsVectorsScalar(&coord0, &scalar_min, &scalar_max);
+    }
+    scalar_time = now() - start;
+    start = now();
+    for(j = 0; j < REPEATS; j++)
+    {
+        boundsVectors(&coord0, &batch_min, &batch_max);
+    }
+    batch_time = now() - start;
+    failed |= report("boundsVectors",
+        scalar_time,
+        batch_time,
+        memcmp(&scalar_min, &batch_min, sizeof(vector_t)) ||
+            memcmp(&scalar_max, &batch_max, sizeof(vector_t)) ? 1 : 0);
+
+// without & with the plane slope
+    for(i = 0; i < 2; i++)
+    {
+        planeAngle = i ? 0.3 : 0;
+        planeIntercept = 50;
+        cosPlane = cos(planeAngle);
+        sinPlane = sin(planeAngle);
+
+        start = now();
+        for(j = 0; j < REPEATS; j++)
+        {
+            polarToXYZVectorsScalar(&scalar, &polar);
+        }
+        scalar_time = now() - start;
+        start = now();
+        for(j = 0; j < REPEATS; j++)
+        {
+            polarToXYZVectors(&batch, &polar);
+        }
+        batch_time = now() - start;
+        failed |= report(i ? "polarToXYZ plane" : "polarToXYZ",
+            scalar_time,
+            batch_time,
+            max_error(&batch, &scalar, 0));
+
+        start = now();
+        for(j = 0; j < REPEATS; j++)
+        {
+            XYZToPolarVectorsScalar(&scalar, &coord0);
+        }
+        scalar_time = now() - start;
+        start = now();
+        for(j = 0; j < REPEATS; j++)
+        {
+            XYZToPolarVectors(&batch, &coord0);
+        }
+        batch_time = now() - start;
+        failed |= report(i ? "XYZToPolar plane" : "XYZToPolar",
+            scalar_time,
+            batch_time,
+            max_error(&batch, &scalar, 1));
+    }
+
+    freeVectors(&coord0);
+    freeVectors(&coord1);
+    freeVectors(&coord2);
+    freeVectors(&polar);
+    freeVectors(&scalar);
+    freeVectors(&batch);
+    if(failed)
+    {
+        printf("main %d: FAILED\n", __LINE__);
+        return 1;
+    }
+    printf("main %d: passed\n", __LINE__);
+    return 0;
+}
@@ -0,0 +1,203 @@
+// check the closed form plane solutions in 3dstuff.h against the bisection
+// they replaced.  Exits with 1 if an error is out of bounds.
+
+// gcc -O2 3dstuff_test.c -o 3dstuff_test -lm
+
+#include "3dstuff.h"
+
+#define TOTAL_POINTS 200000
+// the bisections stop when the step is under 0.0001.  The bounds leave
+// some room for the last step.
+#define MAX_POLAR_ERROR 0.0005
+#define MAX_FRACTION_ERROR 0.0002
+#define MAX_ROUND_TRIP_ERROR 0.00001
+
+// the old XYZToPolar X before the plane slope
+double bisect_planeX(double goalX, double z)
+{
+    double x = goalX;
+    double step = fabs(x) / 2;
+    while(step > 0.0001)
+    {
+        double topX = x * cosPlane;
+        double topZ = planeIntercept + x * sinPlane;
+        double slope = (topX - x) / topZ;
+        double testX = x + z * slope;
+        if(testX < goalX)
+        {
+            x += step;
+        }
+        else
+        {
+            x -= step;
+        }
+
+        step /= 2;
+    }
+    return x;
+}
+
+vector_t bisect_XYZToPolar(vector_t xyz)
+{
+    double x = xyz.x;
+    if(fabs(planeAngle) > 0.001)
+    {
+        x = bisect_planeX(x, xyz.z);
+    }
+    return (vector_t){ atan2(-xyz.y, x), hypot(x, xyz.y), xyz.z };
+}
+
+// the old intersectionPoint2
+vector_t bisect_intersectionPoint2(vector_t xyz1,
+    vector_t xyz2,
+    double planeIntercept,
+    double planeSlope)
+{
+    double testFraction = 0.5;
+    double step = 0.5;
+    vector_t testPoint;
+    vector_t diff = subVectors(xyz2, xyz1);
+    while(step > 0.0001)
+    {
+        testPoint = addVectors(xyz1,
+            scaleVector(testFraction, diff));
+        double testZ = planeIntercept + testPoint.x * planeSlope;
+        step /= 2;
+        if(testPoint.z > testZ)
+        {
+            testFraction -= step;
+        }
+        else
+        {
+            testFraction += step;
+        }
+    }
+
+    return testPoint;
+}
+
+double random_range(double min, double max)
+{
+    return min + rand() / (double)RAND_MAX * (max - min);
+}
+
+void set_plane(double angle, double intercept)
+{
+    planeAngle = angle;
+    planeIntercept = intercept;
+    cosPlane = cos(angle);
+    sinPlane = sin(angle);
+}
+
+int test_polar()
+{
+// the goals are reachable at these angles
+    double angles[] = { 0.05, 0.3, -0.4 };
+    int total_angles = sizeof(angles) / sizeof(double);
+    int failed = 0;
+    int i, j;
+    for(i = 0; i < total_angles; i++)
+    {
+        double max_arc = 0;
+        double max_radius = 0;
+        double max_round_trip = 0;
+        set_plane(angles[i], 40);
+        for(j = 0; j < TOTAL_POINTS; j++)
+        {
+            vector_t xyz = { random_range(-30, 30),
+                random_range(-30, 30),
+                random_range(0, 40) };
+            vector_t polar = XYZToPolar(xyz);
+            vector_t expected = bisect_XYZToPolar(xyz);
+            double arc = fabs(polar.x - expected.x);
+            if(arc > M_PI)
+            {
+                arc = 2 * M_PI - arc;
+            }
+            max_arc = fmax(max_arc, arc * expected.y);
+            max_radius = fmax(max_radius, fabs(polar.y - expected.y));
+
+            vector_t xyz2 = polarToXYZ(polar);
+            max_round_trip = fmax(max_round_trip,
+                hypot3(xyz2.x - xyz.x, xyz2.y - xyz.y, xyz2.z - xyz.z));
+        }
+
+        printf("test_polar: plane=%g arc error=%g radius error=%g round trip error=%g\n",
+            angles[i],
+            max_arc,
+            max_radius,
+            max_round_trip);
+        if(max_arc > MAX_POLAR_ERROR ||
+            max_radius > MAX_POLAR_ERROR ||
+            max_round_trip > MAX_ROUND_TRIP_ERROR)
+        {
+            printf("test_polar %d: plane=%g is out of bounds\n", __LINE__, angles[i]);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+int test_intersection()
+{
+    double max_error = 0;
+    double max_plane_error = 0;
+    int failed = 0;
+    int i;
+    for(i = 0; i < TOTAL_POINTS; i++)
+    {
+        vector_t xyz1 = { random_range(-50, 50), random_range(0, 10), random_range(0, 20) };
+        vector_t xyz2 = { random_range(-50, 50), random_range(0, 10), random_range(30, 50) };
+        double intercept = random_range(10, 40);
+        double slope = random_range(-0.2, 0.2);
+        double height1 = xyz1.z - (intercept + xyz1.x * slope);
+        double height2 = xyz2.z - (intercept + xyz2.x * slope);
+// the bisection only works on lines rising through the plane
+        if(height2 <= height1)
+        {
+            continue;
+        }
+
+        vector_t point = intersectionPoint2(xyz1, xyz2, intercept, slope);
+        vector_t expected = bisect_intersectionPoint2(xyz1, xyz2, intercept, slope);
+        vector_t diff = subVectors(xyz2, xyz1);
+// the bisection's error is a fraction of the line
+        double error = hypot3(point.x - expected.x,
+            point.y - expected.y,
+            point.z - expected.z) / magnitude(diff);
+        max_error = fmax(max_error, error);
+
+// unclamped points are on the plane
+        if(height1 < 0 && height2 > 0)
+        {
+            max_plane_error = fmax(max_plane_error, 
+                fabs(point.z - (intercept + point.x * slope)));
+        }
+    }
+
+    printf("test_intersection: fraction error=%g plane error=%g\n",
+        max_error,
+        max_plane_error);
+    if(max_error > MAX_FRACTION_ERROR ||
+        max_plane_error > MAX_ROUND_TRIP_ERROR)
+    {
+        printf("test_intersection %d: out of bounds\n", __LINE__);
+        failed = 1;
+    }
+    return failed;
+}
+
+int main()
+{
+    int failed = 0;
+    srand(1);
+    failed |= test_polar();
+    failed |= test_intersection();
+    if(failed)
+    {
+        printf("main %d: FAILED\n", __LINE__);
+        return 1;
+    }
+    printf("main %d: passed\n", __LINE__);
+    return 0;
+}
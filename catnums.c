@@ -1,17 +1,436 @@
 // cat a bunch of files by filename numbers
 
+// The files are copied in-process with copy_file_range or splice so the
+// kernel can avoid user space copies & reflink where supported.  Falls back
+// to large reads.
+
+// The validation mode checks MPEG-TS sync bytes, continuity counters & PCR
+// order across the segment boundaries while copying.
 
 // gcc -O2 -o catnums catnums.c
 
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 
 
 
 #define TEXTLEN 1024
+#define BUFFER_SIZE 0x100000
+#define TS_PACKET 188
+#define TS_SYNC 0x47
+#define TOTAL_PIDS 0x2000
+#define NULL_PID 0x1fff
+// 27Mhz PCR clock
+#define PCR_CLOCK 27000000LL
+#define PCR_WRAP ((1LL << 33) * 300)
+// PCR jump which indicates missing data
+#define PCR_GAP (PCR_CLOCK * 5)
+// errors to print per segment
+#define MAX_REPORTS 10
+
+// methods which work for the output
+#define COPY_FILE_RANGE 0
+#define SPLICE 1
+#define READ_WRITE 2
+int copy_method = COPY_FILE_RANGE;
+
+// returns 1 on a write error
+int copy_segment(int in_fd, int out_fd, const char *path)
+{
+    struct stat ostat;
+    ssize_t result = 0;
+    if(fstat(in_fd, &ostat))
+    {
+        return 0;
+    }
+    off_t remaining = ostat.st_size;
+
+    if(copy_method == COPY_FILE_RANGE)
+    {
+        while(remaining > 0)
+        {
+            result = copy_file_range(in_fd, 0, out_fd, 0, remaining, 0);
+            if(result <= 0)
+            {
+                break;
+            }
+            remaining -= result;
+        }
+
+        if(remaining == 0)
+        {
+            return 0;
+        }
+
+// not supported between these files.  Continue with the next method.
+        if(result < 0 &&
+            (errno == EXDEV || 
+            errno == EINVAL || 
+            errno == ENOSYS || 
+            errno == EBADF ||
+            errno == EOPNOTSUPP))
+        {
+            copy_method = SPLICE;
+        }
+        else
+        if(result < 0)
+        {
+            perror("copy_segment: copy_file_range");
+            return 1;
+        }
+    }
+
+    if(copy_method == SPLICE)
+    {
+        while(remaining > 0)
+        {
+            result = splice(in_fd, 0, out_fd, 0, remaining, SPLICE_F_MOVE);
+            if(result <= 0)
+            {
+                break;
+            }
+            remaining -= result;
+        }
+
+        if(remaining == 0)
+        {
+            return 0;
+        }
+
+// only works if the output is a pipe
+        if(result < 0 && errno == EINVAL)
+        {
+            copy_method = READ_WRITE;
+        }
+        else
+        if(result < 0)
+        {
+            perror("copy_segment: splice");
+            return 1;
+        }
+    }
+
+// the input may have changed size or the fast methods failed
+    static char *buffer = 0;
+    if(!buffer)
+    {
+        buffer = malloc(BUFFER_SIZE);
+    }
+
+    while((result = read(in_fd, buffer, BUFFER_SIZE)) > 0)
+    {
+        char *ptr = buffer;
+        while(result > 0)
+        {
+            ssize_t written = write(out_fd, ptr, result);
+            if(written <= 0)
+            {
+                perror("copy_segment: write");
+                return 1;
+            }
+            ptr += written;
+            result -= written;
+        }
+    }
+
+    if(result < 0)
+    {
+        fprintf(stderr, "catnums: %s: %s\n", path, strerror(errno));
+    }
+    return 0;
+}
+
+
+// validation state carried across segments
+typedef struct
+{
+    int validate;
+// last continuity counter or -1
+    int8_t cc[TOTAL_PIDS];
+// the last packet had a payload with the same counter
+    uint8_t repeated[TOTAL_PIDS];
+// last PCR or -1
+    int64_t pcr[TOTAL_PIDS];
+    uint64_t last_hash;
+    int segment_reports;
+    int total_segments;
+    int64_t total_packets;
+    int total_corrupt;
+    int total_cc_errors;
+    int total_pcr_errors;
+    int total_gaps;
+    int total_duplicates;
+    int total_truncated;
+} validate_t;
+
+validate_t validation;
+
+void report(const char *path, int64_t packet, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+void report(const char *path, int64_t packet, const char *format, ...)
+{
+    va_list ap;
+    if(validation.segment_reports++ >= MAX_REPORTS)
+    {
+        return;
+    }
+
+    if(packet >= 0)
+    {
+        fprintf(stderr, "catnums: %s: packet %lld: ", path, (long long)packet);
+    }
+    else
+    {
+        fprintf(stderr, "catnums: %s: ", path);
+    }
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+}
+
+uint64_t hash_data(const uint8_t *data, size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+    for(i = 0; i < size; i += 8)
+    {
+        uint64_t k = 0;
+        memcpy(&k, data + i, size - i < 8 ? size - i : 8);
+        h = (h ^ k) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+void validate_packet(const uint8_t *packet, const char *path, int64_t number)
+{
+    int pid = ((packet[1] & 0x1f) << 8) | packet[2];
+    int adaptation = (packet[3] >> 4) & 0x3;
+    int cc = packet[3] & 0xf;
+    int discontinuity = 0;
+
+    if(packet[1] & 0x80)
+    {
+        report(path, number, "transport error on PID 0x%x", pid);
+        validation.total_corrupt++;
+        return;
+    }
+
+    if(pid == NULL_PID)
+    {
+        return;
+    }
+
+// adaptation field
+    if((adaptation & 0x2) && packet[4] > 0)
+    {
+        int length = packet[4];
+        int flags = packet[5];
+        if(length > TS_PACKET - 5)
+        {
+            report(path, number, "adaptation field too long on PID 0x%x", pid);
+            validation.total_corrupt++;
+            return;
+        }
+
+        discontinuity = flags & 0x80;
+        if((flags & 0x10) && length >= 7)
+        {
+            int64_t base = ((int64_t)packet[6] << 25) |
+                (packet[7] << 17) |
+                (packet[8] << 9) |
+                (packet[9] << 1) |
+                (packet[10] >> 7);
+            int extension = ((packet[10] & 0x1) << 8) | packet[11];
+            int64_t pcr = base * 300 + extension;
+            int64_t last = validation.pcr[pid];
+
+            if(last >= 0 && !discontinuity)
+            {
+                int64_t diff = pcr - last;
+                if(diff < -PCR_WRAP / 2)
+                {
+                    diff += PCR_WRAP;
+                }
+                else
+                if(diff > PCR_WRAP / 2)
+                {
+                    diff -= PCR_WRAP;
+                }
+
+                if(diff < 0)
+                {
+                    report(path, number, 
+                        "PCR went back %.3fs on PID 0x%x",
+                        (double)-diff / PCR_CLOCK,
+                        pid);
+                    validation.total_pcr_errors++;
+                }
+                else
+                if(diff > PCR_GAP)
+                {
+                    report(path, number, 
+                        "PCR jumped %.3fs on PID 0x%x",
+                        (double)diff / PCR_CLOCK,
+                        pid);
+                    validation.total_gaps++;
+                }
+            }
+            validation.pcr[pid] = pcr;
+        }
+    }
+
+// continuity counter only increments on packets with payloads
+    int last = validation.cc[pid];
+    if(last >= 0 && !discontinuity)
+    {
+        if(adaptation & 0x1)
+        {
+            if(cc == last)
+            {
+// 1 duplicate packet is allowed
+                if(validation.repeated[pid])
+                {
+                    report(path, number, "repeated continuity counter %d on PID 0x%x", cc, pid);
+                    validation.total_cc_errors++;
+                }
+                validation.repeated[pid] = 1;
+            }
+            else
+            {
+                if(cc != ((last + 1) & 0xf))
+                {
+                    report(path, number, 
+                        "continuity counter %d expected %d on PID 0x%x.  %d packets lost",
+                        cc,
+                        (last + 1) & 0xf,
+                        pid,
+                        (cc - last - 1) & 0xf);
+                    validation.total_cc_errors++;
+                }
+                validation.repeated[pid] = 0;
+            }
+        }
+        else
+        if(cc != last)
+        {
+            report(path, number, "continuity counter changed without payload on PID 0x%x", pid);
+            validation.total_cc_errors++;
+        }
+    }
+    validation.cc[pid] = cc;
+}
+
+void validate_segment(const uint8_t *data, size_t size, const char *path)
+{
+    size_t offset = 0;
+    int64_t number = 0;
+
+    validation.segment_reports = 0;
+    validation.total_segments++;
+
+    uint64_t hash = hash_data(data, size);
+    if(validation.total_segments > 1 && hash == validation.last_hash)
+    {
+        report(path, -1, "duplicate of the previous segment");
+        validation.total_duplicates++;
+    }
+    validation.last_hash = hash;
+
+    while(offset + TS_PACKET <= size)
+    {
+        if(data[offset] != TS_SYNC)
+        {
+// find the next 2 sync bytes 1 packet apart
+            size_t start = offset;
+            offset++;
+            while(offset + TS_PACKET < size &&
+                (data[offset] != TS_SYNC || data[offset + TS_PACKET] != TS_SYNC))
+            {
+                offset++;
+            }
+// the search stops at the last packet without finding sync
+            if(data[offset] != TS_SYNC)
+            {
+                report(path, number, "lost sync for %d bytes", (int)(size - start));
+                validation.total_corrupt++;
+                offset = size;
+                break;
+            }
+            report(path, number, "lost sync for %d bytes", (int)(offset - start));
+            validation.total_corrupt++;
+        }
+
+        validate_packet(data + offset, path, number);
+        validation.total_packets++;
+        number++;
+        offset += TS_PACKET;
+    }
+
+    if(offset < size)
+    {
+        report(path, number, "truncated.  %d bytes left over", (int)(size - offset));
+        validation.total_truncated++;
+    }
+}
+
+// copy & validate the data in 1 pass
+// returns 1 on a write error
+int validate_copy(int in_fd, int out_fd, const char *path)
+{
+    struct stat ostat;
+    if(fstat(in_fd, &ostat))
+    {
+        return 0;
+    }
+
+    if(ostat.st_size == 0)
+    {
+        validate_segment(0, 0, path);
+        return 0;
+    }
+
+    const uint8_t *data = mmap(0, ostat.st_size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+    if(data == MAP_FAILED)
+    {
+        fprintf(stderr, "catnums: %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    madvise((void*)data, ostat.st_size, MADV_SEQUENTIAL);
+
+    validate_segment(data, ostat.st_size, path);
+
+    const uint8_t *ptr = data;
+    size_t remaining = ostat.st_size;
+    while(remaining > 0)
+    {
+        ssize_t written = write(out_fd, ptr, remaining);
+        if(written <= 0)
+        {
+            perror("validate_copy: write");
+            munmap((void*)data, ostat.st_size);
+            return 1;
+        }
+        ptr += written;
+        remaining -= written;
+    }
+
+    munmap((void*)data, ostat.st_size);
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -21,7 +440,10 @@ int main(int argc, char *argv[])
         printf("so 100 comes before 1000.\n");
         printf("Usage: catnums <filename format> <start number> <end number inclusive>\n");
         printf(" -n dry run\n");
+        printf(" -o <path> write to a file instead of stdout\n");
+        printf(" -v validate MPEG-TS packets & report gaps, duplicates & corruption on stderr\n");
         printf("Example: catnums %%d.ts 0 1600\n");
+        printf("Example: catnums -o movie.ts %%d.ts 0 1600\n");
         exit(1);
     }
     
@@ -30,6 +452,7 @@ int main(int argc, char *argv[])
     const char *filename;
     const char *start_number;
     const char *end_number;
+    const char *output_path = 0;
     int argument = 0;
    
     for(i = 1; i < argc; i++)
@@ -39,6 +462,16 @@ int main(int argc, char *argv[])
             dry_run = 1;
         }
         else
+        if(!strcmp(argv[i], "-v"))
+        {
+            validation.validate = 1;
+        }
+        else
+        if(!strcmp(argv[i], "-o") && i < argc - 1)
+        {
+            output_path = argv[++i];
+        }
+        else
         if(argument == 0)
         {
             filename = argv[i];
@@ -62,22 +495,79 @@ int main(int argc, char *argv[])
     int start_number1 = atoi(start_number);
     int end_number1 = atoi(end_number);
     char *filename2 = malloc(strlen(filename) + TEXTLEN);
-    char *string2 = malloc(strlen(filename) + TEXTLEN);
+    int out_fd = STDOUT_FILENO;
+    memset(validation.cc, 0xff, sizeof(validation.cc));
+    for(i = 0; i < TOTAL_PIDS; i++)
+    {
+        validation.pcr[i] = -1;
+    }
+
+    if(output_path && !dry_run)
+    {
+        out_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(out_fd < 0)
+        {
+            printf("main %d: Couldn't open %s\n", __LINE__, output_path);
+            perror("");
+            exit(1);
+        }
+    }
 
     for(i = start_number1; i <= end_number1; i++)
     {
         sprintf(filename2, filename, i);
-        sprintf(string2, "cat %s", filename2);
         if(!dry_run)
         {
-            system(string2);
+            int in_fd = open(filename2, O_RDONLY);
+            if(in_fd < 0)
+            {
+                fprintf(stderr, "catnums: %s: %s\n", filename2, strerror(errno));
+                if(validation.validate)
+                {
+                    validation.total_gaps++;
+                }
+                continue;
+            }
+
+            int error;
+            if(validation.validate)
+            {
+                error = validate_copy(in_fd, out_fd, filename2);
+            }
+            else
+            {
+                error = copy_segment(in_fd, out_fd, filename2);
+            }
+            close(in_fd);
+            if(error)
+            {
+                exit(1);
+            }
         }
         else
         {
-            printf("main %d: %s\n", __LINE__, string2);
+            printf("main %d: cat %s\n", __LINE__, filename2);
         }
     }
-    
-}
 
+    if(out_fd != STDOUT_FILENO)
+    {
+        close(out_fd);
+    }
+
+    if(validation.validate && !dry_run)
+    {
+        fprintf(stderr, 
+            "catnums: segments=%d packets=%lld corrupt=%d continuity errors=%d\n"
+            "    PCR errors=%d gaps=%d duplicate segments=%d truncated segments=%d\n",
+            validation.total_segments,
+            (long long)validation.total_packets,
+            validation.total_corrupt,
+            validation.total_cc_errors,
+            validation.total_pcr_errors,
+            validation.total_gaps,
+            validation.total_duplicates,
+            validation.total_truncated);
+    }
+}
 
@@ -24,31 +24,61 @@
 // find differences between 2 directories between files of only the given types
 // then print the missing files
 
+// Files with the same contents are detected by a content hash instead of
+// running diff.  The hashes are cached in ~/.diffdir_cache by
+// device, inode, size, mtime & ctime so unchanged files aren't reread.
+
 // gcc -g diffdir.c -o /usr/bin/diffdir
 
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #define MAX_EXTENSIONS 64
+#define MAX_DIRS 26
 #define TEXTLEN 1024
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 
-char dir1[TEXTLEN] = { 0 };
-char dir2[TEXTLEN] = { 0 };
+char dirs[MAX_DIRS][TEXTLEN] = { 0 };
+int total_dirs = 2;
+char *dir1 = dirs[0];
+char *dir2 = dirs[1];
 char *extensions[MAX_EXTENSIONS] = { 0 };
 int total_extensions = 0;
 // only show filenames
 int files_only = 1;
 // ignore files starting in .
 int ignore_hidden = 1;
+// use the hash cache
+int use_cache = 1;
+// print results while walking the directories
+int stream_mode = 0;
+// match files missing from each directory by content
+int detect_renames = 1;
+// stop after this many changed files if > 0
+int limit = 0;
+int total_changed = 0;
+char cache_path[TEXTLEN] = { 0 };
 
 typedef struct
 {
     char *string;
     struct timespec date;
+// identity of the file for the hash cache
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec ctime;
+// content hash if have_hash is set
+    uint64_t hash;
+    int have_hash;
 } file_t;
 
 typedef struct
@@ -77,11 +107,24 @@ typedef struct
     file_t *file;
     char *dir1;
     char *dir2;
+// matched to a missing file in the other directory
+    int renamed;
 } missing_file_t;
 missing_file_t *missing_files;
 int total_missing_files = 0;
 
-void append_vector(vector_t *vector, char *string, struct timespec date)
+void init_file(file_t *file, char *string, struct stat *ostat)
+{
+    bzero(file, sizeof(file_t));
+    file->string = strdup(string);
+    file->date = ostat->st_mtim;
+    file->dev = ostat->st_dev;
+    file->ino = ostat->st_ino;
+    file->size = ostat->st_size;
+    file->ctime = ostat->st_ctim;
+}
+
+void append_vector(vector_t *vector, char *string, struct stat *ostat)
 {
     if(vector->allocated < vector->size + 1)
     {
@@ -106,8 +149,7 @@ void append_vector(vector_t *vector, char *string, struct timespec date)
     }
     
     
-    vector->files[vector->size].string = strdup(string);
-    vector->files[vector->size].date = date;
+    init_file(&vector->files[vector->size], string, ostat);
     vector->size++;
 }
 
@@ -168,6 +210,403 @@ char* get_relpath(file_t *file, char *dir)
     return relpath;
 }
 
+// hash cache file format:
+// an 8 byte magic number followed by cache_record_t's.  New records are
+// only appended to the end & the last record for a key wins.
+#define CACHE_MAGIC "DDCACHE1"
+#define CACHE_MAGIC_SIZE 8
+// don't cache files modified this recently since they can change again
+// without changing the mtime
+#define RACY_SECONDS 2
+// rewrite the file when it has this many records & most are stale
+#define COMPACT_RECORDS 65536
+
+typedef struct
+{
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t hash;
+// detects torn records from a crashed writer
+    uint64_t check;
+} cache_record_t;
+
+// records in the mmapped file or new_records, indexed by key
+cache_record_t **cache_table = 0;
+int cache_table_size = 0;
+int cache_table_used = 0;
+// mmapped cache file
+cache_record_t *cache_records = 0;
+int total_cache_records = 0;
+void *cache_map = 0;
+size_t cache_map_size = 0;
+// records to append when we're done
+cache_record_t *new_records = 0;
+int total_new_records = 0;
+int allocated_new_records = 0;
+time_t start_time;
+
+uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+uint64_t hash_data(const uint8_t *data, size_t size)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+    size_t i;
+    for(i = 0; i + 8 <= size; i += 8)
+    {
+        uint64_t k;
+        memcpy(&k, data + i, 8);
+        h = (h ^ mix64(k)) * 0x100000001b3ULL;
+    }
+
+    uint64_t k = 0;
+    memcpy(&k, data + i, size - i);
+    h ^= mix64(k ^ (size - i));
+    return mix64(h);
+}
+
+uint64_t record_check(cache_record_t *record)
+{
+    return hash_data((uint8_t*)record, sizeof(cache_record_t) - sizeof(uint64_t));
+}
+
+uint64_t key_hash(uint64_t dev, uint64_t ino)
+{
+    return mix64(dev * 0x9e3779b97f4a7c15ULL ^ ino);
+}
+
+int64_t to_ns(struct timespec t)
+{
+    return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+void put_cache_table(cache_record_t *record);
+
+void grow_cache_table()
+{
+    cache_record_t **old_table = cache_table;
+    int old_size = cache_table_size;
+    int i;
+
+    cache_table_size = old_size ? old_size * 2 : 1024;
+    cache_table = calloc(sizeof(cache_record_t*), cache_table_size);
+    cache_table_used = 0;
+    for(i = 0; i < old_size; i++)
+    {
+        if(old_table[i])
+        {
+            put_cache_table(old_table[i]);
+        }
+    }
+    free(old_table);
+}
+
+// insert or replace the record with the same dev & inode
+void put_cache_table(cache_record_t *record)
+{
+    if((cache_table_used + 1) * 2 > cache_table_size)
+    {
+        grow_cache_table();
+    }
+
+    int mask = cache_table_size - 1;
+    int i = key_hash(record->dev, record->ino) & mask;
+    while(cache_table[i])
+    {
+        if(cache_table[i]->dev == record->dev &&
+            cache_table[i]->ino == record->ino)
+        {
+            cache_table[i] = record;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    cache_table[i] = record;
+    cache_table_used++;
+}
+
+cache_record_t* get_cache_table(uint64_t dev, uint64_t ino)
+{
+    if(!cache_table_size)
+    {
+        return 0;
+    }
+
+    int mask = cache_table_size - 1;
+    int i = key_hash(dev, ino) & mask;
+    while(cache_table[i])
+    {
+        if(cache_table[i]->dev == dev &&
+            cache_table[i]->ino == ino)
+        {
+            return cache_table[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return 0;
+}
+
+void load_cache()
+{
+    start_time = time(0);
+    if(!use_cache)
+    {
+        return;
+    }
+
+    int fd = open(cache_path, O_RDONLY);
+    if(fd < 0)
+    {
+        return;
+    }
+
+// wait for any writer to finish appending
+    flock(fd, LOCK_SH);
+    struct stat ostat;
+    fstat(fd, &ostat);
+    if(ostat.st_size > CACHE_MAGIC_SIZE)
+    {
+        cache_map_size = ostat.st_size;
+        cache_map = mmap(0, cache_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(cache_map == MAP_FAILED)
+        {
+            cache_map = 0;
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    if(!cache_map)
+    {
+        return;
+    }
+
+    if(memcmp(cache_map, CACHE_MAGIC, CACHE_MAGIC_SIZE))
+    {
+        printf("load_cache %d: %s isn't a diffdir cache\n", __LINE__, cache_path);
+        munmap(cache_map, cache_map_size);
+        cache_map = 0;
+        use_cache = 0;
+        return;
+    }
+
+    cache_records = (cache_record_t*)((uint8_t*)cache_map + CACHE_MAGIC_SIZE);
+    total_cache_records = (cache_map_size - CACHE_MAGIC_SIZE) / sizeof(cache_record_t);
+    int i;
+    for(i = 0; i < total_cache_records; i++)
+    {
+        cache_record_t *record = &cache_records[i];
+        if(record->check == record_check(record))
+        {
+            put_cache_table(record);
+        }
+    }
+}
+
+// get the content hash from the cache or by reading the file
+// returns 1 if the file couldn't be read
+int get_hash(file_t *file)
+{
+    if(file->have_hash)
+    {
+        return 0;
+    }
+
+    cache_record_t *record = get_cache_table(file->dev, file->ino);
+    if(record &&
+        record->size == file->size &&
+        record->mtime_ns == to_ns(file->date) &&
+        record->ctime_ns == to_ns(file->ctime))
+    {
+        file->hash = record->hash;
+        file->have_hash = 1;
+        return 0;
+    }
+
+    int fd = open(file->string, O_RDONLY);
+    if(fd < 0)
+    {
+        return 1;
+    }
+
+    struct stat ostat;
+    fstat(fd, &ostat);
+    if(ostat.st_size > 0)
+    {
+        void *data = mmap(0, ostat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED)
+        {
+            close(fd);
+            return 1;
+        }
+        file->hash = hash_data(data, ostat.st_size);
+        munmap(data, ostat.st_size);
+    }
+    else
+    {
+        file->hash = hash_data(0, 0);
+    }
+    close(fd);
+    file->have_hash = 1;
+
+// don't cache it if it changed since the listing or might change again
+// in the same timestamp
+    if(!use_cache ||
+        ostat.st_ino != file->ino ||
+        ostat.st_size != file->size ||
+        to_ns(ostat.st_mtim) != to_ns(file->date) ||
+        to_ns(ostat.st_ctim) != to_ns(file->ctime) ||
+        ostat.st_mtim.tv_sec >= start_time - RACY_SECONDS ||
+        ostat.st_ctim.tv_sec >= start_time - RACY_SECONDS)
+    {
+        return 0;
+    }
+
+    if(total_new_records >= allocated_new_records)
+    {
+// records in the table point to new_records so they can't move
+        allocated_new_records = MAX(allocated_new_records * 2, 1024);
+        cache_record_t *new_block = calloc(sizeof(cache_record_t), allocated_new_records);
+        int i;
+        for(i = 0; i < total_new_records; i++)
+        {
+            new_block[i] = new_records[i];
+            put_cache_table(&new_block[i]);
+        }
+        free(new_records);
+        new_records = new_block;
+    }
+
+    record = &new_records[total_new_records++];
+    record->dev = file->dev;
+    record->ino = file->ino;
+    record->size = file->size;
+    record->mtime_ns = to_ns(file->date);
+    record->ctime_ns = to_ns(file->ctime);
+    record->hash = file->hash;
+    record->check = record_check(record);
+    put_cache_table(record);
+    return 0;
+}
+
+// returns 1 if the files are known to have the same contents
+int same_contents(file_t *file1, file_t *file2)
+{
+    if(file1->size != file2->size)
+    {
+        return 0;
+    }
+
+    if(get_hash(file1) || get_hash(file2))
+    {
+        return 0;
+    }
+
+    return file1->hash == file2->hash;
+}
+
+// append the new records to the cache file
+void save_cache()
+{
+    if(!use_cache || !total_new_records)
+    {
+        return;
+    }
+
+    int fd;
+    while(1)
+    {
+        fd = open(cache_path, O_RDWR | O_CREAT, 0644);
+        if(fd < 0)
+        {
+            printf("save_cache %d: couldn't open %s\n", __LINE__, cache_path);
+            return;
+        }
+
+        flock(fd, LOCK_EX);
+// another process may have replaced the file while we waited
+        struct stat fd_stat;
+        struct stat path_stat;
+        fstat(fd, &fd_stat);
+        if(!stat(cache_path, &path_stat) &&
+            path_stat.st_dev == fd_stat.st_dev &&
+            path_stat.st_ino == fd_stat.st_ino)
+        {
+            break;
+        }
+        close(fd);
+    }
+
+    struct stat ostat;
+    fstat(fd, &ostat);
+    off_t offset = ostat.st_size;
+    if(offset < CACHE_MAGIC_SIZE)
+    {
+        if(ftruncate(fd, 0) ||
+            pwrite(fd, CACHE_MAGIC, CACHE_MAGIC_SIZE, 0) != CACHE_MAGIC_SIZE)
+        {
+            printf("save_cache %d: couldn't write %s\n", __LINE__, cache_path);
+            flock(fd, LOCK_UN);
+            close(fd);
+            return;
+        }
+        offset = CACHE_MAGIC_SIZE;
+    }
+    else
+    {
+// drop a torn record from a crashed writer so the records stay aligned
+        offset -= (offset - CACHE_MAGIC_SIZE) % sizeof(cache_record_t);
+    }
+
+    int total_records = (offset - CACHE_MAGIC_SIZE) / sizeof(cache_record_t) +
+        total_new_records;
+    if(total_records > COMPACT_RECORDS &&
+        total_records > cache_table_used * 2)
+    {
+// mostly stale records.  Replace the file with the live records.
+        char temp_path[TEXTLEN + 32];
+        sprintf(temp_path, "%s.%d", cache_path, getpid());
+        FILE *temp = fopen(temp_path, "w");
+        if(temp)
+        {
+            int i;
+            fwrite(CACHE_MAGIC, 1, CACHE_MAGIC_SIZE, temp);
+            for(i = 0; i < cache_table_size; i++)
+            {
+                if(cache_table[i])
+                {
+                    fwrite(cache_table[i], sizeof(cache_record_t), 1, temp);
+                }
+            }
+            fclose(temp);
+            rename(temp_path, cache_path);
+            flock(fd, LOCK_UN);
+            close(fd);
+            return;
+        }
+    }
+
+    if(pwrite(fd, 
+        new_records, 
+        sizeof(cache_record_t) * total_new_records, 
+        offset) != (ssize_t)(sizeof(cache_record_t) * total_new_records))
+    {
+        printf("save_cache %d: couldn't write %s\n", __LINE__, cache_path);
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
 int sort_compare(const void *ptr1, const void *ptr2)
 {
 	file_t *item1 = (file_t*)ptr1;
@@ -186,7 +625,11 @@ int sort_compare(const void *ptr1, const void *ptr2)
 //     }
 // }
 
-void listdir(char *dir, vector_t *dst)
+// call the callback for every file in the directory as find prints it.
+// Stops if the callback returns 1.
+void walkdir(char *dir, 
+    int (*callback)(char *path, struct stat *ostat, void *arg),
+    void *arg)
 {
     int i;
     char string[TEXTLEN];
@@ -264,24 +707,39 @@ void listdir(char *dir, vector_t *dst)
         
         if(!skip)
         {
-            append_vector(dst, string, ostat.st_mtim);
+            if(callback(string, &ostat, arg))
+            {
+                break;
+            }
         }
     }
     fclose(fd);
     
     if(!got_line)
     {
-        printf("listdir %d: command failed command=%s fd=%p\n", 
+        printf("walkdir %d: command failed command=%s fd=%p\n", 
             __LINE__, 
             string2, 
             fd);
     }
+}
+
+int listdir_callback(char *path, struct stat *ostat, void *arg)
+{
+    append_vector((vector_t*)arg, path, ostat);
+    return 0;
+}
+
+void listdir(char *dir, vector_t *dst)
+{
+    walkdir(dir, listdir_callback, dst);
 // sort by date
     qsort(dst->files, dst->size, sizeof(file_t), sort_compare);
 }
 
 
-void the_diff(char *relpath,
+// returns 1 if the files differed
+int the_diff(char *relpath,
     file_t *file1, 
     file_t *file2)
 {
@@ -341,6 +799,7 @@ void the_diff(char *relpath,
     }
     
     fclose(fd);
+    return total > 0;
 }
 
 
@@ -359,7 +818,16 @@ int diff_order_compare(const void *ptr1, const void *ptr2)
     file2 = &dir2_files.files[item2->index2];
     int64_t date2 = MAX(file1->date.tv_sec, file2->date.tv_sec);
 
-	return date1 < date2;
+// newest first
+    if(date1 < date2)
+    {
+        return 1;
+    }
+    if(date1 > date2)
+    {
+        return -1;
+    }
+    return 0;
 }
 
 int missing_file_compare(const void *ptr1, const void *ptr2)
@@ -367,7 +835,16 @@ int missing_file_compare(const void *ptr1, const void *ptr2)
 	missing_file_t *item1 = (missing_file_t*)ptr1;
 	missing_file_t *item2 = (missing_file_t*)ptr2;
 
-	return item1->file->date.tv_sec < item2->file->date.tv_sec;
+// newest first
+    if(item1->file->date.tv_sec < item2->file->date.tv_sec)
+    {
+        return 1;
+    }
+    if(item1->file->date.tv_sec > item2->file->date.tv_sec)
+    {
+        return -1;
+    }
+    return 0;
 }
 
 
@@ -408,26 +885,816 @@ void get_missing_files(vector_t *dir1_files,
     }
 }
 
+
+// streaming mode:
+// pairs & missing files go into a bounded queue as find prints them.  When
+// the queue is full, the newest one is compared & printed so the output is
+// approximately newest first.
+#define STREAM_WINDOW 256
+
+typedef struct
+{
+    file_t *file1;
+// 0 if file1 is missing from dir2
+    file_t *file2;
+    char *dir1;
+    char *dir2;
+    int64_t date;
+} stream_item_t;
+
+stream_item_t stream_heap[STREAM_WINDOW];
+int stream_heap_size = 0;
+
+void push_stream(stream_item_t *item)
+{
+    int i = stream_heap_size++;
+    while(i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if(stream_heap[parent].date >= item->date)
+        {
+            break;
+        }
+        stream_heap[i] = stream_heap[parent];
+        i = parent;
+    }
+    stream_heap[i] = *item;
+}
+
+// remove the newest item
+void pop_stream(stream_item_t *item)
+{
+    *item = stream_heap[0];
+    stream_item_t last = stream_heap[--stream_heap_size];
+    int i = 0;
+    while(1)
+    {
+        int child = i * 2 + 1;
+        if(child >= stream_heap_size)
+        {
+            break;
+        }
+        if(child + 1 < stream_heap_size &&
+            stream_heap[child + 1].date > stream_heap[child].date)
+        {
+            child++;
+        }
+        if(last.date >= stream_heap[child].date)
+        {
+            break;
+        }
+        stream_heap[i] = stream_heap[child];
+        i = child;
+    }
+    stream_heap[i] = last;
+}
+
+void free_file(file_t *file)
+{
+    if(file)
+    {
+        free(file->string);
+        free(file);
+    }
+}
+
+void emit_stream(stream_item_t *item)
+{
+    char *relpath = get_relpath(item->file1, item->dir1);
+    if(item->file2)
+    {
+        if(!same_contents(item->file1, item->file2) &&
+            the_diff(relpath, item->file1, item->file2))
+        {
+            total_changed++;
+        }
+    }
+    else
+    {
+        char date_string[TEXTLEN];
+        printf("%s %s exists in %s but not %s\n", 
+            date_to_string(item->file1->date, date_string),
+            relpath,
+            item->dir1,
+            item->dir2);
+    }
+    fflush(stdout);
+
+    free_file(item->file1);
+    free_file(item->file2);
+}
+
+// returns 1 if the limit was reached
+int flush_stream(int all)
+{
+    while(stream_heap_size > 0 &&
+        (all || stream_heap_size >= STREAM_WINDOW))
+    {
+        stream_item_t item;
+        pop_stream(&item);
+        emit_stream(&item);
+        if(limit > 0 && total_changed >= limit)
+        {
+            while(stream_heap_size > 0)
+            {
+                pop_stream(&item);
+                free_file(item.file1);
+                free_file(item.file2);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// files in dir1: queue the pair or the missing file
+int stream_callback1(char *path, struct stat *ostat, void *arg __attribute__((unused)))
+{
+    stream_item_t item;
+    char path2[TEXTLEN * 2];
+    struct stat ostat2;
+
+    bzero(&item, sizeof(item));
+    item.file1 = calloc(1, sizeof(file_t));
+    init_file(item.file1, path, ostat);
+    item.dir1 = dir1;
+    item.dir2 = dir2;
+    item.date = ostat->st_mtim.tv_sec;
+
+    sprintf(path2, "%s%s", dir2, get_relpath(item.file1, dir1));
+    if(!stat(path2, &ostat2) && !S_ISDIR(ostat2.st_mode))
+    {
+        item.file2 = calloc(1, sizeof(file_t));
+        init_file(item.file2, path2, &ostat2);
+        item.date = MAX(item.date, ostat2.st_mtim.tv_sec);
+    }
+
+    push_stream(&item);
+    return flush_stream(0);
+}
+
+// files in dir2: only queue the missing files
+int stream_callback2(char *path, struct stat *ostat, void *arg __attribute__((unused)))
+{
+    stream_item_t item;
+    char path1[TEXTLEN * 2];
+    struct stat ostat1;
+
+    bzero(&item, sizeof(item));
+    item.file1 = calloc(1, sizeof(file_t));
+    init_file(item.file1, path, ostat);
+    item.dir1 = dir2;
+    item.dir2 = dir1;
+    item.date = ostat->st_mtim.tv_sec;
+
+    sprintf(path1, "%s%s", dir1, get_relpath(item.file1, dir2));
+    if(!stat(path1, &ostat1) && !S_ISDIR(ostat1.st_mode))
+    {
+        free_file(item.file1);
+        return 0;
+    }
+
+    push_stream(&item);
+    return flush_stream(0);
+}
+
+void stream_diffs()
+{
+    if(limit > 0 && total_changed >= limit)
+    {
+        return;
+    }
+
+    walkdir(dir1, stream_callback1, 0);
+    if(flush_stream(1))
+    {
+        return;
+    }
+
+    walkdir(dir2, stream_callback2, 0);
+    flush_stream(1);
+}
+
+
+// N way mode:
+// every directory is listed once & the files are grouped by relative path.
+// Each file is hashed at most once.
+typedef struct
+{
+    char *relpath;
+// file in each directory or 0 if it's missing
+    file_t *files[MAX_DIRS];
+// letter for each directory.  Same letter = same contents
+    char classes[MAX_DIRS + 1];
+    int64_t date;
+} nway_row_t;
+
+nway_row_t *nway_rows = 0;
+int total_nway_rows = 0;
+int allocated_nway_rows = 0;
+// relpath -> row index + 1
+int *nway_table = 0;
+int nway_table_size = 0;
+
+uint64_t hash_string(const char *string)
+{
+    return hash_data((const uint8_t*)string, strlen(string));
+}
+
+nway_row_t* get_nway_row(char *relpath)
+{
+    int mask = nway_table_size - 1;
+    int i = hash_string(relpath) & mask;
+    while(nway_table[i])
+    {
+        nway_row_t *row = &nway_rows[nway_table[i] - 1];
+        if(!strcmp(row->relpath, relpath))
+        {
+            return row;
+        }
+        i = (i + 1) & mask;
+    }
+
+    if(total_nway_rows >= allocated_nway_rows)
+    {
+        allocated_nway_rows = MAX(allocated_nway_rows * 2, 1024);
+        nway_rows = realloc(nway_rows, sizeof(nway_row_t) * allocated_nway_rows);
+    }
+
+    nway_row_t *row = &nway_rows[total_nway_rows++];
+    bzero(row, sizeof(nway_row_t));
+    row->relpath = relpath;
+    nway_table[i] = total_nway_rows;
+    return row;
+}
+
+int nway_compare(const void *ptr1, const void *ptr2)
+{
+	nway_row_t *item1 = (nway_row_t*)ptr1;
+	nway_row_t *item2 = (nway_row_t*)ptr2;
+// newest first
+    if(item1->date < item2->date)
+    {
+        return 1;
+    }
+    if(item1->date > item2->date)
+    {
+        return -1;
+    }
+    return strcmp(item1->relpath, item2->relpath);
+}
+
+void nway_diff()
+{
+    vector_t *dir_files = calloc(sizeof(vector_t), total_dirs);
+    int total_files = 0;
+    int i, j, k;
+
+    for(i = 0; i < total_dirs; i++)
+    {
+        listdir(dirs[i], &dir_files[i]);
+        total_files += dir_files[i].size;
+    }
+
+// group the files by relative path
+    nway_table_size = 1024;
+    while(nway_table_size < total_files * 2)
+    {
+        nway_table_size *= 2;
+    }
+    nway_table = calloc(sizeof(int), nway_table_size);
+    for(i = 0; i < total_dirs; i++)
+    {
+        for(j = 0; j < dir_files[i].size; j++)
+        {
+            file_t *file = &dir_files[i].files[j];
+            nway_row_t *row = get_nway_row(get_relpath(file, dirs[i]));
+            row->files[i] = file;
+            row->date = MAX(row->date, file->date.tv_sec);
+        }
+    }
+
+// assign a letter to each group of identical files
+    for(i = 0; i < total_nway_rows; i++)
+    {
+        nway_row_t *row = &nway_rows[i];
+        int total_classes = 0;
+// 1st directory with each letter
+        int representative[MAX_DIRS];
+        for(j = 0; j < total_dirs; j++)
+        {
+            file_t *file = row->files[j];
+            if(!file)
+            {
+                row->classes[j] = '-';
+                continue;
+            }
+
+            for(k = 0; k < total_classes; k++)
+            {
+                if(same_contents(row->files[representative[k]], file))
+                {
+                    break;
+                }
+            }
+
+            if(k == total_classes)
+            {
+                representative[total_classes++] = j;
+            }
+            row->classes[j] = 'A' + k;
+        }
+    }
+
+    qsort(nway_rows, total_nway_rows, sizeof(nway_row_t), nway_compare);
+
+    for(i = 0; i < total_dirs; i++)
+    {
+        printf("column %d: %s\n", i + 1, dirs[i]);
+    }
+
+    for(i = 0; i < total_nway_rows; i++)
+    {
+        nway_row_t *row = &nway_rows[i];
+        int agree = 1;
+        for(j = 0; j < total_dirs; j++)
+        {
+            if(row->classes[j] != 'A')
+            {
+                agree = 0;
+                break;
+            }
+        }
+
+        if(agree)
+        {
+            continue;
+        }
+
+        if(limit > 0 && total_changed >= limit)
+        {
+            break;
+        }
+        total_changed++;
+
+        struct timespec date = { row->date, 0 };
+        char date_string[TEXTLEN];
+        printf("%s ", date_to_string(date, date_string));
+        for(j = 0; j < total_dirs; j++)
+        {
+            printf("%c", row->classes[j]);
+        }
+        printf(" %s\n", row->relpath);
+    }
+}
+
+
+// rename detection:
+// files missing from each directory are joined on the content hash for
+// exact moves.  The rest are joined on a MinHash of line shingles for
+// edited moves.  Candidates come from locality sensitive hashing of the
+// MinHash bands so it doesn't compare every pair.
+#define MINHASH_SIZE 32
+#define MINHASH_BANDS 16
+#define MINHASH_ROWS (MINHASH_SIZE / MINHASH_BANDS)
+// consecutive lines in a shingle
+#define SHINGLE_LINES 3
+// minimum estimated similarity for an edited move
+#define RENAME_SIMILARITY 0.5
+// ignore bands shared by this many files.  Boilerplate.
+#define MAX_BUCKET 64
+// Smaller files are plain adds & deletes.  Empty files & tiny boilerplate
+// files all look the same so they'd be paired with each other.
+#define MIN_RENAME_SIZE 64
+
+typedef struct
+{
+    missing_file_t *missing;
+    uint64_t minhash[MINHASH_SIZE];
+    int have_minhash;
+    int matched;
+} rename_file_t;
+
+typedef struct
+{
+// in the directory the file exists in
+    rename_file_t *old_file;
+    rename_file_t *new_file;
+    int similarity;
+    int64_t date;
+} rename_t;
+
+int rename_compare(const void *ptr1, const void *ptr2)
+{
+	rename_t *item1 = (rename_t*)ptr1;
+	rename_t *item2 = (rename_t*)ptr2;
+// highest similarity first for matching
+    return item2->similarity - item1->similarity;
+}
+
+int rename_date_compare(const void *ptr1, const void *ptr2)
+{
+	rename_t *item1 = (rename_t*)ptr1;
+	rename_t *item2 = (rename_t*)ptr2;
+    if(item1->date < item2->date)
+    {
+        return 1;
+    }
+    if(item1->date > item2->date)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// returns 1 if the file couldn't be read
+int get_minhash(rename_file_t *file)
+{
+    int i;
+    if(file->have_minhash)
+    {
+        return 0;
+    }
+
+    file_t *src = file->missing->file;
+    int fd = open(src->string, O_RDONLY);
+    if(fd < 0)
+    {
+        return 1;
+    }
+
+    struct stat ostat;
+    fstat(fd, &ostat);
+    size_t size = ostat.st_size;
+    uint8_t *data = 0;
+    if(size > 0)
+    {
+        data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED)
+        {
+            close(fd);
+            return 1;
+        }
+    }
+    close(fd);
+
+    for(i = 0; i < MINHASH_SIZE; i++)
+    {
+        file->minhash[i] = UINT64_MAX;
+    }
+
+// hashes of the last SHINGLE_LINES lines
+    uint64_t lines[SHINGLE_LINES] = { 0 };
+    int total_lines = 0;
+    size_t start = 0;
+    size_t end;
+    for(end = 0; end <= size; end++)
+    {
+        if(end < size && data[end] != '\n')
+        {
+            continue;
+        }
+
+// ignore trailing whitespace
+        size_t line_end = end;
+        while(line_end > start && 
+            (data[line_end - 1] == ' ' || 
+            data[line_end - 1] == '\t' ||
+            data[line_end - 1] == '\r'))
+        {
+            line_end--;
+        }
+
+        if(line_end > start || end < size)
+        {
+            memmove(lines, lines + 1, sizeof(uint64_t) * (SHINGLE_LINES - 1));
+            lines[SHINGLE_LINES - 1] = hash_data(data + start, line_end - start);
+            total_lines++;
+
+            if(total_lines >= SHINGLE_LINES || end >= size)
+            {
+                uint64_t shingle = hash_data((uint8_t*)lines, sizeof(lines));
+                for(i = 0; i < MINHASH_SIZE; i++)
+                {
+                    uint64_t value = mix64(shingle ^ 
+                        (0x9e3779b97f4a7c15ULL * (i + 1)));
+                    if(value < file->minhash[i])
+                    {
+                        file->minhash[i] = value;
+                    }
+                }
+            }
+        }
+        start = end + 1;
+    }
+
+    if(data)
+    {
+        munmap(data, size);
+    }
+    file->have_minhash = 1;
+    return 0;
+}
+
+// estimated fraction of shingles in common * 100
+int minhash_similarity(rename_file_t *a, rename_file_t *b)
+{
+    int i;
+    int same = 0;
+    for(i = 0; i < MINHASH_SIZE; i++)
+    {
+        if(a->minhash[i] == b->minhash[i])
+        {
+            same++;
+        }
+    }
+    return same * 100 / MINHASH_SIZE;
+}
+
+// print renames & remove them from the missing files
+void find_renames()
+{
+    int i, j, k;
+    int total_old = 0;
+    int total_new = 0;
+    rename_file_t *old_files = calloc(sizeof(rename_file_t), total_missing_files);
+    rename_file_t *new_files = calloc(sizeof(rename_file_t), total_missing_files);
+    rename_t *renames = calloc(sizeof(rename_t), total_missing_files);
+    int total_renames = 0;
+
+    for(i = 0; i < total_missing_files; i++)
+    {
+        missing_file_t *missing = &missing_files[i];
+        if(missing->file->size < MIN_RENAME_SIZE ||
+            get_hash(missing->file))
+        {
+            continue;
+        }
+
+        if(missing->dir1 == dir1)
+        {
+            old_files[total_old++].missing = missing;
+        }
+        else
+        {
+            new_files[total_new++].missing = missing;
+        }
+    }
+
+    if(!total_old || !total_new)
+    {
+        free(old_files);
+        free(new_files);
+        free(renames);
+        return;
+    }
+
+// exact moves
+    int table_size = 1024;
+    while(table_size < total_new * 2)
+    {
+        table_size *= 2;
+    }
+    int mask = table_size - 1;
+// new file index + 1
+    int *table = calloc(sizeof(int), table_size);
+    for(i = 0; i < total_new; i++)
+    {
+        k = mix64(new_files[i].missing->file->hash) & mask;
+        while(table[k])
+        {
+            k = (k + 1) & mask;
+        }
+        table[k] = i + 1;
+    }
+
+    for(i = 0; i < total_old; i++)
+    {
+        file_t *old_file = old_files[i].missing->file;
+        k = mix64(old_file->hash) & mask;
+        while(table[k])
+        {
+            rename_file_t *new_file = &new_files[table[k] - 1];
+            if(!new_file->matched &&
+                same_contents(old_file, new_file->missing->file))
+            {
+                old_files[i].matched = 1;
+                new_file->matched = 1;
+                rename_t *rename = &renames[total_renames++];
+                rename->old_file = &old_files[i];
+                rename->new_file = new_file;
+                rename->similarity = 100;
+                break;
+            }
+            k = (k + 1) & mask;
+        }
+    }
+    free(table);
+
+// edited moves.  Bucket the new files by each band of the MinHash.
+    uint64_t band_size = 1024;
+    while(band_size < (uint64_t)total_new * MINHASH_BANDS * 2)
+    {
+        band_size *= 2;
+    }
+    uint64_t band_mask = band_size - 1;
+    int *band_table = calloc(sizeof(int), band_size);
+    uint64_t *band_keys = calloc(sizeof(uint64_t), band_size);
+    for(i = 0; i < total_new; i++)
+    {
+        rename_file_t *new_file = &new_files[i];
+        if(new_file->matched || get_minhash(new_file))
+        {
+            continue;
+        }
+
+        for(j = 0; j < MINHASH_BANDS; j++)
+        {
+            uint64_t key = hash_data((uint8_t*)&new_file->minhash[j * MINHASH_ROWS],
+                sizeof(uint64_t) * MINHASH_ROWS) + j;
+            k = key & band_mask;
+            while(band_table[k])
+            {
+                k = (k + 1) & band_mask;
+            }
+            band_table[k] = i + 1;
+            band_keys[k] = key;
+        }
+    }
+
+    int allocated_candidates = total_old;
+    int total_candidates = 0;
+    rename_t *candidates = calloc(sizeof(rename_t), allocated_candidates);
+// last old file each new file was a candidate for
+    int *seen = calloc(sizeof(int), total_new);
+    for(i = 0; i < total_old; i++)
+    {
+        rename_file_t *old_file = &old_files[i];
+        if(old_file->matched || get_minhash(old_file))
+        {
+            continue;
+        }
+
+        for(j = 0; j < MINHASH_BANDS; j++)
+        {
+            uint64_t key = hash_data((uint8_t*)&old_file->minhash[j * MINHASH_ROWS],
+                sizeof(uint64_t) * MINHASH_ROWS) + j;
+            int bucket = 0;
+            k = key & band_mask;
+            while(band_table[k] && bucket < MAX_BUCKET)
+            {
+                int new_index = band_table[k] - 1;
+                if(band_keys[k] == key && seen[new_index] != i + 1)
+                {
+                    bucket++;
+                    seen[new_index] = i + 1;
+                    int similarity = minhash_similarity(old_file, &new_files[new_index]);
+// identical files were already matched
+                    if(similarity > 99)
+                    {
+                        similarity = 99;
+                    }
+                    if(similarity >= RENAME_SIMILARITY * 100)
+                    {
+                        if(total_candidates >= allocated_candidates)
+                        {
+                            allocated_candidates *= 2;
+                            candidates = realloc(candidates, 
+                                sizeof(rename_t) * allocated_candidates);
+                        }
+                        rename_t *candidate = &candidates[total_candidates++];
+                        candidate->old_file = old_file;
+                        candidate->new_file = &new_files[new_index];
+                        candidate->similarity = similarity;
+                    }
+                }
+                k = (k + 1) & band_mask;
+            }
+        }
+    }
+    free(seen);
+    free(band_table);
+    free(band_keys);
+
+// take the most similar pairs first
+    qsort(candidates, total_candidates, sizeof(rename_t), rename_compare);
+    for(i = 0; i < total_candidates; i++)
+    {
+        rename_t *candidate = &candidates[i];
+        if(!candidate->old_file->matched && !candidate->new_file->matched)
+        {
+            candidate->old_file->matched = 1;
+            candidate->new_file->matched = 1;
+            renames[total_renames++] = *candidate;
+        }
+    }
+    free(candidates);
+
+    for(i = 0; i < total_renames; i++)
+    {
+        rename_t *rename = &renames[i];
+        rename->old_file->missing->renamed = 1;
+        rename->new_file->missing->renamed = 1;
+        rename->date = MAX(rename->old_file->missing->file->date.tv_sec,
+            rename->new_file->missing->file->date.tv_sec);
+    }
+    qsort(renames, total_renames, sizeof(rename_t), rename_date_compare);
+
+    for(i = 0; i < total_renames; i++)
+    {
+        rename_t *rename = &renames[i];
+        file_t *old_file = rename->old_file->missing->file;
+        file_t *new_file = rename->new_file->missing->file;
+        struct timespec date = { rename->date, 0 };
+        char date_string[TEXTLEN];
+        date_to_string(date, date_string);
+        if(rename->similarity == 100)
+        {
+            printf("%s %s renamed to %s\n", 
+                date_string,
+                old_file->string,
+                new_file->string);
+        }
+        else
+        {
+            printf("%s meld \"%s\" \"%s\" renamed %d%% similar\n", 
+                date_string,
+                old_file->string,
+                new_file->string,
+                rename->similarity);
+        }
+    }
+
+    free(old_files);
+    free(new_files);
+    free(renames);
+}
+
 void main(int argc, char *argv[])
 {
     if(argc < 3)
     {
-        printf("Usage: diffdir <directory 1> <directory 2> [file extension] [file extension]\n");
+        printf("Usage: diffdir [options] <directory 1> <directory 2> [file extension] [file extension]\n");
+        printf(" -c <path> hash cache file.  Default is ~/.diffdir_cache\n");
+        printf(" -C don't use the hash cache\n");
+        printf(" -s print results while walking the directories, approximately newest first\n");
+        printf(" -R don't detect renamed files\n");
+        printf(" -l, --limit <N> stop after the N most recent changed files\n");
+        printf(" -N <count> compare this many directories.  Prints which directories\n");
+        printf("    agree for each file.  Same letter = same contents, - = missing\n");
         printf("Example: diffdir old new java kt c\n");
+        printf("Example: diffdir -N 3 base fork1 fork2 c h\n");
         exit(1);
     }
 
     int i;
+    int argument = 0;
+    char *home = getenv("HOME");
+    sprintf(cache_path, "%s/.diffdir_cache", home ? home : ".");
     for(i = 1; i < argc; i++)
     {
-        if(i == 1)
+        if(!strcmp(argv[i], "-c") && i < argc - 1)
+        {
+            strcpy(cache_path, argv[++i]);
+        }
+        else
+        if(!strcmp(argv[i], "-C"))
+        {
+            use_cache = 0;
+        }
+        else
+        if(!strcmp(argv[i], "-s"))
+        {
+            stream_mode = 1;
+        }
+        else
+        if(!strcmp(argv[i], "-R"))
+        {
+            detect_renames = 0;
+        }
+        else
+        if((!strcmp(argv[i], "-l") || !strcmp(argv[i], "--limit")) && 
+            i < argc - 1)
+        {
+            limit = atoi(argv[++i]);
+        }
+        else
+        if(!strcmp(argv[i], "-N") && i < argc - 1)
         {
-            strcpy(dir1, argv[i]);
+            total_dirs = atoi(argv[++i]);
+            if(total_dirs < 2 || total_dirs > MAX_DIRS)
+            {
+                printf("main %d: number of directories must be 2-%d\n", 
+                    __LINE__, 
+                    MAX_DIRS);
+                exit(1);
+            }
         }
         else
-        if(i == 2)
+        if(argument < total_dirs)
         {
-            strcpy(dir2, argv[i]);
+            strcpy(dirs[argument], argv[i]);
+            argument++;
         }
         else
         if(total_extensions < MAX_EXTENSIONS)
@@ -436,14 +1703,28 @@ void main(int argc, char *argv[])
         }
     }
 
-    if(strlen(dir1) > 0 && dir1[strlen(dir1) - 1] != '/')
+    for(i = 0; i < total_dirs; i++)
+    {
+        if(strlen(dirs[i]) > 0 && dirs[i][strlen(dirs[i]) - 1] != '/')
+        {
+            strcat(dirs[i], "/");
+        }
+    }
+
+    load_cache();
+
+    if(total_dirs > 2)
     {
-        strcat(dir1, "/");
+        nway_diff();
+        save_cache();
+        return;
     }
 
-    if(strlen(dir2) > 0 && dir1[strlen(dir2) - 1] != '/')
+    if(stream_mode)
     {
-        strcat(dir2, "/");
+        stream_diffs();
+        save_cache();
+        return;
     }
 
 // list the contents of the directories
@@ -488,23 +1769,47 @@ void main(int argc, char *argv[])
         
         char *relpath1 = get_relpath(&dir1_files.files[index1], dir1);
         char *relpath2 = get_relpath(&dir2_files.files[index2], dir2);
-            
-        the_diff(relpath1, 
+
+        if(limit > 0 && total_changed >= limit)
+        {
+            break;
+        }
+
+// diff wouldn't print anything
+        if(same_contents(&dir1_files.files[index1], 
+            &dir2_files.files[index2]))
+        {
+            continue;
+        }
+
+        if(the_diff(relpath1, 
             &dir1_files.files[index1], 
-            &dir2_files.files[index2]);
+            &dir2_files.files[index2]))
+        {
+            total_changed++;
+        }
     }
 
 // show files which don't exist
     missing_files = calloc(sizeof(missing_file_t), dir1_files.size + dir2_files.size);
     get_missing_files(&dir1_files, &dir2_files, dir1, dir2);
     get_missing_files(&dir2_files, &dir1_files, dir2, dir1);
-    
+
+    if(detect_renames)
+    {
+        find_renames();
+    }
     
     qsort(missing_files, total_missing_files, sizeof(missing_file_t), missing_file_compare);
 
     
     for(i = 0; i < total_missing_files; i++)
     {
+        if(missing_files[i].renamed)
+        {
+            continue;
+        }
+
         file_t *file = missing_files[i].file;
         char *relpath1 = get_relpath(file, missing_files[i].dir1);
         char date_string[TEXTLEN];
@@ -515,6 +1820,7 @@ void main(int argc, char *argv[])
             missing_files[i].dir2);
     }
 
+    save_cache();
 }
 
 
@@ -1,32 +1,1545 @@
 // download a segmented video file using a formatting code for the number
 
+// The segments are fetched in-process by a pool of workers.  Each worker
+// keeps its connection alive between segments so only the 1st segment pays
+// for the TCP & TLS handshakes.  Certificates aren't checked, like
+// wget --no-check-certificate.
 
-// gcc -O2 -o segments2 segments2.c
+// With -o, the segments are written straight into 1 output file in order.
+// Segments which finish early wait in a reorder buffer of 2 segments per
+// worker.  A .progress file next to the output allows resuming.
 
+// Given an .m3u8 playlist instead of a number range, the segments come from
+// the playlist.  Live playlists are refreshed until they end.  The number of
+// concurrent downloads adapts to the measured throughput & latency.
+
+// gcc -O2 -o segments2 segments2.c -lpthread -lssl -lcrypto
+// make segments2_test downloads from segments2_test_server.py on localhost
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TEXTLEN 1024
+#define DEFAULT_WORKERS 4
+#define MAX_WORKERS 64
+// jobs waiting for a worker
+#define QUEUE_SIZE 64
+#define MAX_RETRIES 5
+// 1st retry delay in ms.  Doubles for each retry.
+#define RETRY_DELAY 500
+#define MAX_REDIRECTS 5
+// socket timeout in seconds
+#define TIMEOUT 30
+#define READ_BUFFER 0x10000
+// default maximum concurrent downloads for playlists
+#define DEFAULT_HLS_WORKERS 16
+// playlist fetch attempts before giving up on a live stream
+#define PLAYLIST_RETRIES 5
+
+// fetch results other than HTTP status codes
+#define FETCH_OK 0
+#define FETCH_NETWORK -1
+#define FETCH_PROTOCOL -2
+
+typedef struct
+{
+    int https;
+    char host[TEXTLEN];
+    int port;
+// includes the query
+    char path[TEXTLEN];
+} url_t;
+
+typedef struct
+{
+    int fd;
+    SSL *ssl;
+    int https;
+    char host[TEXTLEN];
+    int port;
+// has been used for a previous request
+    int reused;
+    char buffer[READ_BUFFER];
+    int offset;
+    int size;
+} connection_t;
+
+typedef struct
+{
+    char *data;
+    size_t size;
+    size_t allocated;
+} buffer_t;
+
+typedef struct
+{
+// order of the segment in the output
+    int index;
+    char *url;
+} job_t;
+
+// job states
+#define JOB_PENDING 0
+#define JOB_DONE 1
+#define JOB_FAILED 2
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t queue_space = PTHREAD_COND_INITIALIZER;
+job_t queue[QUEUE_SIZE];
+int queue_head = 0;
+int queue_count = 0;
+// no more jobs will be added
+int queue_finished = 0;
+
+// ordered completion index
+char *job_states = 0;
+int total_jobs = 0;
+int allocated_jobs = 0;
+// every job before this is done or failed
+int next_complete = 0;
+// every segment before this is on disk in output mode
+int next_written = 0;
+// a thread is writing the segments between next_written & next_complete
+int writing = 0;
+// 1st job after resuming
+int first_job = 0;
+int total_failed = 0;
+char **failed_urls = 0;
+// failed before resuming.  Included in total_failed.
+int total_restored = 0;
+// segments which dropped out of a live playlist
+int total_skipped = 0;
+
+// output file mode
+int out_fd = -1;
+// the next segment is written here
+int64_t out_offset = 0;
+char *progress_path = 0;
+// identifies the download in the progress file
+const char *progress_url = 0;
+int progress_start = 0;
+int progress_step = 0;
+// segments which finished early, indexed by job % reorder_size
+buffer_t *reorder = 0;
+int reorder_size = 0;
+
+// playlist mode
+int hls_mode = 0;
+// maximum jobs running concurrently.  0 to run 1 per worker.
+int concurrency = 0;
+int max_concurrency = 0;
+int active_jobs = 0;
+// AIMD measurement round.  A round ends when concurrency jobs have finished.
+double round_start = 0;
+int64_t round_bytes = 0;
+double round_latency = 0;
+int round_count = 0;
+double prev_throughput = 0;
+double prev_latency = 0;
+
+typedef struct
+{
+// media sequence number of job 0
+    int base_sequence;
+// next media sequence number to add
+    int next_sequence;
+// 1st job for a media sequence, after the init segment
+    int sequence_job;
+    int have_map;
+    int target_duration;
+    int ended;
+// the previous playlist, to skip parsing when nothing changed
+    char *prev_text;
+} hls_t;
+
+SSL_CTX *ssl_context = 0;
+int dry_run = 0;
+
+int parse_url(url_t *dst, const char *url)
+{
+    const char *ptr = url;
+    if(!strncasecmp(ptr, "https://", 8))
+    {
+        dst->https = 1;
+        dst->port = 443;
+        ptr += 8;
+    }
+    else
+    if(!strncasecmp(ptr, "http://", 7))
+    {
+        dst->https = 0;
+        dst->port = 80;
+        ptr += 7;
+    }
+    else
+    {
+        return 1;
+    }
+
+    const char *end = ptr;
+    while(*end && *end != '/' && *end != '?' && *end != ':')
+    {
+        end++;
+    }
+    if(end == ptr || end - ptr >= TEXTLEN)
+    {
+        return 1;
+    }
+    memcpy(dst->host, ptr, end - ptr);
+    dst->host[end - ptr] = 0;
+
+    if(*end == ':')
+    {
+        dst->port = strtol(end + 1, (char**)&end, 10);
+    }
+
+    if(*end == '/')
+    {
+        snprintf(dst->path, TEXTLEN, "%s", end);
+    }
+    else
+    {
+        snprintf(dst->path, TEXTLEN, "/%s", end);
+    }
+    return 0;
+}
+
+// remove . & .. components from the path of a URL
+void remove_dots(char *url)
+{
+    char *host = strstr(url, "://");
+    char *path = host ? host + 3 : url;
+    path += strcspn(path, "/?");
+    if(*path != '/')
+    {
+        return;
+    }
+
+    char *src = path;
+    char *dst = path;
+    while(*src && *src != '?')
+    {
+        if(!strncmp(src, "/./", 3) || !strcmp(src, "/.") ||
+            !strncmp(src, "/.?", 3))
+        {
+            src += 2;
+            if(*src != '/')
+            {
+                *dst++ = '/';
+            }
+        }
+        else
+        if(!strncmp(src, "/../", 4) || !strcmp(src, "/..") ||
+            !strncmp(src, "/..?", 4))
+        {
+            src += 3;
+            while(dst > path && *--dst != '/')
+            {
+            }
+            if(*src != '/')
+            {
+                *dst++ = '/';
+            }
+        }
+        else
+        {
+            *dst++ = *src++;
+        }
+    }
+    memmove(dst, src, strlen(src) + 1);
+}
+
+// resolve a URL relative to a base URL
+void resolve_url(char *dst, const char *base, const char *url)
+{
+    if(strstr(url, "://"))
+    {
+        snprintf(dst, TEXTLEN, "%s", url);
+        return;
+    }
+
+    const char *host = strstr(base, "://");
+    host = host ? host + 3 : base;
+    if(url[0] == '/' && url[1] == '/')
+    {
+        snprintf(dst, TEXTLEN, "%.*s%s", (int)(host - base - 2), base, url);
+        remove_dots(dst);
+        return;
+    }
+
+    const char *path = host;
+    while(*path && *path != '/' && *path != '?')
+    {
+        path++;
+    }
+    if(url[0] == '/')
+    {
+        snprintf(dst, TEXTLEN, "%.*s%s", (int)(path - base), base, url);
+        remove_dots(dst);
+        return;
+    }
+
+// directory of the base path, without the query
+    const char *query = strchr(path, '?');
+    const char *dir_end = query ? query : path + strlen(path);
+    while(dir_end > path && dir_end[-1] != '/')
+    {
+        dir_end--;
+    }
+    if(dir_end == path)
+    {
+        snprintf(dst, TEXTLEN, "%.*s/%s", (int)(path - base), base, url);
+    }
+    else
+    {
+        snprintf(dst, TEXTLEN, "%.*s%s", (int)(dir_end - base), base, url);
+    }
+    remove_dots(dst);
+}
+
+double get_time()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (double)now.tv_nsec / 1000000000;
+}
+
+void append_buffer(buffer_t *buffer, const char *data, size_t size)
+{
+    if(buffer->size + size > buffer->allocated)
+    {
+        size_t new_allocated = buffer->allocated ? buffer->allocated * 2 : READ_BUFFER;
+        while(new_allocated < buffer->size + size)
+        {
+            new_allocated *= 2;
+        }
+        buffer->data = realloc(buffer->data, new_allocated);
+        buffer->allocated = new_allocated;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+void close_connection(connection_t *conn)
+{
+    if(conn->ssl)
+    {
+        SSL_free(conn->ssl);
+        conn->ssl = 0;
+    }
+    if(conn->fd >= 0)
+    {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->offset = 0;
+    conn->size = 0;
+    conn->reused = 0;
+}
+
+int open_connection(connection_t *conn, const url_t *url)
+{
+    if(conn->fd >= 0 &&
+        conn->https == url->https &&
+        conn->port == url->port &&
+        !strcasecmp(conn->host, url->host))
+    {
+        return 0;
+    }
+
+    close_connection(conn);
+
+    struct addrinfo hints;
+    struct addrinfo *result;
+    char port_text[TEXTLEN];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(port_text, "%d", url->port);
+    int error = getaddrinfo(url->host, port_text, &hints, &result);
+    if(error)
+    {
+        fprintf(stderr, "open_connection: %s: %s\n", url->host, gai_strerror(error));
+        return 1;
+    }
+
+    struct addrinfo *ptr;
+    for(ptr = result; ptr; ptr = ptr->ai_next)
+    {
+        conn->fd = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+        if(conn->fd < 0)
+        {
+            continue;
+        }
+
+        struct timeval timeout = { TIMEOUT, 0 };
+        int one = 1;
+        setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if(!connect(conn->fd, ptr->ai_addr, ptr->ai_addrlen))
+        {
+            break;
+        }
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    freeaddrinfo(result);
+
+    if(conn->fd < 0)
+    {
+        fprintf(stderr, "open_connection: %s:%d: %s\n",
+            url->host,
+            url->port,
+            strerror(errno));
+        return 1;
+    }
+
+    if(url->https)
+    {
+        conn->ssl = SSL_new(ssl_context);
+        SSL_set_fd(conn->ssl, conn->fd);
+        SSL_set_tlsext_host_name(conn->ssl, url->host);
+        if(SSL_connect(conn->ssl) != 1)
+        {
+            fprintf(stderr, "open_connection: %s: TLS handshake failed\n", url->host);
+            close_connection(conn);
+            return 1;
+        }
+    }
+
+    conn->https = url->https;
+    conn->port = url->port;
+    strcpy(conn->host, url->host);
+    return 0;
+}
+
+int write_connection(connection_t *conn, const char *data, int size)
+{
+    while(size > 0)
+    {
+        int result;
+        if(conn->ssl)
+        {
+            result = SSL_write(conn->ssl, data, size);
+        }
+        else
+        {
+            result = send(conn->fd, data, size, MSG_NOSIGNAL);
+        }
+
+        if(result <= 0)
+        {
+            return 1;
+        }
+        data += result;
+        size -= result;
+    }
+    return 0;
+}
+
+// refill the read buffer.  Returns the number of bytes or <= 0 on EOF
+int fill_connection(connection_t *conn)
+{
+    int result;
+    if(conn->ssl)
+    {
+        result = SSL_read(conn->ssl, conn->buffer, READ_BUFFER);
+    }
+    else
+    {
+        result = recv(conn->fd, conn->buffer, READ_BUFFER, 0);
+    }
+
+    conn->offset = 0;
+    conn->size = result > 0 ? result : 0;
+    return result;
+}
+
+// read a line without the CR LF.  Returns 1 on EOF
+int read_line(connection_t *conn, char *dst)
+{
+    int len = 0;
+    while(1)
+    {
+        if(conn->offset >= conn->size && fill_connection(conn) <= 0)
+        {
+            return 1;
+        }
+
+        char c = conn->buffer[conn->offset++];
+        if(c == '\n')
+        {
+            break;
+        }
+        if(c != '\r' && len < TEXTLEN - 1)
+        {
+            dst[len++] = c;
+        }
+    }
+    dst[len] = 0;
+    return 0;
+}
+
+// read a number of bytes into the buffer or until EOF if size < 0
+int read_body(connection_t *conn, buffer_t *buffer, int64_t size)
+{
+    while(size != 0)
+    {
+        if(conn->offset >= conn->size && fill_connection(conn) <= 0)
+        {
+            return size < 0 ? 0 : 1;
+        }
+
+        int fragment = conn->size - conn->offset;
+        if(size > 0 && fragment > size)
+        {
+            fragment = size;
+        }
+        append_buffer(buffer, conn->buffer + conn->offset, fragment);
+        conn->offset += fragment;
+        if(size > 0)
+        {
+            size -= fragment;
+        }
+    }
+    return 0;
+}
+
+// send 1 GET request on the connection & read the response
+// returns FETCH_OK, FETCH_NETWORK, FETCH_PROTOCOL or the HTTP status
+int http_get(connection_t *conn,
+    const url_t *url,
+    buffer_t *buffer,
+    char *location)
+{
+    char string[TEXTLEN * 3];
+    char line[TEXTLEN];
+    char host[TEXTLEN + 16];
+    int64_t content_length = -1;
+    int chunked = 0;
+    int keep_alive = 1;
+    int status;
+    int default_port = url->https ? 443 : 80;
+
+    if(url->port == default_port)
+    {
+        sprintf(host, "%s", url->host);
+    }
+    else
+    {
+        sprintf(host, "%s:%d", url->host, url->port);
+    }
+    sprintf(string,
+        "GET %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "User-Agent: segments2\r\n"
+        "Accept: */*\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n",
+        url->path,
+        host);
+
+    if(write_connection(conn, string, strlen(string)) ||
+        read_line(conn, line))
+    {
+        return FETCH_NETWORK;
+    }
+
+    int minor_version;
+    if(sscanf(line, "HTTP/1.%d %d", &minor_version, &status) != 2)
+    {
+        return FETCH_PROTOCOL;
+    }
+    if(minor_version == 0)
+    {
+        keep_alive = 0;
+    }
+
+    location[0] = 0;
+    while(1)
+    {
+        if(read_line(conn, line))
+        {
+            return FETCH_NETWORK;
+        }
+        if(!line[0])
+        {
+            break;
+        }
+
+        char *value = strchr(line, ':');
+        if(!value)
+        {
+            continue;
+        }
+        *value++ = 0;
+        while(*value == ' ' || *value == '\t')
+        {
+            value++;
+        }
+
+        if(!strcasecmp(line, "Content-Length"))
+        {
+            content_length = atoll(value);
+        }
+        else
+        if(!strcasecmp(line, "Transfer-Encoding") && strcasestr(value, "chunked"))
+        {
+            chunked = 1;
+        }
+        else
+        if(!strcasecmp(line, "Connection"))
+        {
+            keep_alive = !strcasecmp(value, "keep-alive") ? 1 :
+                !strcasecmp(value, "close") ? 0 : keep_alive;
+        }
+        else
+        if(!strcasecmp(line, "Location"))
+        {
+            snprintf(location, TEXTLEN, "%s", value);
+        }
+    }
+
+    buffer->size = 0;
+    if(status == 204 || status == 304 || (status >= 100 && status < 200))
+    {
+    }
+    else
+    if(chunked)
+    {
+        while(1)
+        {
+            if(read_line(conn, line))
+            {
+                return FETCH_NETWORK;
+            }
+            int64_t chunk_size = strtoll(line, 0, 16);
+            if(chunk_size == 0)
+            {
+                break;
+            }
+            if(read_body(conn, buffer, chunk_size) ||
+                read_line(conn, line))
+            {
+                return FETCH_NETWORK;
+            }
+        }
+
+// trailers
+        do
+        {
+            if(read_line(conn, line))
+            {
+                return FETCH_NETWORK;
+            }
+        } while(line[0]);
+    }
+    else
+    if(content_length >= 0)
+    {
+        if(read_body(conn, buffer, content_length))
+        {
+            return FETCH_NETWORK;
+        }
+    }
+    else
+    {
+        read_body(conn, buffer, -1);
+        keep_alive = 0;
+    }
+
+    if(keep_alive)
+    {
+        conn->reused = 1;
+    }
+    else
+    {
+        close_connection(conn);
+    }
+    return status == 200 ? FETCH_OK : status;
+}
+
+// fetch a URL, following redirects
+int fetch_url(connection_t *conn, const char *url_text, buffer_t *buffer)
+{
+    char current[TEXTLEN];
+    char location[TEXTLEN];
+    int redirects;
+    snprintf(current, TEXTLEN, "%s", url_text);
+
+    for(redirects = 0; redirects <= MAX_REDIRECTS; redirects++)
+    {
+        url_t url;
+        if(parse_url(&url, current))
+        {
+            fprintf(stderr, "fetch_url: unsupported URL %s\n", current);
+            return FETCH_PROTOCOL;
+        }
+
+        if(open_connection(conn, &url))
+        {
+            return FETCH_NETWORK;
+        }
+
+        int reused = conn->reused;
+        int result = http_get(conn, &url, buffer, location);
+// the server may have closed an idle keep-alive connection
+        if(result == FETCH_NETWORK && reused)
+        {
+            close_connection(conn);
+            if(open_connection(conn, &url))
+            {
+                return FETCH_NETWORK;
+            }
+            result = http_get(conn, &url, buffer, location);
+        }
+
+        if(result < 0)
+        {
+            close_connection(conn);
+            return result;
+        }
+
+        if((result == 301 || result == 302 || result == 303 ||
+            result == 307 || result == 308) && location[0])
+        {
+            char next[TEXTLEN];
+            resolve_url(next, current, location);
+            strcpy(current, next);
+            continue;
+        }
+
+        return result;
+    }
+
+    fprintf(stderr, "fetch_url: too many redirects for %s\n", url_text);
+    return FETCH_PROTOCOL;
+}
+
+// the output filename is the last component of the path, like wget
+void url_to_filename(char *dst, const char *url)
+{
+    const char *end = strchr(url, '?');
+    if(!end)
+    {
+        end = url + strlen(url);
+    }
+    const char *start = end;
+    while(start > url && start[-1] != '/')
+    {
+        start--;
+    }
+    if(start == end)
+    {
+        strcpy(dst, "index.html");
+    }
+    else
+    {
+        snprintf(dst, TEXTLEN, "%.*s", (int)(end - start), start);
+    }
+}
+
+int write_file(const char *url, buffer_t *buffer)
+{
+    char filename[TEXTLEN];
+    char temp[TEXTLEN + 8];
+    url_to_filename(filename, url);
+    sprintf(temp, "%s.part", filename);
+
+    FILE *fd = fopen(temp, "w");
+    if(!fd)
+    {
+        printf("write_file %d: Couldn't open %s\n", __LINE__, temp);
+        perror("");
+        return 1;
+    }
+    int result = fwrite(buffer->data, 1, buffer->size, fd) != buffer->size;
+    result |= fclose(fd) != 0;
+    if(result)
+    {
+        printf("write_file %d: Couldn't write %s\n", __LINE__, temp);
+        unlink(temp);
+        return 1;
+    }
+    return rename(temp, filename);
+}
+
+void grow_jobs(int index)
+{
+    if(index >= allocated_jobs)
+    {
+        int new_allocated = allocated_jobs ? allocated_jobs * 2 : 256;
+        while(new_allocated <= index)
+        {
+            new_allocated *= 2;
+        }
+        job_states = realloc(job_states, new_allocated);
+        memset(job_states + allocated_jobs,
+            JOB_PENDING,
+            new_allocated - allocated_jobs);
+        allocated_jobs = new_allocated;
+    }
+}
+
+void add_job(int index, const char *url)
+{
+    if(dry_run)
+    {
+        printf("add_job %d: %s\n", index, url);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    while(queue_count >= QUEUE_SIZE)
+    {
+        pthread_cond_wait(&queue_space, &lock);
+    }
+
+    grow_jobs(index);
+    if(index >= total_jobs)
+    {
+        total_jobs = index + 1;
+    }
+
+    job_t *job = &queue[(queue_head + queue_count) % QUEUE_SIZE];
+    job->index = index;
+    job->url = strdup(url);
+    queue_count++;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&lock);
+}
+
+void finish_jobs()
+{
+    pthread_mutex_lock(&lock);
+    queue_finished = 1;
+    pthread_cond_broadcast(&queue_ready);
+    pthread_mutex_unlock(&lock);
+}
+
+// returns 1 if there are no more jobs
+int next_job(job_t *dst)
+{
+    pthread_mutex_lock(&lock);
+// don't start segments which have no room in the reorder buffer
+    while((queue_count == 0 && !queue_finished) ||
+        (queue_count > 0 &&
+        reorder_size > 0 &&
+        queue[queue_head].index >= next_written + reorder_size) ||
+        (queue_count > 0 &&
+        concurrency > 0 &&
+        active_jobs >= concurrency))
+    {
+        pthread_cond_wait(&queue_ready, &lock);
+    }
+
+    if(queue_count == 0)
+    {
+        pthread_mutex_unlock(&lock);
+        return 1;
+    }
+
+    *dst = queue[queue_head];
+    queue_head = (queue_head + 1) % QUEUE_SIZE;
+    queue_count--;
+    active_jobs++;
+    pthread_cond_signal(&queue_space);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void add_failed(const char *url)
+{
+    failed_urls = realloc(failed_urls, sizeof(char*) * (total_failed + 1));
+    failed_urls[total_failed] = strdup(url);
+    total_failed++;
+}
+
+// the progress file contents for the written segments.  Must be called with
+// the lock held.
+char* progress_text()
+{
+    char *text = 0;
+    size_t size = 0;
+    FILE *fd = open_memstream(&text, &size);
+    int i;
+    fprintf(fd, "url %s\n", progress_url);
+    fprintf(fd, "start %d\n", progress_start);
+    fprintf(fd, "step %d\n", progress_step);
+    fprintf(fd, "next %d\n", next_written);
+    fprintf(fd, "offset %lld\n", (long long)out_offset);
+    for(i = 0; i < next_written; i++)
+    {
+        if(job_states[i] == JOB_FAILED)
+        {
+            fprintf(fd, "failed %d\n", i);
+        }
+    }
+    fclose(fd);
+    return text;
+}
+
+// rewrite the progress file atomically
+void write_progress(const char *text)
+{
+    char temp[TEXTLEN + 8];
+    sprintf(temp, "%s.tmp", progress_path);
+    FILE *fd = fopen(temp, "w");
+    if(!fd)
+    {
+        printf("write_progress %d: Couldn't open %s\n", __LINE__, temp);
+        perror("");
+        return;
+    }
+
+    fputs(text, fd);
+    fclose(fd);
+    rename(temp, progress_path);
+}
 
-#define TEXTLEN 1024
+// returns the next job to resume from
+int read_progress()
+{
+    FILE *fd = fopen(progress_path, "r");
+    char string[TEXTLEN * 2];
+    int next = 0;
+    int64_t offset = 0;
+    int matches = 0;
+    if(!fd)
+    {
+        return 0;
+    }
+
+    while(fgets(string, sizeof(string), fd))
+    {
+        char *value = strchr(string, ' ');
+        if(!value)
+        {
+            continue;
+        }
+        *value++ = 0;
+        value[strcspn(value, "\n")] = 0;
+
+        if(!strcmp(string, "url"))
+        {
+            matches += !strcmp(value, progress_url);
+        }
+        else
+        if(!strcmp(string, "start"))
+        {
+// the playlist mode takes the starting media sequence from the file
+            if(hls_mode)
+            {
+                progress_start = atoi(value);
+                matches++;
+            }
+            else
+            {
+                matches += atoi(value) == progress_start;
+            }
+        }
+        else
+        if(!strcmp(string, "step"))
+        {
+            matches += atoi(value) == progress_step;
+        }
+        else
+        if(!strcmp(string, "next"))
+        {
+            next = atoi(value);
+        }
+        else
+        if(!strcmp(string, "offset"))
+        {
+            offset = atoll(value);
+        }
+        else
+        if(!strcmp(string, "failed"))
+        {
+            int index = atoi(value);
+            printf("read_progress %d: segment %d was skipped before resuming\n",
+                __LINE__,
+                index);
+            grow_jobs(index);
+            job_states[index] = JOB_FAILED;
+        }
+    }
+    fclose(fd);
+
+    if(matches != 3)
+    {
+        printf("read_progress %d: %s is for a different download.  Starting over.\n",
+            __LINE__,
+            progress_path);
+        memset(job_states, JOB_PENDING, allocated_jobs);
+        return 0;
+    }
+
+// the segments which failed before are still missing from the output
+    int i;
+    for(i = 0; i < next && i < allocated_jobs; i++)
+    {
+        if(job_states[i] == JOB_FAILED)
+        {
+            char url[TEXTLEN * 2];
+            char string2[TEXTLEN * 3];
+            if(hls_mode)
+            {
+                sprintf(url, "segment %d", i);
+            }
+            else
+            {
+                snprintf(url, sizeof(url), progress_url, progress_start + i * progress_step);
+            }
+            sprintf(string2, "%s failed before resuming", url);
+            add_failed(string2);
+            total_restored++;
+        }
+    }
+
+    out_offset = offset;
+    return next;
+}
+
+void write_segment(buffer_t *buffer)
+{
+    size_t done = 0;
+    while(done < buffer->size)
+    {
+        ssize_t result = pwrite(out_fd,
+            buffer->data + done,
+            buffer->size - done,
+            out_offset + done);
+        if(result <= 0)
+        {
+            perror("write_segment: pwrite");
+            exit(1);
+        }
+        done += result;
+    }
+    out_offset += buffer->size;
+    buffer->size = 0;
+}
+
+// write the segments up to next_complete, 1 thread at a time.  Must be called
+// with the lock held.  The lock is released during the writes so the other
+// workers don't wait for the disk.
+void write_ready()
+{
+    if(out_fd < 0 || writing)
+    {
+        return;
+    }
+
+    writing = 1;
+    while(next_written < next_complete)
+    {
+// new segments go in other slots until next_written advances
+        int start = next_written;
+        int end = next_complete;
+        int i;
+        pthread_mutex_unlock(&lock);
+// failed segments left their slot empty
+        for(i = start; i < end; i++)
+        {
+            write_segment(&reorder[i % reorder_size]);
+        }
+// the data must be on disk before the progress file says it is
+        fdatasync(out_fd);
+
+        pthread_mutex_lock(&lock);
+        next_written = end;
+        char *text = progress_text();
+        pthread_cond_broadcast(&queue_ready);
+        pthread_mutex_unlock(&lock);
+
+        write_progress(text);
+        free(text);
+        pthread_mutex_lock(&lock);
+    }
+    writing = 0;
+}
+
+// advance past the finished segments & write them.  Must be called with the
+// lock held.
+void advance_complete()
+{
+    int prev_complete = next_complete;
+    while(next_complete < total_jobs &&
+        job_states[next_complete] != JOB_PENDING)
+    {
+        next_complete++;
+    }
+    if(next_complete > prev_complete)
+    {
+        printf("segments2: %d/%d segments complete\n",
+            next_complete,
+            total_jobs);
+        pthread_cond_broadcast(&queue_ready);
+        write_ready();
+    }
+}
+
+// in output mode, the buffer is swapped with a reorder buffer entry
+void complete_job(job_t *job, int state, buffer_t *buffer)
+{
+    pthread_mutex_lock(&lock);
+    job_states[job->index] = state;
+    active_jobs--;
+    pthread_cond_broadcast(&queue_ready);
+    if(state == JOB_FAILED)
+    {
+        add_failed(job->url);
+        if(out_fd >= 0)
+        {
+            fprintf(stderr, "segments2: %s: leaving a gap in the output\n", job->url);
+        }
+    }
+    else
+    if(out_fd >= 0)
+    {
+        buffer_t *slot = &reorder[job->index % reorder_size];
+        buffer_t temp = *slot;
+        *slot = *buffer;
+        *buffer = temp;
+    }
+
+    advance_complete();
+    pthread_mutex_unlock(&lock);
+}
+
+// mark jobs which will never be added as failed
+void skip_jobs(int start, int end)
+{
+    int i;
+    pthread_mutex_lock(&lock);
+    if(start < first_job)
+    {
+        start = first_job;
+    }
+    grow_jobs(end);
+    for(i = start; i < end; i++)
+    {
+        job_states[i] = JOB_FAILED;
+        total_skipped++;
+    }
+    if(end > total_jobs)
+    {
+        total_jobs = end;
+    }
+    advance_complete();
+    pthread_mutex_unlock(&lock);
+}
+
+// additive increase, multiplicative decrease of the concurrent jobs
+// bytes < 0 for an error
+void adapt_concurrency(int64_t bytes, double latency)
+{
+    if(concurrency == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    int prev_concurrency = concurrency;
+    double now = get_time();
+    if(bytes < 0)
+    {
+        concurrency = concurrency / 2 > 1 ? concurrency / 2 : 1;
+        round_count = 0;
+    }
+    else
+    {
+        if(round_count == 0)
+        {
+            round_start = now - latency;
+            round_bytes = 0;
+            round_latency = 0;
+        }
+        round_bytes += bytes;
+        round_latency += latency;
+        round_count++;
+
+        if(round_count >= concurrency)
+        {
+            double throughput = round_bytes / (now - round_start + 0.001);
+            double average_latency = round_latency / round_count;
+// more connections helped
+            if(prev_throughput == 0 || throughput > prev_throughput * 1.05)
+            {
+                if(concurrency < max_concurrency)
+                {
+                    concurrency++;
+                }
+            }
+            else
+// more connections only made the server or link slower
+            if(throughput < prev_throughput * 0.8 &&
+                average_latency > prev_latency * 1.5)
+            {
+                concurrency = concurrency / 2 > 1 ? concurrency / 2 : 1;
+            }
+            prev_throughput = throughput;
+            prev_latency = average_latency;
+            round_count = 0;
+        }
+    }
+
+    if(concurrency != prev_concurrency)
+    {
+        printf("segments2: concurrency %d\n", concurrency);
+        pthread_cond_broadcast(&queue_ready);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void* worker(void *ptr)
+{
+    connection_t conn;
+    buffer_t buffer;
+    job_t job;
+    memset(&conn, 0, sizeof(conn));
+    memset(&buffer, 0, sizeof(buffer));
+    conn.fd = -1;
+
+    while(!next_job(&job))
+    {
+        int attempt;
+        int state = JOB_FAILED;
+        for(attempt = 0; attempt <= MAX_RETRIES; attempt++)
+        {
+            double start_time = get_time();
+            int result = fetch_url(&conn, job.url, &buffer);
+            if(result == FETCH_OK)
+            {
+                adapt_concurrency(buffer.size, get_time() - start_time);
+                if(out_fd >= 0 || !write_file(job.url, &buffer))
+                {
+                    state = JOB_DONE;
+                }
+                break;
+            }
+
+// client errors won't be fixed by retrying
+            if(result >= 400 && result < 500 && result != 408 && result != 429)
+            {
+                fprintf(stderr, "segments2: %s: HTTP %d\n", job.url, result);
+                break;
+            }
+
+            adapt_concurrency(-1, 0);
+            if(attempt < MAX_RETRIES)
+            {
+// exponential backoff with some jitter so the workers don't retry together
+                int delay = (RETRY_DELAY << attempt) + rand() % RETRY_DELAY;
+                fprintf(stderr, "segments2: %s: %s.  Retrying in %dms\n",
+                    job.url,
+                    result == FETCH_NETWORK ? "network error" :
+                        result == FETCH_PROTOCOL ? "protocol error" : "server error",
+                    delay);
+                usleep(delay * 1000);
+            }
+            else
+            {
+                fprintf(stderr, "segments2: %s: giving up after %d retries\n",
+                    job.url,
+                    MAX_RETRIES);
+            }
+        }
+
+        complete_job(&job, state, &buffer);
+        free(job.url);
+    }
+
+    close_connection(&conn);
+    free(buffer.data);
+    return 0;
+}
+
+// get the next line of a playlist & terminate it.  Returns 0 at the end.
+char* next_line(char **ptr)
+{
+    char *line = *ptr;
+    if(!*line)
+    {
+        return 0;
+    }
+
+    char *end = line + strcspn(line, "\r\n");
+    *ptr = end;
+    while(**ptr == '\r' || **ptr == '\n')
+    {
+        (*ptr)++;
+    }
+    *end = 0;
+    return line;
+}
+
+// get the highest bandwidth variant from a master playlist
+// returns 1 if it isn't a master playlist
+int parse_master(char *dst, char *text, const char *base_url)
+{
+    char *ptr = text;
+    char *line;
+    int64_t bandwidth = -1;
+    int64_t best = -1;
+    dst[0] = 0;
+    while((line = next_line(&ptr)))
+    {
+        if(!strncmp(line, "#EXT-X-STREAM-INF:", 18))
+        {
+            char *value = strstr(line, "BANDWIDTH=");
+            bandwidth = value ? atoll(value + 10) : 0;
+        }
+        else
+        if(line[0] && line[0] != '#' && bandwidth >= 0)
+        {
+            if(bandwidth > best)
+            {
+                best = bandwidth;
+                resolve_url(dst, base_url, line);
+            }
+            bandwidth = -1;
+        }
+    }
+    return best < 0;
+}
+
+// add jobs for the segments which haven't been seen
+// returns the number of new segments
+int parse_playlist(hls_t *hls, char *text, const char *base_url)
+{
+    if(hls->prev_text && !strcmp(hls->prev_text, text))
+    {
+        return 0;
+    }
+    free(hls->prev_text);
+    hls->prev_text = strdup(text);
+
+    char *ptr = text;
+    char *line;
+    char url[TEXTLEN];
+    int sequence = 0;
+    int new_segments = 0;
+    while((line = next_line(&ptr)))
+    {
+        if(!strncmp(line, "#EXT-X-MEDIA-SEQUENCE:", 22))
+        {
+            sequence = atoi(line + 22);
+            if(hls->base_sequence < 0)
+            {
+                hls->base_sequence = sequence;
+                hls->next_sequence = sequence;
+                progress_start = sequence;
+            }
+        }
+        else
+        if(!strncmp(line, "#EXT-X-TARGETDURATION:", 22))
+        {
+            hls->target_duration = atoi(line + 22);
+        }
+        else
+        if(!strncmp(line, "#EXT-X-ENDLIST", 14))
+        {
+            hls->ended = 1;
+        }
+        else
+        if(!strncmp(line, "#EXT-X-KEY:", 11) &&
+            !strstr(line, "METHOD=NONE"))
+        {
+            if(hls->base_sequence < 0 || hls->next_sequence == hls->base_sequence)
+            {
+                fprintf(stderr, "segments2: the segments are encrypted & will be saved encrypted\n");
+            }
+        }
+        else
+        if(!strncmp(line, "#EXT-X-MAP:", 11) && !hls->have_map)
+        {
+// fragmented MP4 init segment is job 0
+            char *uri = strstr(line, "URI=\"");
+            if(uri)
+            {
+                uri += 5;
+                uri[strcspn(uri, "\"")] = 0;
+                hls->have_map = 1;
+                hls->sequence_job = 1;
+                if(first_job == 0)
+                {
+                    resolve_url(url, base_url, uri);
+                    add_job(0, url);
+                }
+            }
+        }
+        else
+        if(line[0] && line[0] != '#')
+        {
+            if(hls->base_sequence < 0)
+            {
+// no media sequence tag means it starts at 0
+                hls->base_sequence = 0;
+                hls->next_sequence = 0;
+                progress_start = 0;
+            }
+
+            if(sequence > hls->next_sequence)
+            {
+                fprintf(stderr, "segments2: %d segments dropped out of the playlist before they were seen\n",
+                    sequence - hls->next_sequence);
+                skip_jobs(hls->next_sequence - hls->base_sequence + hls->sequence_job,
+                    sequence - hls->base_sequence + hls->sequence_job);
+                hls->next_sequence = sequence;
+            }
+
+// only new segments are resolved & queued
+            if(sequence >= hls->next_sequence)
+            {
+                int index = sequence - hls->base_sequence + hls->sequence_job;
+                if(index >= first_job)
+                {
+                    resolve_url(url, base_url, line);
+                    add_job(index, url);
+                }
+                hls->next_sequence = sequence + 1;
+                new_segments++;
+            }
+            sequence++;
+        }
+    }
+    return new_segments;
+}
+
+// fetch a playlist, retrying errors.  Returns 1 if it couldn't be fetched.
+int fetch_playlist(connection_t *conn, const char *url, buffer_t *buffer)
+{
+    int attempt;
+    for(attempt = 0; attempt < PLAYLIST_RETRIES; attempt++)
+    {
+        int result = fetch_url(conn, url, buffer);
+        if(result == FETCH_OK)
+        {
+            append_buffer(buffer, "", 1);
+            return 0;
+        }
+
+        fprintf(stderr, "segments2: %s: playlist fetch failed (%d)\n", url, result);
+        if(result >= 400 && result < 500 && result != 408 && result != 429)
+        {
+            return 1;
+        }
+        usleep((RETRY_DELAY << attempt) * 1000);
+    }
+    return 1;
+}
+
+// add jobs from a playlist until it ends
+void hls_download(const char *url)
+{
+    connection_t conn;
+    buffer_t buffer;
+    hls_t hls;
+    char playlist_url[TEXTLEN];
+    memset(&conn, 0, sizeof(conn));
+    memset(&buffer, 0, sizeof(buffer));
+    memset(&hls, 0, sizeof(hls));
+    conn.fd = -1;
+    hls.base_sequence = -1;
+    hls.target_duration = 10;
+    snprintf(playlist_url, TEXTLEN, "%s", url);
+
+// resuming restores the starting media sequence
+    if(first_job > 0)
+    {
+        hls.base_sequence = progress_start;
+        hls.next_sequence = progress_start;
+    }
+
+    if(fetch_playlist(&conn, playlist_url, &buffer))
+    {
+        close_connection(&conn);
+        return;
+    }
+
+    char variant[TEXTLEN];
+    char *text = strdup(buffer.data);
+    if(!parse_master(variant, text, playlist_url))
+    {
+        printf("hls_download %d: using variant %s\n", __LINE__, variant);
+        strcpy(playlist_url, variant);
+        if(fetch_playlist(&conn, playlist_url, &buffer))
+        {
+            free(text);
+            close_connection(&conn);
+            return;
+        }
+    }
+    free(text);
+
+    while(1)
+    {
+        int new_segments = parse_playlist(&hls, buffer.data, playlist_url);
+        if(hls.ended || dry_run)
+        {
+            break;
+        }
+
+// live playlist.  Check again in half the target duration if nothing changed.
+        double delay = new_segments ? hls.target_duration : hls.target_duration / 2.0;
+        usleep((int)(delay * 1000000));
+        if(fetch_playlist(&conn, playlist_url, &buffer))
+        {
+            break;
+        }
+    }
+
+    free(hls.prev_text);
+    free(buffer.data);
+    close_connection(&conn);
+}
 
 int main(int argc, char *argv[])
 {
-    if(argc < 4)
+    if(argc < 2)
     {
         printf("Download a segmented video file by replacing the formatting code with the number\n");
         printf("Usage: segments URL <start number> <end number inclusive> [step size]\n");
+        printf("Usage: segments <.m3u8 playlist URL>\n");
         printf(" -n dry run\n");
+        printf(" -j <count> concurrent downloads.  Default is %d or a maximum of %d for playlists\n",
+            DEFAULT_WORKERS,
+            DEFAULT_HLS_WORKERS);
+        printf(" -o <path> write the segments in order to 1 file.  Resumes from path.progress\n");
         printf("Example: segments2 \"https://ga.video.cdn.pbs.org/videos/some_long_filename_%%05d.ts\" 1 268\n");
         printf("Example: segments2 \"https://ga.video.cdn.pbs.org/videos/some_long_filename_%%08X.ts\" 1 268\n");
+        printf("Example: segments2 -o movie.ts https://example.com/live/index.m3u8\n");
         exit(1);
     }
-    
+
     int i;
-    int dry_run = 0;
     const char *url;
     int start_number = 0;
     int end_number = 0;
     int step = 1;
+    int total_workers = 0;
+    const char *output_path = 0;
     int argument = 0;
     for(i = 1; i < argc; i++)
     {
@@ -35,6 +1548,24 @@ int main(int argc, char *argv[])
             dry_run = 1;
         }
         else
+        if(!strcmp(argv[i], "-j") && i < argc - 1)
+        {
+            total_workers = atoi(argv[++i]);
+            if(total_workers < 1)
+            {
+                total_workers = 1;
+            }
+            if(total_workers > MAX_WORKERS)
+            {
+                total_workers = MAX_WORKERS;
+            }
+        }
+        else
+        if(!strcmp(argv[i], "-o") && i < argc - 1)
+        {
+            output_path = argv[++i];
+        }
+        else
         if(argument == 0)
         {
             url = argv[i];
@@ -59,32 +1590,173 @@ int main(int argc, char *argv[])
         }
     }
 
-    
+
+    if(argument == 1 && strstr(url, ".m3u8"))
+    {
+        hls_mode = 1;
+        max_concurrency = total_workers ? total_workers : DEFAULT_HLS_WORKERS;
+        total_workers = max_concurrency;
+        concurrency = 2 < max_concurrency ? 2 : max_concurrency;
+    }
+    else
+    if(argument < 3)
+    {
+        printf("main %d: need a start & end number or a .m3u8 playlist\n", __LINE__);
+        exit(1);
+    }
+    else
+    if(!total_workers)
+    {
+        total_workers = DEFAULT_WORKERS;
+    }
+
     char *url2 = malloc(strlen(url) + TEXTLEN);
-    char *string2 = malloc(strlen(url) + TEXTLEN);
 
-    printf("\nDownloading %s\nstart=%d\nend=%d\nstep=%d\n",
-        url,
-        start_number,
-        end_number,
-        step);
+    if(hls_mode)
+    {
+        printf("\nDownloading playlist %s\nmaximum workers=%d\n",
+            url,
+            total_workers);
+    }
+    else
+    {
+        printf("\nDownloading %s\nstart=%d\nend=%d\nstep=%d\nworkers=%d\n",
+            url,
+            start_number,
+            end_number,
+            step,
+            total_workers);
+    }
     printf("Press enter to continue\n");
     fgetc(stdin);
 
-    for(i = start_number; i <= end_number; i += step)
+    if(dry_run && !hls_mode)
     {
-        sprintf(url2, url, i);
-        sprintf(string2, "wget --no-check-certificate %s", url2);
-        printf("main %d: %s\n", __LINE__, string2);
-        if(!dry_run)
+        for(i = start_number; i <= end_number; i += step)
         {
-            int _ = system(string2);
+            sprintf(url2, url, i);
+            printf("main %d: %s\n", __LINE__, url2);
         }
+        exit(0);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    ssl_context = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ssl_context, SSL_VERIFY_NONE, 0);
+
+    if(dry_run)
+    {
+        hls_download(url);
+        exit(0);
+    }
+
+    if(output_path)
+    {
+        progress_path = malloc(strlen(output_path) + TEXTLEN);
+        sprintf(progress_path, "%s.progress", output_path);
+        progress_url = url;
+        progress_start = start_number;
+        progress_step = step;
+        first_job = read_progress();
+
+        out_fd = open(output_path, O_WRONLY | O_CREAT | (first_job ? 0 : O_TRUNC), 0644);
+        if(out_fd < 0)
+        {
+            printf("main %d: Couldn't open %s\n", __LINE__, output_path);
+            perror("");
+            exit(1);
+        }
+
+        if(first_job)
+        {
+// discard anything written after the last progress update
+            if(ftruncate(out_fd, out_offset))
+            {
+                perror("main: ftruncate");
+                exit(1);
+            }
+            printf("main %d: resuming at segment %d offset %lld\n",
+                __LINE__,
+                first_job,
+                (long long)out_offset);
+        }
+
+        reorder_size = total_workers * 2;
+        reorder = calloc(reorder_size, sizeof(buffer_t));
+        next_complete = first_job;
+        next_written = first_job;
+        total_jobs = first_job;
+    }
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * total_workers);
+    for(i = 0; i < total_workers; i++)
+    {
+        pthread_create(&threads[i], 0, worker, 0);
+    }
+
+    if(hls_mode)
+    {
+        hls_download(url);
+    }
+    else
+    {
+        int index = 0;
+        for(i = start_number; i <= end_number; i += step)
+        {
+            if(index >= first_job)
+            {
+                sprintf(url2, url, i);
+                add_job(index, url2);
+            }
+            index++;
+        }
+    }
+    finish_jobs();
+
+    for(i = 0; i < total_workers; i++)
+    {
+        pthread_join(threads[i], 0);
     }
-    
-    
-    
-}
 
+    printf("segments2: %d segments downloaded.  %d failed.\n",
+        total_jobs - first_job - (total_failed - total_restored) - total_skipped,
+        total_failed);
+    if(total_skipped)
+    {
+        printf("segments2: %d segments were missed from the live playlist.\n",
+            total_skipped);
+    }
+    if(total_failed)
+    {
+        for(i = 0; i < total_failed; i++)
+        {
+            if(failed_urls[i])
+            {
+                printf("    %s\n", failed_urls[i]);
+            }
+        }
+    }
+
+// keep the progress file while the output has gaps
+    int missing = 0;
+    if(out_fd >= 0)
+    {
+        for(i = 0; i < next_complete; i++)
+        {
+            missing += job_states[i] == JOB_FAILED;
+        }
 
+        close(out_fd);
+        if(!total_failed && !missing)
+        {
+            unlink(progress_path);
+        }
+        for(i = 0; i < reorder_size; i++)
+        {
+            free(reorder[i].data);
+        }
+    }
 
+    SSL_CTX_free(ssl_context);
+    return total_failed || missing ? 1 : 0;
+}
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+# serve numbered segments & playlists on localhost for testing segments2
+# without a real CDN.
+
+# python3 segments2_test_server.py [port] [-f <segment which returns 404>]
+#     [-d <seconds to delay each segment>]
+
+# /seg_00005.ts      segment 5.  Its packets contain the segment number.
+# /master.m3u8       master playlist with 2 variants of the same segments
+# /vod.m3u8          all the segments & ENDLIST
+# /live.m3u8         sliding window which advances 1 segment per second from
+#                    the 1st request & ends after the last segment
+# /dropping.m3u8     sliding window which advances faster than the target
+#                    duration, so segments drop out before they're seen
+
+import http.server
+import sys
+import time
+
+TOTAL_SEGMENTS = 12
+# segments in the sliding window
+WINDOW = 4
+PACKETS = 64
+
+port = 8765
+failed = -1
+delay = 0
+i = 1
+while i < len(sys.argv):
+    if sys.argv[i] == "-f":
+        i += 1
+        failed = int(sys.argv[i])
+    elif sys.argv[i] == "-d":
+        i += 1
+        delay = float(sys.argv[i])
+    else:
+        port = int(sys.argv[i])
+    i += 1
+
+# time of the 1st request for each live playlist
+start_times = {}
+
+
+def segment(number):
+    packet = bytes([0x47, number >> 8, number & 0xff]) + bytes([number & 0xff]) * 185
+    return packet * PACKETS
+
+
+def playlist(first, last, duration, ended):
+    text = "#EXTM3U\n#EXT-X-VERSION:3\n"
+    text += "#EXT-X-TARGETDURATION:%d\n" % duration
+    text += "#EXT-X-MEDIA-SEQUENCE:%d\n" % first
+    for number in range(first, last):
+        text += "#EXTINF:%d.0,\nseg_%05d.ts\n" % (duration, number)
+    if ended:
+        text += "#EXT-X-ENDLIST\n"
+    return text
+
+
+# the window after some seconds
+def window(seconds):
+    last = min(WINDOW + int(seconds), TOTAL_SEGMENTS)
+    return max(last - WINDOW, 0), last, last == TOTAL_SEGMENTS
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def send(self, code, content_type, data):
+        self.send_response(code)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_GET(self):
+        path = self.path
+        elapsed = time.time() - start_times.setdefault(path, time.time())
+        if path == "/master.m3u8":
+            text = "#EXTM3U\n"
+            text += "#EXT-X-STREAM-INF:BANDWIDTH=100000\nlow/vod.m3u8\n"
+            text += "#EXT-X-STREAM-INF:BANDWIDTH=900000\nvod.m3u8\n"
+            self.send(200, "application/vnd.apple.mpegurl", text.encode())
+        elif path.endswith("vod.m3u8"):
+            text = playlist(0, TOTAL_SEGMENTS, 1, True)
+            self.send(200, "application/vnd.apple.mpegurl", text.encode())
+        elif path == "/live.m3u8":
+            first, last, ended = window(elapsed)
+            text = playlist(first, last, 1, ended)
+            self.send(200, "application/vnd.apple.mpegurl", text.encode())
+        elif path == "/dropping.m3u8":
+            first, last, ended = window(elapsed * 4)
+            text = playlist(first, last, 2, ended)
+            self.send(200, "application/vnd.apple.mpegurl", text.encode())
+        elif path.startswith("/seg_") and path.endswith(".ts"):
+            number = int(path[5:-3])
+            time.sleep(delay)
+            if number == failed or number >= TOTAL_SEGMENTS:
+                self.send(404, "text/plain", b"not found\n")
+            else:
+                self.send(200, "video/mp2t", segment(number))
+        else:
+            self.send(404, "text/plain", b"not found\n")
+
+    def log_message(self, format, *args):
+        pass
+
+
+class Server(http.server.ThreadingHTTPServer):
+    # segments2 drops connections when it's killed
+    def handle_error(self, request, client_address):
+        if not isinstance(sys.exc_info()[1], ConnectionError):
+            super().handle_error(request, client_address)
+
+
+Server(("127.0.0.1", port), Handler).serve_forever()
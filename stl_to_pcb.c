@@ -21,12 +21,21 @@
 
 // This program converts a bunch of STL files into a PCB layout.
 
+// The command file entries & the blobs are processed on a thread pool.  Each
+// footprint is printed to its own memory buffer & the buffers are written in
+// the original order.
 
 
-// g++ -O2 stl_to_pcb.c -o stl_to_pcb -lm
+
+// g++ -O2 stl_to_pcb.c -o stl_to_pcb -lm -lpthread
 // ./stl_to_pcb pcb_commands cable.kicad_pcb
 
 #include "3dstuff.h"
+#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+#include <deque>
+#include <queue>
 #include <vector>
 
 using namespace std;
@@ -44,6 +53,10 @@ using namespace std;
 #define Y 100.0
 // maximum distance to be considered touching
 #define THRESHOLD 0.01
+// size of a spatial hash cell.  Points which touch are at most 1 cell apart
+// on each axis even with rounding.
+#define GRID_SIZE (THRESHOLD * 2)
+#define MAX_THREADS 64
 
 
 const char *header = 
@@ -135,15 +148,53 @@ typedef struct
     float x1, y1, x2, y2;
 } line_t;
 
-typedef vector<triangle_t*> blob_t;
-typedef vector<vector_t*> polygon_t;
+// a range of the entry's triangles
+typedef struct
+{
+    int start;
+    int size;
+} blob_t;
+
+// indexes of the points in a footprint
+typedef deque<int> polygon_t;
+
+// uniform spatial hash of points.  Each bucket is a linked list of IDs.
+// Different cells can share a bucket so the caller has to check distances.
+typedef struct
+{
+    vector<int> heads;
+    vector<int> next;
+    vector<int> ids;
+    int mask;
+} grid_t;
 
 vector<const char*> command;
 vector<const char*> src_stl;
 vector<const char*> dst_layer;
 vector<int> subtract_mode;
 vector<int> fill_mode;
-FILE *dst;
+// each thread prints to its own buffer
+__thread FILE *dst;
+
+// a command file entry.  The triangles are sorted by blob so each blob is
+// a contiguous range.
+typedef struct
+{
+    vector<triangle_t> triangles;
+    vector<blob_t> blobs;
+} entry_t;
+
+// the output of 1 blob
+typedef struct
+{
+    int src_index;
+    int blob_index;
+    char *text;
+    size_t size;
+} output_t;
+
+vector<entry_t> entries;
+vector<output_t> outputs;
 
 
 void flip_line(line_t *l)
@@ -167,6 +218,97 @@ int touches2(float x1, float y1, float x2, float y2)
     return (hypot(x1 - x2, y1 - y2) <= THRESHOLD);
 }
 
+void init_grid(grid_t *grid, int total)
+{
+    int size = 1024;
+    while(size < total * 2)
+    {
+        size *= 2;
+    }
+    grid->heads.assign(size, -1);
+    grid->next.clear();
+    grid->ids.clear();
+    grid->mask = size - 1;
+}
+
+int64_t grid_cell(float x)
+{
+    return (int64_t)floor(x / GRID_SIZE);
+}
+
+int grid_bucket(grid_t *grid, int64_t x, int64_t y, int64_t z)
+{
+    uint64_t hash = (uint64_t)x * 73856093ULL ^
+        (uint64_t)y * 19349663ULL ^
+        (uint64_t)z * 83492791ULL;
+    return (int)((hash ^ (hash >> 29)) & grid->mask);
+}
+
+void grid_insert(grid_t *grid, float x, float y, float z, int id)
+{
+    int bucket = grid_bucket(grid, grid_cell(x), grid_cell(y), grid_cell(z));
+    grid->next.push_back(grid->heads[bucket]);
+    grid->ids.push_back(id);
+    grid->heads[bucket] = grid->ids.size() - 1;
+}
+
+// append the IDs of all points in the 27 cells around a point.
+// May contain duplicates & points which don't touch.
+void grid_query(grid_t *grid, float x, float y, float z, vector<int> *result)
+{
+    int64_t cx = grid_cell(x);
+    int64_t cy = grid_cell(y);
+    int64_t cz = grid_cell(z);
+    int64_t i, j, k;
+    for(i = cx - 1; i <= cx + 1; i++)
+    {
+        for(j = cy - 1; j <= cy + 1; j++)
+        {
+            for(k = cz - 1; k <= cz + 1; k++)
+            {
+                int entry = grid->heads[grid_bucket(grid, i, j, k)];
+                while(entry >= 0)
+                {
+                    result->push_back(grid->ids[entry]);
+                    entry = grid->next[entry];
+                }
+            }
+        }
+    }
+}
+
+// 2D version ignores Z
+void grid_query2(grid_t *grid, float x, float y, vector<int> *result)
+{
+    int64_t cx = grid_cell(x);
+    int64_t cy = grid_cell(y);
+    int64_t cz = grid_cell(0);
+    int64_t i, j;
+    for(i = cx - 1; i <= cx + 1; i++)
+    {
+        for(j = cy - 1; j <= cy + 1; j++)
+        {
+            int entry = grid->heads[grid_bucket(grid, i, j, cz)];
+            while(entry >= 0)
+            {
+                result->push_back(grid->ids[entry]);
+                entry = grid->next[entry];
+            }
+        }
+    }
+}
+
+int find_root(vector<int> *parent, int i)
+{
+    while(parent->at(i) != i)
+    {
+// path halving
+        parent->at(i) = parent->at(parent->at(i));
+        i = parent->at(i);
+    }
+    return i;
+}
+
 int touches(triangle_t *a, triangle_t *b)
 {
     int i, j;
@@ -191,45 +333,6 @@ int touches(triangle_t *a, triangle_t *b)
     return 0;
 }
 
-// test if the 2 points are both on the same triangle in horiz
-// ignore Z.  Return the distance if they're joined or -1 if they're not.
-float joined(vector_t *a, vector_t *b, vector<triangle_t*> *horiz)
-{
-    int i, j;
-    int got_it = 0;
-    for(i = 0; i < horiz->size(); i++)
-    {
-        triangle_t *tri = horiz->at(i);
-        for(j = 0; j < 3; j++)
-        {
-            if(touches2(a->x, a->y, tri->coords[j].x, tri->coords[j].y))
-            {
-                got_it = 1;
-                break;
-            }
-        }
-        
-        if(got_it)
-        {
-            got_it = 0;
-            for(j = 0; j < 3; j++)
-            {
-                if(touches2(b->x, b->y, tri->coords[j].x, tri->coords[j].y))
-                {
-                    got_it = 1;
-                    break;
-                }
-            }
-        }
-        
-        if(got_it)
-        {
-            return hypot2(a, b);
-        }
-    }
-    return -1;
-}
-
 // if the top or bottom surface
 int is_flat(triangle_t *t)
 {
@@ -302,23 +405,6 @@ void triangle_to_line(line_t *line, triangle_t *t)
     }
 }
 
-vector_t* new_vector(float x, float y)
-{
-    vector_t *result = new vector_t;
-    result->x = x;
-    result->y = y;
-    return result;
-}
-
-triangle_t* new_triangle(stl_triangle_t *src)
-{
-    triangle_t *result = new triangle_t;
-    result->coords[0] = src->coords[0];
-    result->coords[1] = src->coords[1];
-    result->coords[2] = src->coords[2];
-    return result;
-}
-
 vector<char*> split(char *s) 
 {
     vector<char*> res;
@@ -363,15 +449,123 @@ void poly_footer(const char *layer, int fill_mode)
     }
 }
 
-void make_via(blob_t *blob)
+// Group touching triangles into blobs.  The vertices go in a spatial hash so
+// only nearby triangles are tested.  Union-find gives the connected
+// components.  The blobs come out in the order of the original search, which
+// started each blob with the last unused triangle & appended the touching
+// triangles of each blob member in file order.  The triangles are rearranged
+// in blob order.
+void extract_blobs(vector<triangle_t> *src, vector<blob_t> *blobs)
+{
+    int total = src->size();
+    int i, j, k;
+    grid_t grid;
+    init_grid(&grid, total * 3);
+    for(i = 0; i < total; i++)
+    {
+        triangle_t *tri = &src->at(i);
+        for(j = 0; j < 3; j++)
+        {
+            grid_insert(&grid, tri->coords[j].x, tri->coords[j].y, tri->coords[j].z, i);
+        }
+    }
+
+// touching triangles of each triangle in file order
+    vector<int> neighbor_start(total + 1);
+    vector<int> neighbors;
+    vector<int> parent(total);
+    vector<int> candidates;
+    for(i = 0; i < total; i++)
+    {
+        parent[i] = i;
+    }
+
+    for(i = 0; i < total; i++)
+    {
+        triangle_t *tri = &src->at(i);
+        candidates.clear();
+        for(j = 0; j < 3; j++)
+        {
+            grid_query(&grid, tri->coords[j].x, tri->coords[j].y, tri->coords[j].z, &candidates);
+        }
+        sort(candidates.begin(), candidates.end());
+
+        neighbor_start[i] = neighbors.size();
+        for(j = 0; j < candidates.size(); j++)
+        {
+            int other = candidates[j];
+            if(other != i &&
+                (j == 0 || other != candidates[j - 1]) &&
+                touches(tri, &src->at(other)))
+            {
+                neighbors.push_back(other);
+                int root1 = find_root(&parent, i);
+                int root2 = find_root(&parent, other);
+                if(root1 != root2)
+                {
+                    parent[root1] = root2;
+                }
+            }
+        }
+    }
+    neighbor_start[total] = neighbors.size();
+
+// the highest triangle in each component starts its blob
+    vector<int> highest(total, -1);
+    for(i = 0; i < total; i++)
+    {
+        highest[find_root(&parent, i)] = i;
+    }
+
+    vector<char> used(total, 0);
+    vector<int> order;
+    for(i = total - 1; i >= 0; i--)
+    {
+        if(highest[find_root(&parent, i)] != i)
+        {
+            continue;
+        }
+
+// breadth first search
+        blob_t blob;
+        blob.start = order.size();
+        order.push_back(i);
+        used[i] = 1;
+        for(j = blob.start; j < order.size(); j++)
+        {
+            int current = order[j];
+            for(k = neighbor_start[current]; k < neighbor_start[current + 1]; k++)
+            {
+                int other = neighbors[k];
+                if(!used[other])
+                {
+                    used[other] = 1;
+                    order.push_back(other);
+                }
+            }
+        }
+
+        blob.size = order.size() - blob.start;
+        blobs->push_back(blob);
+    }
+
+    vector<triangle_t> sorted(total);
+    for(i = 0; i < total; i++)
+    {
+        sorted[i] = src->at(order[i]);
+    }
+    src->swap(sorted);
+}
+
+void make_via(triangle_t *blob, int total)
 {
 // get center X, Y from blob
     int i, j, k;
     float x1, y1, x2, y2;
     int first = 1;
-    for(i = 0; i < blob->size(); i++)
+    for(i = 0; i < total; i++)
     {
-        triangle_t *tri = blob->at(i);
+        triangle_t *tri = &blob[i];
         for(j = 0; j < 3; j++)
         {
             if(tri->coords[j].x < x1 || first)
@@ -406,297 +600,744 @@ void make_via(blob_t *blob)
         VIA_BOTTOM);
 }
 
-void make_footprint(int blob_index, int src_index, blob_t *blob)
+// horizontal triangles touching the ends of a polygon
+typedef struct
 {
-    int i, j, k;
-    vector<polygon_t*> polys;
-    vector<triangle_t*> horiz;
+    vector<int> front_tris;
+    vector<int> back_tris;
+    int alive;
+// in the queue of polygons to check
+    int dirty;
+} join_t;
+
+// get the horizontal triangles with a vertex touching the point, ignoring Z
+void touching_tris(vector_t *point,
+    vector<triangle_t> *horiz,
+    grid_t *grid,
+    vector<int> *result)
+{
+    int i, j;
+    vector<int> candidates;
+    grid_query2(grid, point->x, point->y, &candidates);
+    sort(candidates.begin(), candidates.end());
 
-// extract useful triangles from the blob
-    for(j = 0; j < blob->size(); j++)
+    result->clear();
+    for(i = 0; i < candidates.size(); i++)
     {
-        triangle_t *tri = blob->at(j);
-        if(is_flat(tri))
+        if(i > 0 && candidates[i] == candidates[i - 1])
         {
-// transfer to horizontal triangle table for later
-            horiz.push_back(tri);
-            blob->erase(blob->begin() + j);
-            j--;
+            continue;
         }
-        else
-        if(!is_top(tri))
+
+        triangle_t *tri = &horiz->at(candidates[i]);
+        for(j = 0; j < 3; j++)
         {
-// discard vertical triangle on bottom
-            blob->erase(blob->begin() + j);
-            j--;
+            if(touches2(point->x, point->y, tri->coords[j].x, tri->coords[j].y))
+            {
+                result->push_back(candidates[i]);
+                break;
+            }
         }
     }
+}
 
-    printf("main %d: blob %d edge triangles=%d\n", __LINE__, blob_index, (int)blob->size());
-
-// convert the top vertical triangles to lines
-    vector<line_t*> lines;
-    for(i = 0; i < blob->size(); i++)
+// test if 2 sorted triangle lists have a triangle in common
+int share_tri(vector<int> *a, vector<int> *b)
+{
+    int i = 0;
+    int j = 0;
+    while(i < a->size() && j < b->size())
     {
-        line_t *line = new line_t;
-        lines.push_back(line);
-        triangle_to_line(line, blob->at(i));
+        if(a->at(i) == b->at(j))
+        {
+            return 1;
+        }
+        if(a->at(i) < b->at(j))
+        {
+            i++;
+        }
+        else
+        {
+            j++;
+        }
     }
+    return 0;
+}
 
-
-// sort lines to make polygon contours
-    while(lines.size() > 0)
+// test if the 2 points are both on the same triangle in horiz.
+// Return the distance if they're joined or -1 if they're not.
+float joined(vector_t *a, vector<int> *a_tris, vector_t *b, vector<int> *b_tris)
+{
+    if(share_tri(a_tris, b_tris))
     {
-        vector<line_t*> sorted;
-        sorted.push_back(lines.at(0));
-        lines.erase(lines.begin());
-        int done = 0;
+        return hypot2(a, b);
+    }
+    return -1;
+}
 
-        while(!done)
+// get the shortest of all possible joins between 2 polygons or -1
+int shortest_join(vector<vector_t> *points,
+    polygon_t *a,
+    join_t *a_join,
+    polygon_t *b,
+    join_t *b_join)
+{
+    int k;
+    vector_t *a_front = &points->at(a->front());
+    vector_t *a_back = &points->at(a->back());
+    vector_t *b_front = &points->at(b->front());
+    vector_t *b_back = &points->at(b->back());
+    float dist[] = { -1, -1, -1, -1 };
+    dist[0] = joined(a_front, &a_join->front_tris, b_front, &b_join->front_tris);
+    dist[1] = joined(a_front, &a_join->front_tris, b_back, &b_join->back_tris);
+    dist[2] = joined(a_back, &a_join->back_tris, b_front, &b_join->front_tris);
+    dist[3] = joined(a_back, &a_join->back_tris, b_back, &b_join->back_tris);
+
+    float shortest = -1;
+    int shortest_index = -1;
+    for(k = 0; k < 4; k++)
+    {
+        if(dist[k] > 0 &&
+            (shortest_index < 0 ||
+            dist[k] < shortest))
         {
-            done = 1;
-            for(i = 0; i < lines.size(); i++)
-            {
-                line_t *unknown = lines.at(i);
-                line_t *front = sorted.front();
-
-                int got_it = 0;
-                if(touches2(unknown->x2, unknown->y2, front->x1, front->y1))
-                {
-// end of unknown line touches start of sorted list
-                    sorted.insert(sorted.begin(), unknown);
-                    got_it = 1;
-                }
-                else
-                if(touches2(unknown->x1, unknown->y1, front->x1, front->y1))
-                {
-// start of unknown line touches start of sorted list
-                    flip_line(unknown);
-                    sorted.insert(sorted.begin(), unknown);
-                    got_it = 1;
-                }
-                else
-                {
-                    line_t *back = sorted.back();
-                    if(touches2(unknown->x1, unknown->y1, back->x2, back->y2))
-                    {
-// start of unknown line touches end of sorted list
-                        sorted.push_back(unknown);
-                        got_it = 1;
-                    }
-                    else
-                    if(touches2(unknown->x2, unknown->y2, back->x2, back->y2))
-                    {
-// end of unknown line touches end of sorted list
-                        flip_line(unknown);
-                        sorted.push_back(unknown);
-                        got_it = 1;
-                    }
-                }
-
-                if(got_it)
-                {
-                    lines.erase(lines.begin() + i);
-                    i--;
-                    done = 0;
-                }
-            }
+            shortest = dist[k];
+            shortest_index = k;
         }
+    }
+    return shortest_index;
+}
 
-        printf("main %d: polygon lines=%d lines left=%d\n", __LINE__, (int)sorted.size(), (int)lines.size());
-
-// create new polygon from sorted lines
-        polygon_t *polygon = new polygon_t;
-        polygon->push_back(new_vector(sorted.at(0)->x1, sorted.at(0)->y1));
-        for(i = 0; i < sorted.size(); i++)
+// get the polygons which can join polygon a in ascending order
+void join_partners(int a,
+    vector<polygon_t> *polys,
+    vector<vector_t> *points,
+    vector<join_t> *joins,
+    vector<vector<int> > *tri_polys,
+    int first_only,
+    vector<int> *result)
+{
+    int i, j;
+    join_t *a_join = &joins->at(a);
+    vector<int> candidates;
+    for(i = 0; i < 2; i++)
+    {
+        vector<int> *tris = i ? &a_join->back_tris : &a_join->front_tris;
+        for(j = 0; j < tris->size(); j++)
         {
-            polygon->push_back(new_vector(sorted.at(i)->x2, sorted.at(i)->y2));
+            vector<int> *others = &tri_polys->at(tris->at(j));
+            candidates.insert(candidates.end(), others->begin(), others->end());
         }
-        polys.push_back(polygon);
     }
+    sort(candidates.begin(), candidates.end());
 
-
-// Combine polygons whose start or end are joined by horizontal triangles
-// These are holes created by Freecad's sweep tool.
-    printf("main %d: unjoined polygons=%d\n", __LINE__, (int)polys.size());
-    int done = 0;
-    while(!done)
+    result->clear();
+    for(i = 0; i < candidates.size(); i++)
     {
-        done = 1;
-        for(i = 0; i < polys.size(); i++)
+        int b = candidates[i];
+        if(b == a ||
+            !joins->at(b).alive ||
+            (i > 0 && b == candidates[i - 1]))
         {
-            polygon_t *a = polys.at(i);
-            for(j = 0; j < polys.size(); j++)
-            {
-                if(j != i)
-                {
-                    polygon_t *b = polys.at(j);
-// compute distances of all possible joins since multiple joins are possible
-                    float dist[] = { -1, -1, -1, -1 };
-                    dist[0] = joined(a->front(), b->front(), &horiz);
-                    dist[1] = joined(a->front(), b->back(), &horiz);
-                    dist[2] = joined(a->back(), b->front(), &horiz);
-                    dist[3] = joined(a->back(), b->back(), &horiz);
-
-                    float shortest = -1;
-                    int shortest_index = -1;
-                    for(k = 0; k < 4; k++)
-                    {
-                        if(dist[k] > 0 &&
-                            (shortest_index < 0 ||
-                            dist[k] < shortest))
-                        {
-                            shortest = dist[k];
-                            shortest_index = k;
-                        }
-                    }
-// printf("main %d i=%d j=%d joined distances=%f %f %f %f shortest=%f shortest_index=%d\n", 
-// __LINE__, 
-// i, 
-// j, 
-// dist[0], 
-// dist[1], 
-// dist[2], 
-// dist[3],
-// shortest,
-// shortest_index);
-
-// transfer the b polygon to the a polygon
-                    if(shortest_index == 0)
-                    {
-//printf("main %d: a=%d b=%d\n", __LINE__, (int)a->size(), (int)b->size());
-                        while(b->size())
-                        {
-                            a->insert(a->begin(), b->front());
-                            b->erase(b->begin());
-                        }
-                        done = 0;
-                    }
-                    else
-                    if(shortest_index == 1)
-                    {
-//printf("main %d: a=%d b=%d\n", __LINE__, (int)a->size(), (int)b->size());
-                        while(b->size())
-                        {
-                            a->insert(a->begin(), b->back());
-                            b->pop_back();
-                        }
-                        done = 0;
-                    }
-                    else
-                    if(shortest_index == 2)
-                    {
-//printf("main %d: a=%d b=%d\n", __LINE__, (int)a->size(), (int)b->size());
-                        while(b->size())
-                        {
-                            a->push_back(b->front());
-                            b->erase(b->begin());
-                        }
-                        done = 0;
-                    }
-                    else
-                    if(shortest_index == 3)
-                    {
-//printf("main %d: a=%d b=%d\n", __LINE__, (int)a->size(), (int)b->size());
-                        while(b->size())
-                        {
-                            a->push_back(b->back());
-                            b->pop_back();
-                        }
-                        done = 0;
-                    }
+            continue;
+        }
 
-// erase the b polygon
-                    if(!done)
-                    {
-                        polys.erase(polys.begin() + j);
-                        j = polys.size();
-                        i = polys.size();
-                    }
-                }
+        if(shortest_join(points, &polys->at(a), a_join, &polys->at(b), &joins->at(b)) >= 0)
+        {
+            result->push_back(b);
+            if(first_only)
+            {
+                break;
             }
         }
     }
+}
 
-    printf("main %d: joined polygons=%d\n", __LINE__, (int)polys.size());
-
-
+void update_ends(int a,
+    vector<polygon_t> *polys,
+    vector<vector_t> *points,
+    vector<join_t> *joins,
+    vector<triangle_t> *horiz,
+    grid_t *grid,
+    vector<vector<int> > *tri_polys)
+{
+    int i;
+    join_t *join = &joins->at(a);
+    touching_tris(&points->at(polys->at(a).front()), horiz, grid, &join->front_tris);
+    touching_tris(&points->at(polys->at(a).back()), horiz, grid, &join->back_tris);
+// old entries for the polygon are left in tri_polys & skipped by shortest_join
+    for(i = 0; i < join->front_tris.size(); i++)
+    {
+        tri_polys->at(join->front_tris[i]).push_back(a);
+    }
+    for(i = 0; i < join->back_tris.size(); i++)
+    {
+        tri_polys->at(join->back_tris[i]).push_back(a);
+    }
+}
 
+// Combine polygons whose start or end are joined by horizontal triangles.
+// The original search merged the 1st pair in list order with a join, then
+// started over.  Polygons found to have no join can only gain 1 when a
+// polygon they touch changes, so only the polygons in a queue are checked.
+// The lowest queued polygon with a join is the 1st pair the original search
+// would find.
+void join_polygons(vector<polygon_t> *polys,
+    vector<vector_t> *points,
+    vector<triangle_t> *horiz)
+{
+    int total = polys->size();
+    int i;
+    grid_t grid;
+    vector<join_t> joins(total);
+    vector<vector<int> > tri_polys(horiz->size());
+    vector<int> partners;
+    priority_queue<int, vector<int>, greater<int> > queue;
 
+    init_grid(&grid, horiz->size() * 3);
+    for(i = 0; i < horiz->size(); i++)
+    {
+        triangle_t *tri = &horiz->at(i);
+        grid_insert(&grid, tri->coords[0].x, tri->coords[0].y, 0, i);
+        grid_insert(&grid, tri->coords[1].x, tri->coords[1].y, 0, i);
+        grid_insert(&grid, tri->coords[2].x, tri->coords[2].y, 0, i);
+    }
 
-// start the output footprint
-    fprintf(dst, 
-        "  (footprint \"LOGO\" (layer \"F.Cu\")\n"
-        "    (tedit 0) (tstamp 0ee69f2a-4ef2-4004-81f1-f2c3e293a6f5)\n"
-        "    (at %.2f %.2f)\n"
-        "    (attr board_only exclude_from_pos_files exclude_from_bom)\n",
-        X,
-        Y);
+    for(i = 0; i < total; i++)
+    {
+        joins[i].alive = 1;
+        joins[i].dirty = 1;
+        update_ends(i, polys, points, &joins, horiz, &grid, &tri_polys);
+        queue.push(i);
+    }
 
-// create subtraction booleans with child polygons
-    if(subtract_mode.at(src_index))
+    while(!queue.empty())
     {
-// TODO: detect child polygons & OR polygons.
-// Parent is hard coded for now & we assume there are no overlapping OR polygons.
-        polygon_t *polygon = polys.at(0);
-        polygon_t final;
-        for(i = 0; i < polygon->size(); i++)
+        int a_index = queue.top();
+        queue.pop();
+        joins[a_index].dirty = 0;
+        if(!joins[a_index].alive)
         {
-            final.push_back(polygon->at(i));
+            continue;
         }
 
-        int poly_index;
-        for(poly_index = 1; poly_index < polys.size(); poly_index++)
+        join_partners(a_index, polys, points, &joins, &tri_polys, 1, &partners);
+        if(partners.empty())
         {
-            polygon_t *polygon = polys.at(poly_index);
+            continue;
+        }
 
-// nearest points in 2 polygons
-            int nearest_point1 = -1;
-            int nearest_point2 = -1;
-            float nearest_dist = -1;
-            for(i = 0; i < final.size(); i++)
+        int b_index = partners[0];
+        polygon_t *a = &polys->at(a_index);
+        polygon_t *b = &polys->at(b_index);
+        int shortest_index = shortest_join(points, a, &joins[a_index], b, &joins[b_index]);
+
+// transfer the b polygon to the a polygon
+        if(shortest_index == 0)
+        {
+            for(i = 0; i < b->size(); i++)
             {
-                vector_t *point1 = final.at(i);
-                for(j = 0; j < polygon->size(); j++)
-                {
-                    vector_t *point2 = polygon->at(j);
-                    float dist = hypot(point1->x - point2->x, point1->y - point2->y);
-                    if(dist < nearest_dist || nearest_dist < 0)
+                a->push_front(b->at(i));
+            }
+        }
+        else
+        if(shortest_index == 1)
+        {
+            for(i = b->size() - 1; i >= 0; i--)
+            {
+                a->push_front(b->at(i));
+            }
+        }
+        else
+        if(shortest_index == 2)
+        {
+            for(i = 0; i < b->size(); i++)
+            {
+                a->push_back(b->at(i));
+            }
+        }
+        else
+        {
+            for(i = b->size() - 1; i >= 0; i--)
+            {
+                a->push_back(b->at(i));
+            }
+        }
+        b->clear();
+        joins[b_index].alive = 0;
+
+// the new ends may join polygons which had no joins
+        update_ends(a_index, polys, points, &joins, horiz, &grid, &tri_polys);
+        join_partners(a_index, polys, points, &joins, &tri_polys, 0, &partners);
+        partners.push_back(a_index);
+        for(i = 0; i < partners.size(); i++)
+        {
+            if(!joins[partners[i]].dirty)
+            {
+                joins[partners[i]].dirty = 1;
+                queue.push(partners[i]);
+            }
+        }
+    }
+
+// erase the joined polygons
+    int dst = 0;
+    for(i = 0; i < total; i++)
+    {
+        if(joins[i].alive)
+        {
+            polys->at(dst++).swap(polys->at(i));
+        }
+    }
+    polys->resize(dst);
+}
+
+// A point in the keyholed polygon.  The points are a linked list ordered by
+// label & a k-d tree for finding the nearest point.
+typedef struct keyhole_s
+{
+    vector_t *point;
+    struct keyhole_s *next;
+    uint64_t label;
+    struct keyhole_s *left;
+    struct keyhole_s *right;
+} keyhole_t;
+
+// initial spacing of the labels
+#define LABEL_GAP 0x100000000ULL
+
+int compare_x(keyhole_t *a, keyhole_t *b)
+{
+    return a->point->x < b->point->x;
+}
+
+int compare_y(keyhole_t *a, keyhole_t *b)
+{
+    return a->point->y < b->point->y;
+}
+
+// build a balanced tree.  Points equal to the split can go on either side.
+keyhole_t* build_kd(keyhole_t **nodes, int total, int depth)
+{
+    if(total == 0)
+    {
+        return 0;
+    }
+
+    int middle = total / 2;
+    nth_element(nodes,
+        nodes + middle,
+        nodes + total,
+        (depth & 1) ? compare_y : compare_x);
+    keyhole_t *node = nodes[middle];
+    node->left = build_kd(nodes, middle, depth + 1);
+    node->right = build_kd(nodes + middle + 1, total - middle - 1, depth + 1);
+    return node;
+}
+
+void insert_kd(keyhole_t *root, keyhole_t *node)
+{
+    int depth = 0;
+    node->left = 0;
+    node->right = 0;
+    while(1)
+    {
+        float split = (depth & 1) ? root->point->y : root->point->x;
+        float value = (depth & 1) ? node->point->y : node->point->x;
+        keyhole_t **child = (value < split) ? &root->left : &root->right;
+        if(!*child)
+        {
+            *child = node;
+            return;
+        }
+        root = *child;
+        depth++;
+    }
+}
+
+// find the nearest point with the same distance calculation as the original
+// search.  Ties go to the point earliest in the list.
+void nearest_kd(keyhole_t *node,
+    int depth,
+    vector_t *target,
+    keyhole_t **nearest,
+    float *nearest_dist)
+{
+    if(!node)
+    {
+        return;
+    }
+
+    float dist = hypot(node->point->x - target->x, node->point->y - target->y);
+    if(!*nearest ||
+        dist < *nearest_dist ||
+        (dist == *nearest_dist && node->label < (*nearest)->label))
+    {
+        *nearest = node;
+        *nearest_dist = dist;
+    }
+
+    double diff = (depth & 1) ?
+        (double)target->y - node->point->y :
+        (double)target->x - node->point->x;
+    nearest_kd(diff < 0 ? node->left : node->right,
+        depth + 1,
+        target,
+        nearest,
+        nearest_dist);
+// leave room for rounding so tied distances aren't skipped
+    if(fabs(diff) <= *nearest_dist * 1.00001 + 0.000001)
+    {
+        nearest_kd(diff < 0 ? node->right : node->left,
+            depth + 1,
+            target,
+            nearest,
+            nearest_dist);
+    }
+}
+
+void relabel(keyhole_t *list)
+{
+    uint64_t label = LABEL_GAP;
+    while(list)
+    {
+        list->label = label;
+        label += LABEL_GAP;
+        list = list->next;
+    }
+}
+
+// Merge the holes into the 1st polygon by bridging each hole from the nearest
+// point.  The original search tested every pair of points & took the 1st
+// pair with the shortest distance, so ties go to the earliest point in the
+// polygon, then the earliest point in the hole.
+keyhole_t* keyhole_polygons(vector<polygon_t> *polys, vector<vector_t> *points)
+{
+    int i, j;
+    int total = 0;
+    for(i = 0; i < polys->size(); i++)
+    {
+        total += polys->at(i).size() + 2;
+    }
+
+// all the nodes are allocated at once
+    keyhole_t *nodes = new keyhole_t[total];
+    int used = 0;
+    polygon_t *polygon = &polys->at(0);
+    vector<keyhole_t*> tree_nodes;
+    for(i = 0; i < polygon->size(); i++)
+    {
+        keyhole_t *node = &nodes[used++];
+        node->point = &points->at(polygon->at(i));
+        node->next = (i < polygon->size() - 1) ? node + 1 : 0;
+        tree_nodes.push_back(node);
+    }
+    relabel(nodes);
+    keyhole_t *root = build_kd(&tree_nodes[0], tree_nodes.size(), 0);
+    int balanced_size = tree_nodes.size();
+
+    int poly_index;
+    for(poly_index = 1; poly_index < polys->size(); poly_index++)
+    {
+        polygon = &polys->at(poly_index);
+        int size = polygon->size();
+
+// nearest points in 2 polygons
+        keyhole_t *nearest_point1 = 0;
+        int nearest_point2 = -1;
+        float nearest_dist = -1;
+        for(j = 0; j < size; j++)
+        {
+            keyhole_t *point1 = 0;
+            float dist = -1;
+            nearest_kd(root, 0, &points->at(polygon->at(j)), &point1, &dist);
+            if(!nearest_point1 ||
+                dist < nearest_dist ||
+                (dist == nearest_dist && point1->label < nearest_point1->label))
+            {
+                nearest_point1 = point1;
+                nearest_point2 = j;
+                nearest_dist = dist;
+            }
+        }
+
+// insert the polygon, close it off & return to the nearest point
+        keyhole_t *prev = nearest_point1;
+        keyhole_t *after = prev->next;
+        uint64_t end_label = after ? after->label : prev->label + LABEL_GAP * (size + 2);
+        uint64_t step = (end_label - prev->label) / (size + 3);
+        for(i = 0; i < size + 2; i++)
+        {
+            keyhole_t *node = &nodes[used++];
+            if(i < size)
+            {
+                node->point = &points->at(polygon->at((i + nearest_point2) % size));
+            }
+            else
+            if(i == size)
+            {
+                node->point = &points->at(polygon->at(nearest_point2));
+            }
+            else
+            {
+                node->point = nearest_point1->point;
+            }
+            node->label = prev->label + step;
+            prev->next = node;
+            prev = node;
+            insert_kd(root, node);
+            tree_nodes.push_back(node);
+        }
+        prev->next = after;
+
+// the holes are inserted in order so rebalance when the tree doubles
+        if(tree_nodes.size() > balanced_size * 2)
+        {
+            root = build_kd(&tree_nodes[0], tree_nodes.size(), 0);
+            balanced_size = tree_nodes.size();
+        }
+
+        if(step == 0)
+        {
+            relabel(nodes);
+        }
+    }
+
+    return nodes;
+}
+
+// which end of the contour a line attaches to
+#define ATTACH_NONE 0
+#define ATTACH_FRONT 1
+#define ATTACH_FRONT_FLIPPED 2
+#define ATTACH_BACK 3
+#define ATTACH_BACK_FLIPPED 4
+
+int attach_line(line_t *unknown, line_t *front, line_t *back)
+{
+    if(touches2(unknown->x2, unknown->y2, front->x1, front->y1))
+    {
+// end of unknown line touches start of sorted list
+        return ATTACH_FRONT;
+    }
+    if(touches2(unknown->x1, unknown->y1, front->x1, front->y1))
+    {
+// start of unknown line touches start of sorted list
+        return ATTACH_FRONT_FLIPPED;
+    }
+    if(touches2(unknown->x1, unknown->y1, back->x2, back->y2))
+    {
+// start of unknown line touches end of sorted list
+        return ATTACH_BACK;
+    }
+    if(touches2(unknown->x2, unknown->y2, back->x2, back->y2))
+    {
+// end of unknown line touches end of sorted list
+        return ATTACH_BACK_FLIPPED;
+    }
+    return ATTACH_NONE;
+}
+
+// Chain the lines into polygon contours.  The line endpoints go in a spatial
+// hash so only lines near the ends of the contour are tested.  The contours
+// come out in the order of the original search, which started with the 1st
+// unused line & scanned the unused lines for 1 touching either end, resuming
+// after each line it attached & starting over from the 1st unused line until
+// a pass attached nothing.  The next line is therefore the lowest unused line
+// after the last one attached or failing that, the lowest unused line.
+void chain_lines(vector<line_t> *lines,
+    vector<vector_t> *points,
+    vector<polygon_t> *polys)
+{
+    int total = lines->size();
+    int remaining = total;
+    int first = 0;
+    int i;
+    grid_t grid;
+    vector<char> used(total, 0);
+    vector<int> candidates;
+
+    init_grid(&grid, total * 2);
+    for(i = 0; i < total; i++)
+    {
+        line_t *line = &lines->at(i);
+        grid_insert(&grid, line->x1, line->y1, 0, i);
+        grid_insert(&grid, line->x2, line->y2, 0, i);
+    }
+
+    while(remaining > 0)
+    {
+        while(used[first])
+        {
+            first++;
+        }
+
+        deque<int> sorted;
+        sorted.push_back(first);
+        used[first] = 1;
+        remaining--;
+        int position = first + 1;
+
+        while(1)
+        {
+            line_t *front = &lines->at(sorted.front());
+            line_t *back = &lines->at(sorted.back());
+            candidates.clear();
+            grid_query2(&grid, front->x1, front->y1, &candidates);
+            grid_query2(&grid, back->x2, back->y2, &candidates);
+
+            int next = -1;
+            int wrapped = -1;
+            for(i = 0; i < candidates.size(); i++)
+            {
+                int id = candidates[i];
+                if(used[id] ||
+                    !attach_line(&lines->at(id), front, back))
+                {
+                    continue;
+                }
+
+                if(id >= position)
+                {
+                    if(next < 0 || id < next)
                     {
-                        nearest_dist = dist;
-                        nearest_point1 = i;
-                        nearest_point2 = j;
+                        next = id;
                     }
                 }
+                else
+                if(wrapped < 0 || id < wrapped)
+                {
+                    wrapped = id;
+                }
             }
 
-// insert polygon
-            for(i = 0; i < polygon->size(); i++)
+            if(next < 0)
             {
-                int offset2 = i + nearest_point2;
-                if(offset2 >= polygon->size())
-                {
-                    offset2 -= polygon->size();
-                }
-                final.insert(final.begin() + nearest_point1 + i + 1, polygon->at(offset2));
+                next = wrapped;
+            }
+            if(next < 0)
+            {
+                break;
             }
 
-// close off inserted polygon
-            final.insert(final.begin() + nearest_point1 + polygon->size() + 1,
-                polygon->at(nearest_point2));
-            final.insert(final.begin() + nearest_point1 + polygon->size() + 2,
-                final.at(nearest_point1));
+            line_t *unknown = &lines->at(next);
+            switch(attach_line(unknown, front, back))
+            {
+                case ATTACH_FRONT:
+                    sorted.push_front(next);
+                    break;
+                case ATTACH_FRONT_FLIPPED:
+                    flip_line(unknown);
+                    sorted.push_front(next);
+                    break;
+                case ATTACH_BACK:
+                    sorted.push_back(next);
+                    break;
+                case ATTACH_BACK_FLIPPED:
+                    flip_line(unknown);
+                    sorted.push_back(next);
+                    break;
+            }
+            used[next] = 1;
+            remaining--;
+            position = next + 1;
+        }
 
+        printf("main %d: polygon lines=%d lines left=%d\n", __LINE__, (int)sorted.size(), remaining);
+
+// create new polygon from sorted lines
+        polys->push_back(polygon_t());
+        polygon_t *polygon = &polys->back();
+        vector_t point = { 0, 0, 0 };
+        line_t *line = &lines->at(sorted.at(0));
+        point.x = line->x1;
+        point.y = line->y1;
+        polygon->push_back(points->size());
+        points->push_back(point);
+        for(i = 0; i < sorted.size(); i++)
+        {
+            line = &lines->at(sorted.at(i));
+            point.x = line->x2;
+            point.y = line->y2;
+            polygon->push_back(points->size());
+            points->push_back(point);
         }
+    }
+}
+
+void make_footprint(int blob_index, int src_index, triangle_t *blob, int total)
+{
+    int i, j, k;
+    vector<polygon_t> polys;
+    vector<vector_t> points;
+    vector<triangle_t> horiz;
+    vector<line_t> lines;
+
+// extract useful triangles from the blob
+    for(j = 0; j < total; j++)
+    {
+        triangle_t *tri = &blob[j];
+        if(is_flat(tri))
+        {
+// transfer to horizontal triangle table for later
+            horiz.push_back(*tri);
+        }
+        else
+        if(is_top(tri))
+        {
+// convert the top vertical triangles to lines.
+// Vertical triangles on the bottom are discarded.
+            line_t line;
+            triangle_to_line(&line, tri);
+            lines.push_back(line);
+        }
+    }
+
+    printf("main %d: blob %d edge triangles=%d\n", __LINE__, blob_index, (int)lines.size());
+
+
+// sort lines to make polygon contours
+    points.reserve(lines.size() * 2);
+    chain_lines(&lines, &points, &polys);
+
+
+// Combine polygons whose start or end are joined by horizontal triangles
+// These are holes created by Freecad's sweep tool.
+    printf("main %d: unjoined polygons=%d\n", __LINE__, (int)polys.size());
+    join_polygons(&polys, &points, &horiz);
+
+    printf("main %d: joined polygons=%d\n", __LINE__, (int)polys.size());
+
+
+
+
+
+// start the output footprint
+    fprintf(dst, 
+        "  (footprint \"LOGO\" (layer \"F.Cu\")\n"
+        "    (tedit 0) (tstamp 0ee69f2a-4ef2-4004-81f1-f2c3e293a6f5)\n"
+        "    (at %.2f %.2f)\n"
+        "    (attr board_only exclude_from_pos_files exclude_from_bom)\n",
+        X,
+        Y);
+
+// create subtraction booleans with child polygons
+    if(subtract_mode.at(src_index))
+    {
+// TODO: detect child polygons & OR polygons.
+// Parent is hard coded for now & we assume there are no overlapping OR polygons.
+        keyhole_t *final = keyhole_polygons(&polys, &points);
 
 // Print booleaned polygons in 1 fp_poly
         fprintf(dst, "    (fp_poly (pts\n");
 
-        for(i = 0; i < final.size(); i++)
+        keyhole_t *node;
+        for(node = final; node; node = node->next)
         {
-            vector_t *point = final.at(i);
+            vector_t *point = node->point;
             fprintf(dst, "        (xy %f %f)\n", point->x, -point->y);
         }
+        delete [] final;
         poly_footer(dst_layer.at(src_index), fill_mode.at(src_index));
 
     }
@@ -706,12 +1347,12 @@ void make_footprint(int blob_index, int src_index, blob_t *blob)
         int poly_index;
         for(poly_index = 0; poly_index < polys.size(); poly_index++)
         {
-            polygon_t *polygon = polys.at(poly_index);
+            polygon_t *polygon = &polys.at(poly_index);
             fprintf(dst, "    (fp_poly (pts\n");
 
             for(i = 0; i < polygon->size(); i++)
             {
-                vector_t *point = polygon->at(i);
+                vector_t *point = &points.at(polygon->at(i));
                 fprintf(dst, "        (xy %f %f)\n", point->x, -point->y);
             }
             poly_footer(dst_layer.at(src_index), fill_mode.at(src_index));
@@ -726,6 +1367,108 @@ void make_footprint(int blob_index, int src_index, blob_t *blob)
 
 
 
+// run the function on every index on a thread pool
+typedef struct
+{
+    int total;
+    int next;
+    void (*function)(int index);
+} thread_pool_t;
+
+void* thread_pool_loop(void *ptr)
+{
+    thread_pool_t *pool = (thread_pool_t*)ptr;
+    while(1)
+    {
+        int i = __sync_fetch_and_add(&pool->next, 1);
+        if(i >= pool->total)
+        {
+            break;
+        }
+        pool->function(i);
+    }
+    return 0;
+}
+
+void for_each_index(int total, void (*function)(int index))
+{
+    thread_pool_t pool;
+    pthread_t threads[MAX_THREADS];
+    int total_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if(total_threads < 1)
+    {
+        total_threads = 1;
+    }
+    if(total_threads > MAX_THREADS)
+    {
+        total_threads = MAX_THREADS;
+    }
+    if(total_threads > total)
+    {
+        total_threads = total;
+    }
+
+    pool.total = total;
+    pool.next = 0;
+    pool.function = function;
+    for(i = 0; i < total_threads; i++)
+    {
+        pthread_create(&threads[i], 0, thread_pool_loop, &pool);
+    }
+    for(i = 0; i < total_threads; i++)
+    {
+        pthread_join(threads[i], 0);
+    }
+}
+
+// read a command file entry & extract the blobs
+void read_entry(int src_index)
+{
+    int i;
+    int src_count = 0;
+    entry_t *entry = &entries.at(src_index);
+
+    printf("main %d reading %s\n", __LINE__, src_stl.at(src_index));
+    stl_triangle_t *stl = read_stl(src_stl.at(src_index), &src_count);
+
+// convert to a triangle array
+    entry->triangles.resize(src_count);
+    for(i = 0; i < src_count; i++)
+    {
+        entry->triangles[i].coords[0] = stl[i].coords[0];
+        entry->triangles[i].coords[1] = stl[i].coords[1];
+        entry->triangles[i].coords[2] = stl[i].coords[2];
+    }
+    free(stl);
+
+// extract blobs from the file
+    extract_blobs(&entry->triangles, &entry->blobs);
+    printf("main %d: total_blobs=%d\n", __LINE__, (int)entry->blobs.size());
+}
+
+// print the footprint or via for 1 blob
+void render_output(int output_index)
+{
+    output_t *output = &outputs.at(output_index);
+    entry_t *entry = &entries.at(output->src_index);
+    blob_t *blob = &entry->blobs.at(output->blob_index);
+    triangle_t *triangles = &entry->triangles[blob->start];
+    dst = open_memstream(&output->text, &output->size);
+
+    if(!strcasecmp(command.at(output->src_index), "polys"))
+    {
+        make_footprint(output->blob_index, output->src_index, triangles, blob->size);
+    }
+    else
+    {
+        make_via(triangles, blob->size);
+    }
+
+    fclose(dst);
+}
+
 int main(int argc, char *argv[])
 {
     int i, j, k;
@@ -748,7 +1491,6 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    int src_count = 0;
     const char *command_path = 0;
     const char *dst_path = 0;
     for(i = 1; i < argc; i++)
@@ -852,76 +1594,23 @@ int main(int argc, char *argv[])
 
     fprintf(dst, "%s", header);
 
+    entries.resize(src_stl.size());
+    for_each_index(src_stl.size(), read_entry);
+
     int src_index;
     for(src_index = 0; src_index < src_stl.size(); src_index++)
     {
-        vector<triangle_t*> src;
-        vector<blob_t*> blobs;
-
-        printf("main %d reading %s\n", __LINE__, src_stl.at(src_index));
-        stl_triangle_t *stl = read_stl(src_stl.at(src_index), &src_count);
-
-// convert to a triangle array
-        for(i = 0; i < src_count; i++)
-        {
-            src.push_back(new_triangle(&stl[i]));
-        }
-
-// extract blobs from the file
-        while(src.size() > 0)
-        {
-// start a new blob with the last triangle
-            blob_t *blob = new blob_t;
-            blobs.push_back(blob);
-            blob->push_back(src.back());
-            src.pop_back();
-
-
-            int done = 0;
-            while(!done)
-            {
-                done = 1;
-
-// test all triangles in the blob with all the unknown triangles
-                for(i = 0; i < blob->size(); i++)
-                {
-                    triangle_t *known = blob->at(i);
-                    for(j = 0; j < src.size(); j++)
-                    {
-                        triangle_t *unknown = src.at(j);
-                        if(touches(unknown, known))
-                        {
-// transfer the triangle to the blob
-                            blob->push_back(unknown);
-                            src.erase(src.begin() + j);
-                            j--;
-                            done = 0;
-                        }
-                    }
-                }
-            }
-        }
-
-
-
-        printf("main %d: total_blobs=%d\n", __LINE__, (int)blobs.size());
-
-
-        if(!strcasecmp(command.at(src_index), "polys"))
+        if(!strcasecmp(command.at(src_index), "polys") ||
+            !strcasecmp(command.at(src_index), "vias"))
         {
-            for(i = 0; i < blobs.size(); i++)
+            for(i = 0; i < entries.at(src_index).blobs.size(); i++)
             {
-                blob_t *blob = blobs.at(i);
-                make_footprint(i, src_index, blobs.at(i));
-            }
-        }
-        else
-        if(!strcasecmp(command.at(src_index), "vias"))
-        {
-            for(i = 0; i < blobs.size(); i++)
-            {
-                blob_t *blob = blobs.at(i);
-                make_via(blobs.at(i));
+                output_t output;
+                output.src_index = src_index;
+                output.blob_index = i;
+                output.text = 0;
+                output.size = 0;
+                outputs.push_back(output);
             }
         }
         else
@@ -930,6 +1619,14 @@ int main(int argc, char *argv[])
         }
     }
 
+    for_each_index(outputs.size(), render_output);
+
+    for(i = 0; i < outputs.size(); i++)
+    {
+        fwrite(outputs.at(i).text, 1, outputs.at(i).size, dst);
+        free(outputs.at(i).text);
+    }
+
     fprintf(dst, "%s", footer);
     fclose(dst);
 }
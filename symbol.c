@@ -1,26 +1,52 @@
 // what file in the current directory contains the symbol?
 // currently finds the definitions & usages
 
-// gcc -O3 symbol.c -o symbol
+// The ELF symbol tables & ar archives are read directly with mmap on a
+// thread pool instead of running nm.
 
+// The symbols are stored in .symbol_index in the current directory.  Each
+// run only rereads the files whose size or mtime changed.  Queries are
+// answered from the mmapped index.
+
+// C++ names are demangled when they're indexed so they can be searched by
+// their demangled form.
+
+// gcc -O3 symbol.c -o symbol -lpthread -lstdc++
+
+#define _GNU_SOURCE
+#include <ar.h>
 #include <ctype.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #define TEXTLEN 1024
+#define MAX_THREADS 64
+#define INDEX_PATH ".symbol_index"
+// symbols to print in a fuzzy search
+#define FUZZY_RESULTS 20
 // ignore files starting in .
 int ignore_hidden = 1;
 #define MAX_EXTENSIONS 64
 char *extensions[MAX_EXTENSIONS] = { 0 };
 int total_extensions = 0;
+// extensions given on the command line.  Queries only print these files.
+int query_extensions = 0;
 
 typedef struct
 {
     char *string;
     struct timespec date;
+    off_t size;
 } file_t;
 
 typedef struct
@@ -30,7 +56,7 @@ typedef struct
     int allocated;
 } vector_t;
 
-void append_vector(vector_t *vector, char *string, struct timespec date)
+void append_vector(vector_t *vector, char *string, struct stat *ostat)
 {
     if(vector->allocated < vector->size + 1)
     {
@@ -56,7 +82,8 @@ void append_vector(vector_t *vector, char *string, struct timespec date)
     
     
     vector->files[vector->size].string = strdup(string);
-    vector->files[vector->size].date = date;
+    vector->files[vector->size].date = ostat->st_mtim;
+    vector->files[vector->size].size = ostat->st_size;
     vector->size++;
 }
 
@@ -155,7 +182,7 @@ void listdir(char *dir, vector_t *dst)
         if(!skip)
         {
 //printf("listdir %d %s\n", __LINE__, string);
-            append_vector(dst, string, ostat.st_mtim);
+            append_vector(dst, string, &ostat);
         }
     }
     fclose(fd);
@@ -169,97 +196,2271 @@ void listdir(char *dir, vector_t *dst)
     }
 }
 
-void main(int argc, char *argv[])
+
+// a symbol from an ELF symbol table
+typedef struct
+{
+// path or path(member) for archive members
+    const char *object;
+    const char *name;
+// nm style type letter
+    char type;
+// section name or 0 if undefined
+    const char *section;
+    uint64_t value;
+// 32 or 64
+    int bits;
+// from a shared library
+    int shared;
+// contents of a relocatable object, to spot copies of it.  0 for other 
+// objects.
+    uint64_t object_hash;
+} symbol_t;
+
+typedef void (*symbol_callback_t)(symbol_t *symbol, void *arg);
+
+typedef struct
+{
+    const char *name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t link;
+} section_t;
+
+// get a string from a string table or 0 if it's out of bounds
+const char* get_elf_string(const uint8_t *data, 
+    size_t size, 
+    section_t *strtab, 
+    uint32_t offset)
 {
-    if(argc < 3)
+    if(!strtab ||
+        strtab->offset > size ||
+        strtab->size > size - strtab->offset ||
+        offset >= strtab->size)
     {
-        printf("Usage: symbol <the symbol> [file extension] [file extension]\n");
-        printf("Example: symbol timer_create o a so ko\n");
-        return;
+        return 0;
     }
 
-    vector_t dir_files;
-    bzero(&dir_files, sizeof(vector_t));
+    const char *ptr = (const char*)data + strtab->offset + offset;
+    if(!memchr(ptr, 0, strtab->size - offset))
+    {
+        return 0;
+    }
+    return ptr;
+}
+
+// nm's type letter
+char symbol_type(int binding, 
+    int type, 
+    int shndx, 
+    section_t *sections, 
+    int total_sections)
+{
+    char result;
+    if(shndx == SHN_UNDEF)
+    {
+        return binding == STB_WEAK ? 'w' : 'U';
+    }
+    if(type == STT_GNU_IFUNC)
+    {
+        return 'i';
+    }
+    if(binding == STB_WEAK)
+    {
+        return type == STT_OBJECT ? 'V' : 'W';
+    }
+    if(binding == STB_GNU_UNIQUE)
+    {
+        return 'u';
+    }
+
+    if(shndx == SHN_ABS)
+    {
+        result = 'A';
+    }
+    else
+    if(shndx == SHN_COMMON)
+    {
+        result = 'C';
+    }
+    else
+    if(shndx >= total_sections)
+    {
+        result = '?';
+    }
+    else
+    {
+        section_t *section = &sections[shndx];
+        if(section->flags & SHF_EXECINSTR)
+        {
+            result = 'T';
+        }
+        else
+        if(section->type == SHT_NOBITS)
+        {
+            result = 'B';
+        }
+        else
+        if(!(section->flags & SHF_ALLOC))
+        {
+            result = 'N';
+        }
+        else
+        if(!(section->flags & SHF_WRITE))
+        {
+            result = 'R';
+        }
+        else
+        {
+            result = 'D';
+        }
+    }
+
+    if(binding == STB_LOCAL)
+    {
+        result = tolower(result);
+    }
+    return result;
+}
+
+uint64_t hash_data(const uint8_t *data, size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ size;
+    size_t i;
+    for(i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(uint64_t));
+        h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+    }
+    for( ; i < size; i++)
+    {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
 
+// read the symbols from 1 ELF object.  Uses .symtab if it exists or .dynsym
+// for stripped libraries, like nm & nm -D.
+// returns 1 if it isn't a usable ELF file
+int read_elf_symbols(const char *object,
+    const uint8_t *data, 
+    size_t size, 
+    symbol_callback_t callback, 
+    void *arg)
+{
+    if(size < EI_NIDENT ||
+        memcmp(data, ELFMAG, SELFMAG) ||
+        data[EI_DATA] != ELFDATA2LSB)
+    {
+        return 1;
+    }
+
+    int is64 = data[EI_CLASS] == ELFCLASS64;
+    int elf_type;
+    uint64_t shoff;
+    uint32_t shentsize;
+    uint32_t shnum;
+    uint32_t shstrndx;
+    if(is64)
+    {
+        if(size < sizeof(Elf64_Ehdr))
+        {
+            return 1;
+        }
+        const Elf64_Ehdr *header = (const Elf64_Ehdr*)data;
+        elf_type = header->e_type;
+        shoff = header->e_shoff;
+        shentsize = header->e_shentsize;
+        shnum = header->e_shnum;
+        shstrndx = header->e_shstrndx;
+    }
+    else
+    {
+        if(size < sizeof(Elf32_Ehdr))
+        {
+            return 1;
+        }
+        const Elf32_Ehdr *header = (const Elf32_Ehdr*)data;
+        elf_type = header->e_type;
+        shoff = header->e_shoff;
+        shentsize = header->e_shentsize;
+        shnum = header->e_shnum;
+        shstrndx = header->e_shstrndx;
+    }
+
+    if(shentsize != (is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr)) ||
+        shoff == 0 ||
+        shoff > size ||
+        shoff + shentsize > size)
+    {
+        return 1;
+    }
+
+// extended section count & string table index
+    if(shnum == 0 || shstrndx == SHN_XINDEX)
+    {
+        if(is64)
+        {
+            const Elf64_Shdr *first = (const Elf64_Shdr*)(data + shoff);
+            if(shnum == 0)
+            {
+                shnum = first->sh_size;
+            }
+            if(shstrndx == SHN_XINDEX)
+            {
+                shstrndx = first->sh_link;
+            }
+        }
+        else
+        {
+            const Elf32_Shdr *first = (const Elf32_Shdr*)(data + shoff);
+            if(shnum == 0)
+            {
+                shnum = first->sh_size;
+            }
+            if(shstrndx == SHN_XINDEX)
+            {
+                shstrndx = first->sh_link;
+            }
+        }
+    }
+
+    if(shnum == 0 || (size - shoff) / shentsize < shnum)
+    {
+        return 1;
+    }
+
+    section_t *sections = calloc(sizeof(section_t), shnum);
     int i;
-    char *symbol = 0;
-    for(i = 1; i < argc; i++)
+    for(i = 0; i < shnum; i++)
     {
-        if(i == 1)
+        section_t *section = &sections[i];
+        uint32_t name;
+        if(is64)
         {
-            symbol = argv[i];
+            const Elf64_Shdr *shdr = (const Elf64_Shdr*)(data + shoff) + i;
+            name = shdr->sh_name;
+            section->type = shdr->sh_type;
+            section->flags = shdr->sh_flags;
+            section->offset = shdr->sh_offset;
+            section->size = shdr->sh_size;
+            section->link = shdr->sh_link;
         }
         else
-        if(total_extensions < MAX_EXTENSIONS)
         {
-            extensions[total_extensions++] = argv[i];
+            const Elf32_Shdr *shdr = (const Elf32_Shdr*)(data + shoff) + i;
+            name = shdr->sh_name;
+            section->type = shdr->sh_type;
+            section->flags = shdr->sh_flags;
+            section->offset = shdr->sh_offset;
+            section->size = shdr->sh_size;
+            section->link = shdr->sh_link;
         }
+// the name is resolved after all the sections are read
+        section->name = (const char*)(uintptr_t)name;
     }
-    listdir(".", &dir_files);
 
-//printf("symbol=%s\n", symbol);
+    section_t *shstrtab = shstrndx < shnum ? &sections[shstrndx] : 0;
+    section_t *symtab = 0;
+    for(i = 0; i < shnum; i++)
+    {
+        section_t *section = &sections[i];
+        section->name = get_elf_string(data, 
+            size, 
+            shstrtab, 
+            (uint32_t)(uintptr_t)section->name);
+        if(section->type == SHT_SYMTAB)
+        {
+            symtab = section;
+        }
+        else
+        if(section->type == SHT_DYNSYM && 
+            (!symtab || symtab->type != SHT_SYMTAB))
+        {
+            symtab = section;
+        }
+    }
+
+    if(!symtab ||
+        symtab->link >= shnum ||
+        symtab->offset > size ||
+        symtab->size > size - symtab->offset)
+    {
+        free(sections);
+        return 0;
+    }
+
+    section_t *strtab = &sections[symtab->link];
+    int entsize = is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+    int total = symtab->size / entsize;
+    symbol_t symbol;
+    symbol.object = object;
+    symbol.bits = is64 ? 64 : 32;
+    symbol.shared = elf_type == ET_DYN;
+    symbol.object_hash = elf_type == ET_REL ? hash_data(data, size) : 0;
+// entry 0 is always empty
+    for(i = 1; i < total; i++)
+    {
+        uint32_t name;
+        int info;
+        int shndx;
+        uint64_t value;
+        if(is64)
+        {
+            const Elf64_Sym *sym = (const Elf64_Sym*)(data + symtab->offset) + i;
+            name = sym->st_name;
+            info = sym->st_info;
+            shndx = sym->st_shndx;
+            value = sym->st_value;
+        }
+        else
+        {
+            const Elf32_Sym *sym = (const Elf32_Sym*)(data + symtab->offset) + i;
+            name = sym->st_name;
+            info = sym->st_info;
+            shndx = sym->st_shndx;
+            value = sym->st_value;
+        }
+
+        int type = ELF64_ST_TYPE(info);
+        int binding = ELF64_ST_BIND(info);
+        if(type == STT_SECTION || type == STT_FILE)
+        {
+            continue;
+        }
+
+        symbol.name = get_elf_string(data, size, strtab, name);
+        if(!symbol.name || !symbol.name[0])
+        {
+            continue;
+        }
 
-    for(i = 0; i < dir_files.size; i++)
+        symbol.type = symbol_type(binding, type, shndx, sections, shnum);
+        symbol.section = 0;
+        if(shndx != SHN_UNDEF && shndx < shnum)
+        {
+            symbol.section = sections[shndx].name;
+        }
+        symbol.value = value;
+        callback(&symbol, arg);
+    }
+
+    free(sections);
+    return 0;
+}
+
+// read the symbols from an ELF file or every member of an ar archive
+// returns 1 if the file couldn't be read
+int read_symbols(const char *path, symbol_callback_t callback, void *arg)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return 1;
+    }
+
+    struct stat ostat;
+    if(fstat(fd, &ostat) || !S_ISREG(ostat.st_mode) || ostat.st_size < SELFMAG)
+    {
+        close(fd);
+        return 1;
+    }
+
+    size_t size = ostat.st_size;
+    const uint8_t *data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
     {
-        char string[TEXTLEN];
-        char *path = dir_files.files[i].string;
-        char *ptr = strrchr(path, '.');
+        return 1;
+    }
 
-        sprintf(string, "bash -c 'nm %s |& grep %s'\n", path, symbol);
-//printf("Running %s", string);
-        FILE *fd = popen(string, "r");
-        while(!feof(fd))
+    if(size >= SARMAG && !memcmp(data, ARMAG, SARMAG))
+    {
+// archive members
+        const char *long_names = 0;
+        size_t long_names_size = 0;
+        size_t offset = SARMAG;
+        char object[TEXTLEN * 2];
+        while(offset + sizeof(struct ar_hdr) <= size)
         {
-            char *result = fgets(string, TEXTLEN, fd);
-            if(!result)
+            const struct ar_hdr *header = (const struct ar_hdr*)(data + offset);
+            char string[sizeof(header->ar_size) + 1];
+            memcpy(string, header->ar_size, sizeof(header->ar_size));
+            string[sizeof(header->ar_size)] = 0;
+            size_t member_size = strtoull(string, 0, 10);
+            size_t member_offset = offset + sizeof(struct ar_hdr);
+            if(member_offset > size || member_size > size - member_offset)
             {
                 break;
             }
-//printf("    result=%s", result);
 
-            // error or junk
-            if(strstr(string, "nm:"))
+            const uint8_t *member = data + member_offset;
+            size_t next_offset = (member_offset + member_size + 1) & ~(size_t)1;
+            char name[TEXTLEN];
+            int name_len = 0;
+            if(header->ar_name[0] == '/' && header->ar_name[1] == '/')
+            {
+// GNU long name table
+                long_names = (const char*)member;
+                long_names_size = member_size;
+            }
+            else
+            if(header->ar_name[0] == '/' && isdigit(header->ar_name[1]))
+            {
+// GNU long name
+                size_t name_offset = atoi(header->ar_name + 1);
+                while(long_names &&
+                    name_offset + name_len < long_names_size &&
+                    long_names[name_offset + name_len] != '/' &&
+                    long_names[name_offset + name_len] != '\n' &&
+                    name_len < TEXTLEN - 1)
+                {
+                    name[name_len] = long_names[name_offset + name_len];
+                    name_len++;
+                }
+            }
+            else
+            if(!memcmp(header->ar_name, "#1/", 3))
             {
+// BSD long name follows the header
+                int len = atoi(header->ar_name + 3);
+                if(len <= member_size)
+                {
+                    name_len = len < TEXTLEN - 1 ? len : TEXTLEN - 1;
+                    memcpy(name, member, name_len);
+                    member += len;
+                    member_size -= len;
+                }
             }
             else
-            // line contains the symbol
-            if((ptr = strstr(string, symbol)) != 0)
+            if(header->ar_name[0] != '/')
             {
-                // exact match
-                if(ptr > string && *(ptr - 1) == ' ' &&
-                    *(ptr + strlen(symbol)) == '\n')
+// short name terminated by / or space
+                while(name_len < sizeof(header->ar_name) &&
+                    header->ar_name[name_len] != '/' &&
+                    header->ar_name[name_len] != ' ')
                 {
-                    ptr = string;
+                    name[name_len] = header->ar_name[name_len];
+                    name_len++;
+                }
+            }
+// other names starting with / are symbol indexes
 
-                    // skip address
-                    while(*ptr && isalnum(*ptr))
-                    {
-                        ptr++;
-                    }
+            if(name_len > 0)
+            {
+                name[name_len] = 0;
+                sprintf(object, "%s(%s)", path, name);
+                read_elf_symbols(object, member, member_size, callback, arg);
+            }
 
-                    // skip whitespace
-                    while(*ptr && (*ptr == ' ' || *ptr == '\t'))
-                    {
-                        ptr++;
-                    }
+            offset = next_offset;
+        }
+    }
+    else
+    {
+        read_elf_symbols(path, data, size, callback, arg);
+    }
 
-// has a definition
-                    if(*ptr == 'T' || *ptr == 't')
-                    {
-                        printf("%s: %s", path, string);
-                    }
-                    else
-// has a usage
-                    if(*ptr == 'U' || *ptr == 'u')
-                    {
-                        printf("%s: %s", path, string);
-                    }
-                }
-            }
+    munmap((void*)data, size);
+    return 0;
+}
+
+// run the function on every file on a thread pool
+typedef struct
+{
+    vector_t *files;
+    int next_file;
+    void (*function)(int file_index, void *arg);
+    void *arg;
+} thread_pool_t;
+
+void* thread_pool_loop(void *ptr)
+{
+    thread_pool_t *pool = (thread_pool_t*)ptr;
+    while(1)
+    {
+        int i = __sync_fetch_and_add(&pool->next_file, 1);
+        if(i >= pool->files->size)
+        {
+            break;
+        }
+        pool->function(i, pool->arg);
+    }
+    return 0;
+}
+
+void for_each_file(vector_t *files, 
+    void (*function)(int file_index, void *arg), 
+    void *arg)
+{
+    thread_pool_t pool;
+    pthread_t threads[MAX_THREADS];
+    int total_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if(total_threads < 1)
+    {
+        total_threads = 1;
+    }
+    if(total_threads > MAX_THREADS)
+    {
+        total_threads = MAX_THREADS;
+    }
+
+    pool.files = files;
+    pool.next_file = 0;
+    pool.function = function;
+    pool.arg = arg;
+    for(i = 0; i < total_threads; i++)
+    {
+        pthread_create(&threads[i], 0, thread_pool_loop, &pool);
+    }
+    for(i = 0; i < total_threads; i++)
+    {
+        pthread_join(threads[i], 0);
+    }
+}
+
+// print a symbol like nm
+void print_symbol(FILE *fd, symbol_t *symbol)
+{
+    int digits = symbol->bits / 4;
+    if(symbol->type == 'U' || symbol->type == 'w')
+    {
+        fprintf(fd, "%s: %*s %c %s\n", 
+            symbol->object, 
+            digits, 
+            "", 
+            symbol->type, 
+            symbol->name);
+    }
+    else
+    {
+        fprintf(fd, "%s: %0*llx %c %s\n", 
+            symbol->object, 
+            digits, 
+            (unsigned long long)symbol->value, 
+            symbol->type, 
+            symbol->name);
+    }
+}
+
+
+#define MATCH_EXACT 0
+#define MATCH_PREFIX 1
+#define MATCH_SUBSTRING 2
+// substring of the demangled name
+#define MATCH_DEMANGLED 3
+// subsequence of the demangled name, ranked
+#define MATCH_FUZZY 4
+int match_mode = MATCH_EXACT;
+
+// from libstdc++
+char* __cxa_demangle(const char *mangled, char *buffer, size_t *length, int *status);
+
+// returns a new string or 0 if it's not a C++ name
+char* demangle(const char *name)
+{
+    int status = -1;
+    if(name[0] != '_' || name[1] != 'Z')
+    {
+        return 0;
+    }
+
+    char *result = __cxa_demangle(name, 0, 0, &status);
+    if(status != 0)
+    {
+        free(result);
+        return 0;
+    }
+    return result;
+}
+
+int match_name(const char *name, const char *symbol)
+{
+    switch(match_mode)
+    {
+        case MATCH_PREFIX:
+            return !strncmp(name, symbol, strlen(symbol));
+        case MATCH_SUBSTRING:
+            return strstr(name, symbol) != 0;
+        case MATCH_DEMANGLED:
+        {
+            char *demangled = demangle(name);
+            int result = strstr(demangled ? demangled : name, symbol) != 0;
+            free(demangled);
+            return result;
+        }
+        default:
+            return !strcmp(name, symbol);
+    }
+}
+
+// has a definition or a usage
+int is_reported(char type)
+{
+    return type == 'T' || type == 't' ||
+        type == 'U' || type == 'u';
+}
+
+typedef struct
+{
+    char *symbol;
+    vector_t *files;
+// output for each file
+    char **results;
+} search_t;
+
+typedef struct
+{
+    char *symbol;
+    FILE *fd;
+    char *buffer;
+    size_t buffer_size;
+} search_file_t;
+
+void search_callback(symbol_t *symbol, void *arg)
+{
+    search_file_t *search_file = (search_file_t*)arg;
+    if(match_name(symbol->name, search_file->symbol) &&
+        is_reported(symbol->type))
+    {
+        if(!search_file->fd)
+        {
+            search_file->fd = open_memstream(&search_file->buffer, 
+                &search_file->buffer_size);
+        }
+        char *demangled = 0;
+        if(match_mode == MATCH_DEMANGLED)
+        {
+            demangled = demangle(symbol->name);
+        }
+
+        if(demangled)
+        {
+            symbol_t result = *symbol;
+            result.name = demangled;
+            print_symbol(search_file->fd, &result);
+            free(demangled);
         }
+        else
+        {
+            print_symbol(search_file->fd, symbol);
+        }
+    }
+}
+
+void search_file(int file_index, void *arg)
+{
+    search_t *search = (search_t*)arg;
+    search_file_t search_file;
+    bzero(&search_file, sizeof(search_file));
+    search_file.symbol = search->symbol;
+    read_symbols(search->files->files[file_index].string, 
+        search_callback, 
+        &search_file);
+    if(search_file.fd)
+    {
+        fclose(search_file.fd);
+        search->results[file_index] = search_file.buffer;
+    }
+}
+
+// scan every file without the index
+void search_files(vector_t *dir_files, char *symbol)
+{
+    int i;
+    search_t search;
+    search.symbol = symbol;
+    search.results = calloc(sizeof(char*), dir_files->size);
+    search.files = dir_files;
+    for_each_file(dir_files, search_file, &search);
 
-        fclose(fd);
+// print in the order find listed them
+    for(i = 0; i < dir_files->size; i++)
+    {
+        if(search.results[i])
+        {
+            fputs(search.results[i], stdout);
+            free(search.results[i]);
+        }
     }
+    free(search.results);
 }
 
+// index file format:
+// index_header_t, index_file_t's, index_symbol_t's sorted by name, 
+// index_demangled_t's sorted by demangled name, index_posting_t's grouped 
+// by symbol, strings.  The symbol names are stored in sorted order at the 
+// start of the strings, followed by the demangled names in sorted order, so
+// substring searches can scan them in 1 block.
+#define INDEX_MAGIC "SYMIDX06"
+#define NO_STRING 0xffffffff
 
+typedef struct
+{
+    char magic[8];
+    uint32_t total_files;
+    uint32_t total_symbols;
+    uint32_t total_postings;
+    uint32_t total_demangled;
+    uint32_t strings_size;
+// end of the names block
+    uint32_t names_size;
+// end of the demangled block
+    uint32_t demangled_end;
+// space separated extensions the files were listed with.  Empty for all 
+// files.  Also pads the header to 8 bytes so the int64_t's in the records 
+// are aligned.
+    uint32_t extensions;
+} index_header_t;
+
+typedef struct
+{
+    uint32_t path;
+    uint32_t reserved;
+    int64_t size;
+    int64_t mtime_ns;
+} index_file_t;
+
+typedef struct
+{
+    uint32_t name;
+// NO_STRING if it's not a C++ name
+    uint32_t demangled;
+    uint32_t first_posting;
+    uint32_t total_postings;
+} index_symbol_t;
+
+typedef struct
+{
+    uint32_t demangled;
+    uint32_t symbol;
+} index_demangled_t;
+
+typedef struct
+{
+    uint64_t value;
+    uint64_t object_hash;
+    uint32_t file;
+// path or path(member)
+    uint32_t object;
+// NO_STRING if undefined
+    uint32_t section;
+    char type;
+    uint8_t bits;
+    uint8_t shared;
+    uint8_t reserved;
+} index_posting_t;
+
+// a mmapped index
+typedef struct
+{
+    void *data;
+    size_t size;
+    index_header_t *header;
+    index_file_t *files;
+    index_symbol_t *symbols;
+    index_demangled_t *demangled;
+    index_posting_t *postings;
+    const char *strings;
+} index_t;
+
+// a posting while the index is being built
+typedef struct
+{
+    const char *name;
+// 0 if it's not a C++ name
+    const char *demangled;
+    const char *object;
+    const char *section;
+    uint64_t value;
+    uint64_t object_hash;
+    uint32_t file;
+// order in the file
+    uint32_t order;
+    char type;
+    uint8_t bits;
+    uint8_t shared;
+} build_posting_t;
+
+typedef struct
+{
+    build_posting_t *postings;
+    int size;
+    int allocated;
+} build_vector_t;
+
+void append_posting(build_vector_t *vector, build_posting_t *posting)
+{
+    if(vector->size >= vector->allocated)
+    {
+        vector->allocated = vector->allocated ? vector->allocated * 2 : 64;
+        vector->postings = realloc(vector->postings, 
+            sizeof(build_posting_t) * vector->allocated);
+    }
+    vector->postings[vector->size++] = *posting;
+}
+
+int64_t to_ns(struct timespec t)
+{
+    return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+uint64_t hash_string(const char *string)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while(*string)
+    {
+        h = (h ^ (uint8_t)*string++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// returns 1 if a section or an offset in a record is out of range
+int check_index(index_t *index)
+{
+    index_header_t *header = index->header;
+    uint32_t i;
+
+// each section must fit in the file & the strings must fill the rest
+    size_t offset = sizeof(index_header_t);
+    offset += sizeof(index_file_t) * (size_t)header->total_files;
+    if(offset > index->size)
+    {
+        return 1;
+    }
+    offset += sizeof(index_symbol_t) * (size_t)header->total_symbols;
+    if(offset > index->size)
+    {
+        return 1;
+    }
+    offset += sizeof(index_demangled_t) * (size_t)header->total_demangled;
+    if(offset > index->size)
+    {
+        return 1;
+    }
+    offset += sizeof(index_posting_t) * (size_t)header->total_postings;
+    if(offset > index->size ||
+        offset + header->strings_size != index->size)
+    {
+        return 1;
+    }
+
+    index->files = (index_file_t*)(header + 1);
+    index->symbols = (index_symbol_t*)(index->files + header->total_files);
+    index->demangled = (index_demangled_t*)(index->symbols + header->total_symbols);
+    index->postings = (index_posting_t*)(index->demangled + header->total_demangled);
+    index->strings = (const char*)(index->postings + header->total_postings);
+
+// every string must be terminated inside its block
+    uint32_t strings_size = header->strings_size;
+    if(header->extensions >= strings_size ||
+        header->names_size > header->demangled_end ||
+        header->demangled_end > strings_size ||
+        (header->names_size && index->strings[header->names_size - 1]) ||
+        (header->demangled_end && index->strings[header->demangled_end - 1]) ||
+        (strings_size && index->strings[strings_size - 1]))
+    {
+        return 1;
+    }
+
+    for(i = 0; i < header->total_files; i++)
+    {
+        if(index->files[i].path >= strings_size)
+        {
+            return 1;
+        }
+    }
+
+    for(i = 0; i < header->total_symbols; i++)
+    {
+        index_symbol_t *symbol = &index->symbols[i];
+        if(symbol->name >= header->names_size ||
+            (symbol->demangled != NO_STRING &&
+            (symbol->demangled < header->names_size ||
+            symbol->demangled >= header->demangled_end)) ||
+            symbol->first_posting > header->total_postings ||
+            symbol->total_postings > header->total_postings - symbol->first_posting)
+        {
+            return 1;
+        }
+    }
+
+    for(i = 0; i < header->total_demangled; i++)
+    {
+        index_demangled_t *demangled = &index->demangled[i];
+        if(demangled->symbol >= header->total_symbols ||
+            demangled->demangled < header->names_size ||
+            demangled->demangled >= header->demangled_end)
+        {
+            return 1;
+        }
+    }
+
+    for(i = 0; i < header->total_postings; i++)
+    {
+        index_posting_t *posting = &index->postings[i];
+        if(posting->file >= header->total_files ||
+            posting->object >= strings_size ||
+            (posting->section != NO_STRING && posting->section >= strings_size))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// returns 1 if there's no usable index
+int open_index(index_t *index, const char *path)
+{
+    bzero(index, sizeof(index_t));
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return 1;
+    }
+
+    struct stat ostat;
+    fstat(fd, &ostat);
+    if(ostat.st_size < (off_t)sizeof(index_header_t))
+    {
+        close(fd);
+        return 1;
+    }
+
+    index->size = ostat.st_size;
+    index->data = mmap(0, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(index->data == MAP_FAILED)
+    {
+        index->data = 0;
+        return 1;
+    }
+
+    index->header = (index_header_t*)index->data;
+    if(memcmp(index->header->magic, INDEX_MAGIC, sizeof(index->header->magic)) ||
+        check_index(index))
+    {
+        fprintf(stderr, "open_index %d: %s is corrupt or out of date\n", __LINE__, path);
+        munmap(index->data, index->size);
+        index->data = 0;
+        return 1;
+    }
+    return 0;
+}
+
+void close_index(index_t *index)
+{
+    if(index->data)
+    {
+        munmap(index->data, index->size);
+    }
+    index->data = 0;
+}
+
+// scanning the changed files
+typedef struct
+{
+    vector_t *files;
+    int *changed;
+    build_vector_t *results;
+} update_t;
+
+typedef struct
+{
+    build_vector_t *vector;
+    uint32_t file;
+} update_file_t;
+
+void update_callback(symbol_t *symbol, void *arg)
+{
+    update_file_t *update_file = (update_file_t*)arg;
+    build_posting_t posting;
+    posting.name = strdup(symbol->name);
+    posting.demangled = demangle(symbol->name);
+    posting.object = strdup(symbol->object);
+    posting.section = symbol->section ? strdup(symbol->section) : 0;
+    posting.value = symbol->value;
+    posting.object_hash = symbol->object_hash;
+    posting.file = update_file->file;
+    posting.order = update_file->vector->size;
+    posting.type = symbol->type;
+    posting.bits = symbol->bits;
+    posting.shared = symbol->shared;
+    append_posting(update_file->vector, &posting);
+}
+
+void update_file(int file_index, void *arg)
+{
+    update_t *update = (update_t*)arg;
+    if(!update->changed[file_index])
+    {
+        return;
+    }
+
+    update_file_t update_file;
+    update_file.vector = &update->results[file_index];
+    update_file.file = file_index;
+    read_symbols(update->files->files[file_index].string, 
+        update_callback, 
+        &update_file);
+}
+
+int posting_compare(const void *ptr1, const void *ptr2)
+{
+    build_posting_t *item1 = (build_posting_t*)ptr1;
+    build_posting_t *item2 = (build_posting_t*)ptr2;
+    int result = strcmp(item1->name, item2->name);
+    if(result)
+    {
+        return result;
+    }
+    if(item1->file != item2->file)
+    {
+        return item1->file < item2->file ? -1 : 1;
+    }
+    if(item1->order != item2->order)
+    {
+        return item1->order < item2->order ? -1 : 1;
+    }
+    return 0;
+}
+
+// deduplicated strings for the index
+typedef struct
+{
+    char *data;
+    uint32_t size;
+    uint32_t allocated;
+    uint32_t *table;
+    uint32_t table_size;
+    uint32_t table_used;
+} string_table_t;
+
+uint32_t append_string(string_table_t *strings, const char *string)
+{
+    uint32_t len = strlen(string) + 1;
+    if(strings->size + len > strings->allocated)
+    {
+        strings->allocated = (strings->size + len) * 2;
+        strings->data = realloc(strings->data, strings->allocated);
+    }
+    uint32_t offset = strings->size;
+    memcpy(strings->data + offset, string, len);
+    strings->size += len;
+    return offset;
+}
+
+uint32_t get_string(string_table_t *strings, const char *string)
+{
+    uint32_t i;
+    if(!string)
+    {
+        return NO_STRING;
+    }
+
+    if((strings->table_used + 1) * 2 > strings->table_size)
+    {
+        uint32_t *old_table = strings->table;
+        uint32_t old_size = strings->table_size;
+        strings->table_size = old_size ? old_size * 2 : 1024;
+        strings->table = malloc(sizeof(uint32_t) * strings->table_size);
+        memset(strings->table, 0xff, sizeof(uint32_t) * strings->table_size);
+        for(i = 0; i < old_size; i++)
+        {
+            if(old_table[i] != NO_STRING)
+            {
+                uint32_t j = hash_string(strings->data + old_table[i]) & 
+                    (strings->table_size - 1);
+                while(strings->table[j] != NO_STRING)
+                {
+                    j = (j + 1) & (strings->table_size - 1);
+                }
+                strings->table[j] = old_table[i];
+            }
+        }
+        free(old_table);
+    }
+
+    uint32_t mask = strings->table_size - 1;
+    i = hash_string(string) & mask;
+    while(strings->table[i] != NO_STRING)
+    {
+        if(!strcmp(strings->data + strings->table[i], string))
+        {
+            return strings->table[i];
+        }
+        i = (i + 1) & mask;
+    }
+
+    strings->table[i] = append_string(strings, string);
+    strings->table_used++;
+    return strings->table[i];
+}
+
+build_posting_t *sort_postings;
+index_symbol_t *sort_symbols;
+int demangled_compare(const void *ptr1, const void *ptr2)
+{
+    index_demangled_t *item1 = (index_demangled_t*)ptr1;
+    index_demangled_t *item2 = (index_demangled_t*)ptr2;
+    return strcmp(sort_postings[sort_symbols[item1->symbol].first_posting].demangled,
+        sort_postings[sort_symbols[item2->symbol].first_posting].demangled);
+}
+
+// add the extensions the index was built with to the extensions to list
+void merge_extensions(const char *string)
+{
+    char *copy = strdup(string);
+    char *ptr = copy;
+    char *token;
+    int i;
+
+// the index has all the files
+    if(!*string)
+    {
+        total_extensions = 0;
+        free(copy);
+        return;
+    }
+
+    while((token = strsep(&ptr, " ")) != 0)
+    {
+        int found = 0;
+        for(i = 0; i < total_extensions; i++)
+        {
+            if(!strcmp(extensions[i], token))
+            {
+                found = 1;
+                break;
+            }
+        }
+
+        if(*token && !found && total_extensions < MAX_EXTENSIONS)
+        {
+            extensions[total_extensions++] = strdup(token);
+        }
+    }
+    free(copy);
+}
+
+// bring the index up to date with the files
+// queries add files to the index.  replace evicts the files without the 
+// extensions.
+// returns 1 on failure
+int update_index(vector_t *dir_files, const char *path, int replace)
+{
+    index_t old_index;
+    int have_old = !open_index(&old_index, path);
+    int i, j;
+
+    if(have_old && !replace)
+    {
+        merge_extensions(old_index.strings + old_index.header->extensions);
+    }
+    listdir(".", dir_files);
+
+// map old files to new files by path
+    int *old_to_new = 0;
+    int *changed = calloc(sizeof(int), dir_files->size);
+    int total_changed = 0;
+    int total_removed = 0;
+    if(have_old)
+    {
+        uint32_t table_size = 1024;
+        while(table_size < dir_files->size * 2)
+        {
+            table_size *= 2;
+        }
+        uint32_t mask = table_size - 1;
+        int *table = calloc(sizeof(int), table_size);
+        for(i = 0; i < dir_files->size; i++)
+        {
+            j = hash_string(dir_files->files[i].string) & mask;
+            while(table[j])
+            {
+                j = (j + 1) & mask;
+            }
+            table[j] = i + 1;
+        }
+
+        old_to_new = malloc(sizeof(int) * old_index.header->total_files);
+        for(i = 0; i < dir_files->size; i++)
+        {
+            changed[i] = 1;
+        }
+        for(i = 0; i < old_index.header->total_files; i++)
+        {
+            index_file_t *old_file = &old_index.files[i];
+            const char *old_path = old_index.strings + old_file->path;
+            int found = 0;
+            old_to_new[i] = -1;
+            j = hash_string(old_path) & mask;
+            while(table[j])
+            {
+                file_t *file = &dir_files->files[table[j] - 1];
+                if(!strcmp(file->string, old_path))
+                {
+                    found = 1;
+                    if(file->size == old_file->size &&
+                        to_ns(file->date) == old_file->mtime_ns)
+                    {
+                        old_to_new[i] = table[j] - 1;
+                        changed[table[j] - 1] = 0;
+                    }
+                    break;
+                }
+                j = (j + 1) & mask;
+            }
+
+            if(!found)
+            {
+                total_removed++;
+            }
+        }
+        free(table);
+    }
+    else
+    {
+        for(i = 0; i < dir_files->size; i++)
+        {
+            changed[i] = 1;
+        }
+    }
+
+    for(i = 0; i < dir_files->size; i++)
+    {
+        total_changed += changed[i];
+    }
+
+    if(have_old && !total_changed && !total_removed)
+    {
+        free(changed);
+        free(old_to_new);
+        close_index(&old_index);
+        return 0;
+    }
+
+// read the changed files
+    update_t update;
+    update.files = dir_files;
+    update.changed = changed;
+    update.results = calloc(sizeof(build_vector_t), dir_files->size);
+    for_each_file(dir_files, update_file, &update);
+
+    build_vector_t new_postings;
+    bzero(&new_postings, sizeof(new_postings));
+    for(i = 0; i < dir_files->size; i++)
+    {
+        build_vector_t *result = &update.results[i];
+        for(j = 0; j < result->size; j++)
+        {
+            append_posting(&new_postings, &result->postings[j]);
+        }
+        free(result->postings);
+    }
+    free(update.results);
+    qsort(new_postings.postings, 
+        new_postings.size, 
+        sizeof(build_posting_t), 
+        posting_compare);
+
+// the old postings of unchanged files are already sorted by name
+    build_vector_t old_postings;
+    bzero(&old_postings, sizeof(old_postings));
+    if(have_old)
+    {
+        for(i = 0; i < old_index.header->total_symbols; i++)
+        {
+            index_symbol_t *symbol = &old_index.symbols[i];
+            for(j = 0; j < symbol->total_postings; j++)
+            {
+                index_posting_t *old = &old_index.postings[symbol->first_posting + j];
+                if(old->file < old_index.header->total_files &&
+                    old_to_new[old->file] >= 0)
+                {
+                    build_posting_t posting;
+                    posting.name = old_index.strings + symbol->name;
+                    posting.demangled = symbol->demangled == NO_STRING ?
+                        0 : old_index.strings + symbol->demangled;
+                    posting.object = old_index.strings + old->object;
+                    posting.section = old->section == NO_STRING ? 
+                        0 : old_index.strings + old->section;
+                    posting.value = old->value;
+                    posting.object_hash = old->object_hash;
+                    posting.file = old_to_new[old->file];
+                    posting.order = j;
+                    posting.type = old->type;
+                    posting.bits = old->bits;
+                    posting.shared = old->shared;
+                    append_posting(&old_postings, &posting);
+                }
+            }
+        }
+    }
+
+// merge them
+    int total_postings = old_postings.size + new_postings.size;
+    build_posting_t *postings = malloc(sizeof(build_posting_t) * (total_postings + 1));
+    int old_i = 0;
+    int new_i = 0;
+    for(i = 0; i < total_postings; i++)
+    {
+        if(new_i >= new_postings.size ||
+            (old_i < old_postings.size &&
+            strcmp(old_postings.postings[old_i].name, 
+                new_postings.postings[new_i].name) <= 0))
+        {
+            postings[i] = old_postings.postings[old_i++];
+        }
+        else
+        {
+            postings[i] = new_postings.postings[new_i++];
+        }
+    }
+
+// build the tables
+    index_header_t header;
+    bzero(&header, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.total_files = dir_files->size;
+    header.total_postings = total_postings;
+
+    string_table_t strings;
+    bzero(&strings, sizeof(strings));
+    index_symbol_t *symbols = calloc(sizeof(index_symbol_t), total_postings + 1);
+    index_posting_t *out_postings = calloc(sizeof(index_posting_t), total_postings + 1);
+    for(i = 0; i < total_postings; )
+    {
+        int start = i;
+        while(i < total_postings && 
+            !strcmp(postings[i].name, postings[start].name))
+        {
+            i++;
+        }
+
+// postings of a symbol from old & new files are sorted by file
+        qsort(postings + start, i - start, sizeof(build_posting_t), posting_compare);
+
+        index_symbol_t *symbol = &symbols[header.total_symbols++];
+        symbol->name = append_string(&strings, postings[start].name);
+        symbol->demangled = NO_STRING;
+        symbol->first_posting = start;
+        symbol->total_postings = i - start;
+        if(postings[start].demangled)
+        {
+            header.total_demangled++;
+        }
+    }
+    header.names_size = strings.size;
+
+// demangled names, sorted & shared by symbols with the same demangled name
+    index_demangled_t *demangled = calloc(sizeof(index_demangled_t), 
+        header.total_demangled + 1);
+    j = 0;
+    for(i = 0; i < header.total_symbols; i++)
+    {
+        if(postings[symbols[i].first_posting].demangled)
+        {
+            demangled[j++].symbol = i;
+        }
+    }
+    sort_postings = postings;
+    sort_symbols = symbols;
+    qsort(demangled, header.total_demangled, sizeof(index_demangled_t), demangled_compare);
+    for(i = 0; i < header.total_demangled; i++)
+    {
+        index_symbol_t *symbol = &symbols[demangled[i].symbol];
+        const char *string = postings[symbol->first_posting].demangled;
+        if(i > 0 &&
+            !strcmp(string, postings[symbols[demangled[i - 1].symbol].first_posting].demangled))
+        {
+            symbol->demangled = demangled[i - 1].demangled;
+        }
+        else
+        {
+            symbol->demangled = append_string(&strings, string);
+        }
+        demangled[i].demangled = symbol->demangled;
+    }
+    header.demangled_end = strings.size;
+
+    for(i = 0; i < total_postings; i++)
+    {
+        index_posting_t *out = &out_postings[i];
+        out->value = postings[i].value;
+        out->object_hash = postings[i].object_hash;
+        out->file = postings[i].file;
+        out->object = get_string(&strings, postings[i].object);
+        out->section = get_string(&strings, postings[i].section);
+        out->type = postings[i].type;
+        out->bits = postings[i].bits;
+        out->shared = postings[i].shared;
+    }
+
+    char extension_list[TEXTLEN];
+    extension_list[0] = 0;
+    for(i = 0; i < total_extensions; i++)
+    {
+        if(strlen(extension_list) + strlen(extensions[i]) + 2 > TEXTLEN)
+        {
+            break;
+        }
+        if(i > 0)
+        {
+            strcat(extension_list, " ");
+        }
+        strcat(extension_list, extensions[i]);
+    }
+    header.extensions = get_string(&strings, extension_list);
+
+    index_file_t *files = calloc(sizeof(index_file_t), dir_files->size + 1);
+    for(i = 0; i < dir_files->size; i++)
+    {
+        files[i].path = get_string(&strings, dir_files->files[i].string);
+        files[i].size = dir_files->files[i].size;
+        files[i].mtime_ns = to_ns(dir_files->files[i].date);
+    }
+    header.strings_size = strings.size;
+
+// replace the index file so readers never see a partial index
+    char temp_path[TEXTLEN];
+    sprintf(temp_path, "%s.%d", path, getpid());
+    FILE *fd = fopen(temp_path, "w");
+    if(!fd)
+    {
+        printf("update_index %d: couldn't write %s\n", __LINE__, temp_path);
+        return 1;
+    }
+    fwrite(&header, sizeof(header), 1, fd);
+    fwrite(files, sizeof(index_file_t), header.total_files, fd);
+    fwrite(symbols, sizeof(index_symbol_t), header.total_symbols, fd);
+    fwrite(demangled, sizeof(index_demangled_t), header.total_demangled, fd);
+    fwrite(out_postings, sizeof(index_posting_t), header.total_postings, fd);
+    fwrite(strings.data, 1, header.strings_size, fd);
+    int error = ferror(fd);
+    if(fclose(fd) || error)
+    {
+        printf("update_index %d: couldn't write %s\n", __LINE__, temp_path);
+        unlink(temp_path);
+        return 1;
+    }
+    rename(temp_path, path);
+
+    fprintf(stderr, "update_index %d: files=%d changed=%d removed=%d symbols=%d\n",
+        __LINE__,
+        header.total_files,
+        total_changed,
+        total_removed,
+        header.total_symbols);
+
+    if(have_old)
+    {
+        close_index(&old_index);
+    }
+    free(old_to_new);
+    free(changed);
+    free(postings);
+    free(symbols);
+    free(demangled);
+    free(out_postings);
+    free(files);
+    free(strings.data);
+    free(strings.table);
+    free(old_postings.postings);
+    free(new_postings.postings);
+    return 0;
+}
+
+// the file has 1 of the extensions given on the command line
+int is_selected(const char *path)
+{
+    char string[TEXTLEN];
+    int i;
+    if(!query_extensions)
+    {
+        return 1;
+    }
+
+    for(i = 0; i < query_extensions; i++)
+    {
+        snprintf(string, TEXTLEN, "*.%s", extensions[i]);
+        if(!fnmatch(string, get_filename((char*)path), 0))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// the symbol has a posting which is printed
+int has_selected(index_t *index, index_symbol_t *symbol)
+{
+    int i;
+    for(i = 0; i < symbol->total_postings; i++)
+    {
+        index_posting_t *posting = &index->postings[symbol->first_posting + i];
+        if(is_reported(posting->type) &&
+            is_selected(index->strings + index->files[posting->file].path))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void print_index_symbol(index_t *index, index_symbol_t *symbol)
+{
+    int demangled = match_mode == MATCH_DEMANGLED || match_mode == MATCH_FUZZY;
+    int i;
+    for(i = 0; i < symbol->total_postings; i++)
+    {
+        index_posting_t *posting = &index->postings[symbol->first_posting + i];
+        if(is_reported(posting->type) &&
+            is_selected(index->strings + index->files[posting->file].path))
+        {
+            symbol_t result;
+            result.object = index->strings + posting->object;
+            result.name = index->strings + symbol->name;
+            if(demangled && symbol->demangled != NO_STRING)
+            {
+                result.name = index->strings + symbol->demangled;
+            }
+            result.type = posting->type;
+            result.section = posting->section == NO_STRING ? 
+                0 : index->strings + posting->section;
+            result.value = posting->value;
+            result.bits = posting->bits;
+            result.shared = posting->shared;
+            print_symbol(stdout, &result);
+        }
+    }
+}
+
+// 1st symbol >= the string
+int lower_bound(index_t *index, const char *string)
+{
+    int low = 0;
+    int high = index->header->total_symbols;
+    while(low < high)
+    {
+        int middle = (low + high) / 2;
+        if(strcmp(index->strings + index->symbols[middle].name, string) < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// symbol whose name contains the string offset
+int symbol_at(index_t *index, uint32_t offset)
+{
+    int low = 0;
+    int high = index->header->total_symbols - 1;
+    while(low < high)
+    {
+        int middle = (low + high + 1) / 2;
+        if(index->symbols[middle].name <= offset)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+// 1st demangled entry with the string offset
+int demangled_at(index_t *index, uint32_t offset)
+{
+    int low = 0;
+    int high = index->header->total_demangled;
+    while(low < high)
+    {
+        int middle = (low + high) / 2;
+        if(index->demangled[middle].demangled < offset)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+int is_boundary(char c)
+{
+    return !isalnum(c);
+}
+
+// rank a subsequence match.  Consecutive characters & characters at the 
+// start of words score higher.  Returns -1 if it doesn't match.
+int fuzzy_score(const char *text, const char *query, int ignore_case)
+{
+    int score = 0;
+    int run = 0;
+    int last = -1;
+    int i = 0;
+    while(*query)
+    {
+        char q = ignore_case ? tolower(*query) : *query;
+        while(text[i] && (ignore_case ? tolower(text[i]) : text[i]) != q)
+        {
+            i++;
+        }
+        if(!text[i])
+        {
+            return -1;
+        }
+
+        if(i == last + 1)
+        {
+            run++;
+            score += run * 4;
+        }
+        else
+        {
+            run = 0;
+            score -= i - last - 1 < 10 ? i - last - 1 : 10;
+        }
+
+        if(i == 0 || is_boundary(text[i - 1]))
+        {
+            score += 8;
+        }
+
+        last = i;
+        i++;
+        query++;
+    }
+
+// prefer shorter names
+    return score * 64 - strlen(text);
+}
+
+typedef struct
+{
+    int symbol;
+    int score;
+} fuzzy_t;
+
+int fuzzy_compare(const void *ptr1, const void *ptr2)
+{
+    fuzzy_t *item1 = (fuzzy_t*)ptr1;
+    fuzzy_t *item2 = (fuzzy_t*)ptr2;
+    if(item1->score != item2->score)
+    {
+        return item2->score - item1->score;
+    }
+    return item1->symbol - item2->symbol;
+}
+
+void fuzzy_search(index_t *index, char *query)
+{
+    int i;
+    int ignore_case = 1;
+    for(i = 0; query[i]; i++)
+    {
+        if(isupper(query[i]))
+        {
+            ignore_case = 0;
+        }
+    }
+
+    int total = 0;
+    int allocated = 1024;
+    fuzzy_t *results = malloc(sizeof(fuzzy_t) * allocated);
+    for(i = 0; i < index->header->total_symbols; i++)
+    {
+        index_symbol_t *symbol = &index->symbols[i];
+        const char *text = index->strings + 
+            (symbol->demangled != NO_STRING ? symbol->demangled : symbol->name);
+        int score = fuzzy_score(text, query, ignore_case);
+        if(score != -1 && has_selected(index, symbol))
+        {
+            if(total >= allocated)
+            {
+                allocated *= 2;
+                results = realloc(results, sizeof(fuzzy_t) * allocated);
+            }
+            results[total].symbol = i;
+            results[total].score = score;
+            total++;
+        }
+    }
+
+    qsort(results, total, sizeof(fuzzy_t), fuzzy_compare);
+    for(i = 0; i < total && i < FUZZY_RESULTS; i++)
+    {
+        print_index_symbol(index, &index->symbols[results[i].symbol]);
+    }
+    free(results);
+}
+
+void search_index(index_t *index, char *symbol)
+{
+    int i;
+    int len = strlen(symbol);
+    if(!index->header->total_symbols)
+    {
+        return;
+    }
+
+    if(match_mode == MATCH_FUZZY)
+    {
+        fuzzy_search(index, symbol);
+    }
+    else
+    if(match_mode == MATCH_DEMANGLED)
+    {
+// scan the block of demangled names
+        const char *strings = index->strings;
+        const char *end = strings + index->header->demangled_end;
+        const char *ptr = strings + index->header->names_size;
+        while(ptr < end &&
+            (ptr = memmem(ptr, end - ptr, symbol, len)) != 0)
+        {
+            i = demangled_at(index, ptr - strings);
+            if(i > 0 && (i >= index->header->total_demangled ||
+                index->demangled[i].demangled > ptr - strings))
+            {
+                i--;
+            }
+            uint32_t offset = index->demangled[i].demangled;
+            while(i > 0 && index->demangled[i - 1].demangled == offset)
+            {
+                i--;
+            }
+            for( ; 
+                i < index->header->total_demangled && 
+                    index->demangled[i].demangled == offset; 
+                i++)
+            {
+                print_index_symbol(index, &index->symbols[index->demangled[i].symbol]);
+            }
+            ptr = strings + offset;
+            ptr += strlen(ptr) + 1;
+        }
+
+// C names are their own demangled names
+        ptr = strings;
+        end = strings + index->header->names_size;
+        while(ptr < end &&
+            (ptr = memmem(ptr, end - ptr, symbol, len)) != 0)
+        {
+            i = symbol_at(index, ptr - strings);
+            if(index->symbols[i].demangled == NO_STRING)
+            {
+                print_index_symbol(index, &index->symbols[i]);
+            }
+            ptr = strings + index->symbols[i].name;
+            ptr += strlen(ptr) + 1;
+        }
+    }
+    else
+    if(match_mode == MATCH_SUBSTRING)
+    {
+// scan the block of names
+        const char *names = index->strings;
+        const char *end = names + index->header->names_size;
+        const char *ptr = names;
+        while(ptr < end &&
+            (ptr = memmem(ptr, end - ptr, symbol, len)) != 0)
+        {
+            i = symbol_at(index, ptr - names);
+            print_index_symbol(index, &index->symbols[i]);
+// skip to the next name
+            ptr = names + index->symbols[i].name;
+            ptr += strlen(ptr) + 1;
+        }
+    }
+    else
+    {
+        for(i = lower_bound(index, symbol); 
+            i < index->header->total_symbols; 
+            i++)
+        {
+            if(!match_name(index->strings + index->symbols[i].name, symbol))
+            {
+                break;
+            }
+            print_index_symbol(index, &index->symbols[i]);
+        }
+    }
+}
+
+// link report:
+// every undefined symbol in the index is resolved against the objects which
+// define it.
+typedef struct
+{
+// index of the library needing the symbol & the library defining it
+    uint32_t from;
+    uint32_t to;
+    int count;
+} edge_t;
+
+typedef struct
+{
+    edge_t *edges;
+    int size;
+    int table_size;
+} edge_table_t;
+
+uint64_t hash_edge(uint32_t from, uint32_t to)
+{
+    uint64_t h = ((uint64_t)from << 32) | to;
+    h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdULL;
+    h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+void add_edge(edge_table_t *table, uint32_t from, uint32_t to)
+{
+    int i;
+    if((table->size + 1) * 2 > table->table_size)
+    {
+        edge_t *old_edges = table->edges;
+        int old_size = table->table_size;
+        table->table_size = old_size ? old_size * 2 : 1024;
+        table->edges = calloc(sizeof(edge_t), table->table_size);
+        table->size = 0;
+        for(i = 0; i < old_size; i++)
+        {
+            if(old_edges[i].count)
+            {
+                int j = hash_edge(old_edges[i].from, old_edges[i].to) & 
+                    (table->table_size - 1);
+                while(table->edges[j].count)
+                {
+                    j = (j + 1) & (table->table_size - 1);
+                }
+                table->edges[j] = old_edges[i];
+                table->size++;
+            }
+        }
+        free(old_edges);
+    }
+
+    int mask = table->table_size - 1;
+    i = hash_edge(from, to) & mask;
+    while(table->edges[i].count)
+    {
+        if(table->edges[i].from == from && table->edges[i].to == to)
+        {
+            table->edges[i].count++;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    table->edges[i].from = from;
+    table->edges[i].to = to;
+    table->edges[i].count = 1;
+    table->size++;
+}
+
+index_t *edge_index;
+int edge_compare(const void *ptr1, const void *ptr2)
+{
+    edge_t *item1 = (edge_t*)ptr1;
+    edge_t *item2 = (edge_t*)ptr2;
+    int result = strcmp(edge_index->strings + edge_index->files[item1->from].path,
+        edge_index->strings + edge_index->files[item2->from].path);
+    if(result)
+    {
+        return result;
+    }
+    return item2->count - item1->count;
+}
+
+// defined & visible to other objects
+int is_global_definition(char type)
+{
+    return type != 'U' && type != 'w' && type != 'N' &&
+        (isupper(type) || type == 'i' || type == 'u');
+}
+
+// a 2nd definition is a link error
+int is_strong_definition(char type)
+{
+    return is_global_definition(type) &&
+        type != 'W' && type != 'V' && type != 'C';
+}
+
+// an object in a library
+int in_library(index_t *index, index_posting_t *posting)
+{
+    return posting->shared || 
+        posting->object != index->files[posting->file].path;
+}
+
+// the object's file name, without the path or the library
+const char* member_name(const char *object, int *len)
+{
+    int object_len = strlen(object);
+    const char *ptr;
+    if(object_len > 0 && object[object_len - 1] == ')' &&
+        (ptr = strrchr(object, '(')) != 0)
+    {
+        *len = object + object_len - 1 - (ptr + 1);
+        return ptr + 1;
+    }
+
+    ptr = get_filename((char*)object);
+    *len = object + object_len - ptr;
+    return ptr;
+}
+
+// copies of a relocatable object, like foo.o & libfoo.a(foo.o)
+int same_object(index_t *index, index_posting_t *posting1, index_posting_t *posting2)
+{
+    int len1, len2;
+    if(!posting1->object_hash || posting1->object_hash != posting2->object_hash)
+    {
+        return 0;
+    }
+
+    const char *name1 = member_name(index->strings + posting1->object, &len1);
+    const char *name2 = member_name(index->strings + posting2->object, &len2);
+    return len1 == len2 && !memcmp(name1, name2, len1);
+}
+
+// a strong definition in a relocatable object which isn't a copy of an 
+// earlier definition
+int is_duplicate_candidate(index_t *index, index_posting_t *postings, int j)
+{
+    int k;
+    if(postings[j].shared || !is_strong_definition(postings[j].type))
+    {
+        return 0;
+    }
+
+    for(k = 0; k < j; k++)
+    {
+        if(!postings[k].shared && 
+            is_strong_definition(postings[k].type) &&
+            same_object(index, &postings[k], &postings[j]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void link_report(index_t *index, int verbose)
+{
+    int i, j, k;
+    int total_unresolved = 0;
+    int total_duplicates = 0;
+    edge_table_t edges;
+    bzero(&edges, sizeof(edges));
+
+    printf("Unresolved symbols:\n");
+    for(i = 0; i < index->header->total_symbols; i++)
+    {
+        index_symbol_t *symbol = &index->symbols[i];
+        index_posting_t *postings = &index->postings[symbol->first_posting];
+        const char *name = index->strings + symbol->name;
+        int defined = 0;
+        int total_users = 0;
+        for(j = 0; j < symbol->total_postings; j++)
+        {
+            if(is_global_definition(postings[j].type))
+            {
+                defined = 1;
+                break;
+            }
+        }
+
+        for(j = 0; j < symbol->total_postings; j++)
+        {
+            index_posting_t *user = &postings[j];
+            if(user->type != 'U')
+            {
+                continue;
+            }
+
+            if(!defined)
+            {
+                if(!total_users)
+                {
+                    printf("    %s needed by", name);
+                    total_unresolved++;
+                }
+                printf(" %s", index->strings + user->object);
+                total_users++;
+                continue;
+            }
+
+// library dependencies.  The linker resolves it inside the user's own
+// library if that defines it.
+            int local = 0;
+            for(k = 0; k < symbol->total_postings; k++)
+            {
+                if(is_global_definition(postings[k].type) &&
+                    postings[k].file == user->file)
+                {
+                    local = 1;
+                    break;
+                }
+            }
+
+            for(k = 0; k < symbol->total_postings && !local; k++)
+            {
+                index_posting_t *definer = &postings[k];
+                if(is_global_definition(definer->type))
+                {
+                    if(in_library(index, user) &&
+                        in_library(index, definer) &&
+                        user->file != definer->file)
+                    {
+                        add_edge(&edges, user->file, definer->file);
+                    }
+                }
+            }
+        }
+
+        if(total_users)
+        {
+            printf("\n");
+        }
+    }
+
+// copies of an object count once
+    printf("\nDuplicate strong definitions in relocatable objects:\n");
+    for(i = 0; i < index->header->total_symbols; i++)
+    {
+        index_symbol_t *symbol = &index->symbols[i];
+        index_posting_t *postings = &index->postings[symbol->first_posting];
+        int total = 0;
+        for(j = 0; j < symbol->total_postings; j++)
+        {
+            total += is_duplicate_candidate(index, postings, j);
+        }
+
+        if(total > 1)
+        {
+            printf("    %s defined by", index->strings + symbol->name);
+            for(j = 0; j < symbol->total_postings; j++)
+            {
+                if(is_duplicate_candidate(index, postings, j))
+                {
+                    printf(" %s", index->strings + postings[j].object);
+                }
+            }
+            printf("\n");
+            total_duplicates++;
+        }
+    }
+
+    printf("\nLibrary dependencies:\n");
+    edge_t *sorted = calloc(sizeof(edge_t), edges.size + 1);
+    int total_edges = 0;
+    for(i = 0; i < edges.table_size; i++)
+    {
+        if(edges.edges[i].count)
+        {
+            sorted[total_edges++] = edges.edges[i];
+        }
+    }
+    edge_index = index;
+    qsort(sorted, total_edges, sizeof(edge_t), edge_compare);
+    for(i = 0; i < total_edges; i++)
+    {
+        printf("    %s -> %s (%d symbols)\n",
+            index->strings + index->files[sorted[i].from].path,
+            index->strings + index->files[sorted[i].to].path,
+            sorted[i].count);
+    }
+
+    if(verbose)
+    {
+        printf("\nResolved symbols:\n");
+        for(i = 0; i < index->header->total_symbols; i++)
+        {
+            index_symbol_t *symbol = &index->symbols[i];
+            index_posting_t *postings = &index->postings[symbol->first_posting];
+            for(j = 0; j < symbol->total_postings; j++)
+            {
+                if(postings[j].type != 'U')
+                {
+                    continue;
+                }
+                for(k = 0; k < symbol->total_postings; k++)
+                {
+                    if(is_global_definition(postings[k].type))
+                    {
+                        printf("    %s: %s from %s\n",
+                            index->strings + postings[j].object,
+                            index->strings + symbol->name,
+                            index->strings + postings[k].object);
+                    }
+                }
+            }
+        }
+    }
+
+    printf("\nunresolved=%d duplicates=%d library dependencies=%d\n",
+        total_unresolved,
+        total_duplicates,
+        total_edges);
+    free(sorted);
+    free(edges.edges);
+}
+
+void main(int argc, char *argv[])
+{
+    if(argc < 2)
+    {
+        printf("Usage: symbol [options] <the symbol> [file extension] [file extension]\n");
+        printf(" -p match names starting with the symbol\n");
+        printf(" -s match names containing the symbol\n");
+        printf(" -d match demangled C++ names containing the symbol\n");
+        printf(" -f fuzzy match the demangled names.  Prints the best %d.\n", FUZZY_RESULTS);
+        printf(" -n query the index without updating it.  No extensions needed.\n");
+        printf(" -u only update the index.  No symbol is given.  Files without the\n");
+        printf("    extensions are removed from the index.\n");
+        printf(" -I don't use the index.  Scan all the files.  Not with -f.\n");
+        printf(" -l report unresolved symbols, duplicate definitions & library\n");
+        printf("    dependencies for all the files.  No symbol is given.\n");
+        printf(" -v with -l, also print where every undefined symbol is defined\n");
+        printf("A query adds the files with the extensions to the index & only prints\n");
+        printf("those files.  The files indexed with other extensions are kept.\n");
+        printf("Example: symbol timer_create o a so ko\n");
+        printf("Example: symbol -u o a so ko\n");
+        printf("Example: symbol -l o a so\n");
+        printf("Example: symbol -d Foo::bar o a so\n");
+        return;
+    }
+
+    vector_t dir_files;
+    bzero(&dir_files, sizeof(vector_t));
+
+    int i;
+    char *symbol = 0;
+    int use_index = 1;
+    int update = 1;
+    int update_only = 0;
+    int report = 0;
+    int verbose = 0;
+    int argument = 0;
+    for(i = 1; i < argc; i++)
+    {
+        if(!strcmp(argv[i], "-p"))
+        {
+            match_mode = MATCH_PREFIX;
+        }
+        else
+        if(!strcmp(argv[i], "-s"))
+        {
+            match_mode = MATCH_SUBSTRING;
+        }
+        else
+        if(!strcmp(argv[i], "-d"))
+        {
+            match_mode = MATCH_DEMANGLED;
+        }
+        else
+        if(!strcmp(argv[i], "-f"))
+        {
+            match_mode = MATCH_FUZZY;
+        }
+        else
+        if(!strcmp(argv[i], "-I"))
+        {
+            use_index = 0;
+        }
+        else
+        if(!strcmp(argv[i], "-n"))
+        {
+            update = 0;
+        }
+        else
+        if(!strcmp(argv[i], "-u"))
+        {
+            update_only = 1;
+        }
+        else
+        if(!strcmp(argv[i], "-l"))
+        {
+            report = 1;
+        }
+        else
+        if(!strcmp(argv[i], "-v"))
+        {
+            verbose = 1;
+        }
+        else
+        if(argument == 0 && !update_only && !report)
+        {
+            symbol = argv[i];
+            argument++;
+        }
+        else
+        if(total_extensions < MAX_EXTENSIONS)
+        {
+            extensions[total_extensions++] = argv[i];
+        }
+    }
+
+//printf("symbol=%s\n", symbol);
+
+    if(!use_index && match_mode == MATCH_FUZZY)
+    {
+        printf("main %d: -f needs the index\n", __LINE__);
+        return;
+    }
+
+    if(!use_index && !report)
+    {
+        listdir(".", &dir_files);
+        if(symbol)
+        {
+            search_files(&dir_files, symbol);
+        }
+        return;
+    }
+
+    if(!update_only)
+    {
+        query_extensions = total_extensions;
+    }
+
+    if(update || update_only)
+    {
+        update_index(&dir_files, INDEX_PATH, update_only);
+    }
+
+    if(symbol || report)
+    {
+        index_t index;
+        if(open_index(&index, INDEX_PATH))
+        {
+            printf("main %d: no index in the current directory\n", __LINE__);
+            return;
+        }
+        if(report)
+        {
+            link_report(&index, verbose);
+        }
+        else
+        {
+            search_index(&index, symbol);
+        }
+        close_index(&index);
+    }
+}